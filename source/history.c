@@ -0,0 +1,361 @@
+#define _GNU_SOURCE     // for memmem()
+#include "history.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// one distinct command; its text is packed into the string arena
+typedef struct {
+    const char *s;
+    uint32_t    len;
+    uint32_t    last;   // most recent entry holding this command
+} hist_cmd_t;
+
+// dedup hash set slot; the stored hash avoids touching the text on a miss
+typedef struct {
+    uint32_t id;        // command id + 1, 0 marks an empty slot
+    uint32_t hash;
+} cmd_slot_t;
+
+// posting list of command ids that contain one trigram, ascending
+typedef struct {
+    uint32_t  key;      // trigram + 1, 0 marks an empty slot
+    uint32_t  n, cap;
+    uint32_t *ids;
+} tri_list_t;
+
+static struct {
+    int         fd;             // history file opened O_APPEND, -1 if none
+    void       *map;            // the file while it is being loaded
+    size_t      map_len;
+
+    uint32_t   *ent;            // entry -> command id, grows without a cap
+    size_t      n, cap;
+
+    hist_cmd_t *cmd;            // distinct commands
+    size_t      ncmd, cmd_cap;
+    cmd_slot_t *slots;          // hash set of command ids for dedup
+    size_t      slot_cap;
+    char       *arena;          // current block of packed command text
+    size_t      arena_used, arena_cap;
+
+    tri_list_t *tri;            // trigram -> posting list
+    size_t      tri_count, tri_cap;
+    size_t      indexed;        // commands [0, indexed) are in the index
+
+    uint32_t   *mark;           // mark[id] == gen when id matched the query
+    size_t      mark_cap;
+    uint32_t    gen;
+    uint32_t   *hits;           // the ids that matched, for the fast path
+    size_t      nhits, hits_cap;
+    char       *query;          // query the marks belong to
+    size_t      query_ncmd;     // ...and how many commands existed then
+} H = { .fd = -1 };
+
+/* word-at-a-time multiplicative hash; loading a big history is mostly this */
+static uint32_t hash_bytes(const char *s, size_t len) {
+    uint64_t h = 0x9E3779B97F4A7C15ull ^ len;
+    while (len >= 8) {
+        uint64_t w;
+        memcpy(&w, s, 8);
+        h = (h ^ w) * 0xFF51AFD7ED558CCDull;
+        h ^= h >> 32;
+        s += 8;
+        len -= 8;
+    }
+    uint64_t w = 0;
+    memcpy(&w, s, len);
+    h = (h ^ w) * 0xC4CEB9FE1A85EC53ull;
+    return (uint32_t)(h ^ (h >> 29));
+}
+
+static void *grow(void *p, size_t *cap, size_t need, size_t size) {
+    if (need <= *cap) return p;
+    size_t c = *cap ? *cap : 64;
+    while (c < need) c *= 2;
+    p = realloc(p, c * size);
+    if (!p) { perror("history"); exit(EXIT_FAILURE); }
+    *cap = c;
+    return p;
+}
+
+/* slot for the command s/len: either the one holding it or an empty slot */
+static cmd_slot_t *cmd_slot(const char *s, size_t len, uint32_t hash) {
+    size_t mask = H.slot_cap - 1;
+    for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+        cmd_slot_t *slot = &H.slots[i];
+        if (slot->id == 0) return slot;
+        if (slot->hash != hash) continue;
+        hist_cmd_t *c = &H.cmd[slot->id - 1];
+        if (c->len == len && memcmp(c->s, s, len) == 0) return slot;
+    }
+}
+
+static void rehash_cmds(void) {
+    cmd_slot_t *old = H.slots;
+    size_t old_cap = H.slot_cap;
+    H.slot_cap = old_cap ? old_cap * 2 : 1024;
+    H.slots = calloc(H.slot_cap, sizeof(cmd_slot_t));
+    for (size_t i = 0; i < old_cap; i++) {
+        if (old[i].id == 0) continue;
+        size_t mask = H.slot_cap - 1, j = old[i].hash & mask;
+        while (H.slots[j].id) j = (j + 1) & mask;
+        H.slots[j] = old[i];
+    }
+    free(old);
+}
+
+/*
+ Distinct commands are copied into big arena blocks. Duplicates then compare
+ against text that sits close together and stays in cache, instead of
+ against their first occurrence somewhere in the mapped file.
+*/
+#define ARENA_BLOCK (1 << 20)
+
+static const char *arena_copy(const char *s, size_t len) {
+    if (H.arena_used + len > H.arena_cap) {
+        H.arena_cap = len > ARENA_BLOCK ? len : ARENA_BLOCK;
+        H.arena = malloc(H.arena_cap);   // old blocks stay alive for their strings
+        if (!H.arena) { perror("history"); exit(EXIT_FAILURE); }
+        H.arena_used = 0;
+    }
+    char *p = H.arena + H.arena_used;
+    memcpy(p, s, len);
+    H.arena_used += len;
+    return p;
+}
+
+/* append an entry, deduplicating its text against the known commands */
+static void add_entry(const char *s, size_t len) {
+    if ((H.ncmd + 1) * 2 > H.slot_cap) rehash_cmds();
+
+    uint32_t hash = hash_bytes(s, len);
+    cmd_slot_t *slot = cmd_slot(s, len, hash);
+    if (slot->id == 0) {
+        H.cmd = grow(H.cmd, &H.cmd_cap, H.ncmd + 1, sizeof(hist_cmd_t));
+        H.cmd[H.ncmd].s = arena_copy(s, len);
+        H.cmd[H.ncmd].len = len;
+        slot->id = ++H.ncmd;
+        slot->hash = hash;
+    }
+    H.ent = grow(H.ent, &H.cap, H.n + 1, sizeof(uint32_t));
+    H.ent[H.n] = slot->id - 1;
+    H.cmd[slot->id - 1].last = H.n;
+    H.n++;
+}
+
+int history_open(const char *path) {
+    int fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) return -1;
+    H.fd = fd;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) return 0;
+
+    H.map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    if (H.map == MAP_FAILED) { H.map = NULL; return -1; }
+    H.map_len = st.st_size;
+
+    const char *p = H.map, *end = p + H.map_len;
+    while (p < end) {
+        const char *nl = memchr(p, '\n', end - p);
+        if (!nl) nl = end;      // a torn last line still counts
+        if (nl > p) add_entry(p, nl - p);
+        p = nl + 1;
+    }
+    // every distinct command now lives in the arena
+    munmap(H.map, H.map_len);
+    H.map = NULL;
+    return 0;
+}
+
+void history_add(const char *line) {
+    size_t len = strlen(line);
+    if (len == 0) return;
+    add_entry(line, len);
+
+    if (H.fd >= 0) {
+        // one write per entry: O_APPEND keeps concurrent sessions from interleaving
+        char stackbuf[1024];
+        char *buf = len + 1 <= sizeof(stackbuf) ? stackbuf : malloc(len + 1);
+        memcpy(buf, line, len);
+        buf[len] = '\n';
+        if (write(H.fd, buf, len + 1) < 0) perror("history");
+        if (buf != stackbuf) free(buf);
+    }
+}
+
+size_t history_size(void) {
+    return H.n;
+}
+
+const char *history_get(size_t i, size_t *len) {
+    hist_cmd_t *c = &H.cmd[H.ent[i]];
+    *len = c->len;
+    return c->s;
+}
+
+static uint32_t trigram(const char *s) {
+    return ((uint32_t)(unsigned char)s[0] << 16) |
+           ((uint32_t)(unsigned char)s[1] << 8) | (unsigned char)s[2];
+}
+
+static tri_list_t *tri_slot(uint32_t tri) {
+    size_t mask = H.tri_cap - 1;
+    uint32_t key = tri + 1;
+    for (size_t i = (key * 2654435761u) & mask; ; i = (i + 1) & mask) {
+        if (H.tri[i].key == key || H.tri[i].key == 0) return &H.tri[i];
+    }
+}
+
+static int cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* add the commands recorded since the last search to the trigram index */
+static void index_update(void) {
+    uint32_t *tris = NULL;
+    size_t tris_cap = 0;
+
+    for (; H.indexed < H.ncmd; H.indexed++) {
+        hist_cmd_t *c = &H.cmd[H.indexed];
+        if (c->len < 3) continue;
+
+        // distinct trigrams of this command
+        size_t nt = c->len - 2, k = 0;
+        tris = grow(tris, &tris_cap, nt, sizeof(uint32_t));
+        for (size_t i = 0; i < nt; i++) tris[i] = trigram(c->s + i);
+        qsort(tris, nt, sizeof(uint32_t), cmp_u32);
+        for (size_t i = 0; i < nt; i++) {
+            if (i > 0 && tris[i] == tris[i - 1]) continue;
+            tris[k++] = tris[i];
+        }
+
+        for (size_t i = 0; i < k; i++) {
+            if ((H.tri_count + 1) * 2 > H.tri_cap) {
+                tri_list_t *old = H.tri;
+                size_t old_cap = H.tri_cap;
+                H.tri_cap = old_cap ? old_cap * 2 : 4096;
+                H.tri = calloc(H.tri_cap, sizeof(tri_list_t));
+                for (size_t j = 0; j < old_cap; j++) {
+                    if (old[j].key) *tri_slot(old[j].key - 1) = old[j];
+                }
+                free(old);
+            }
+            tri_list_t *t = tri_slot(tris[i]);
+            if (t->key == 0) { t->key = tris[i] + 1; H.tri_count++; }
+            if (t->n == t->cap) {
+                t->cap = t->cap ? t->cap * 2 : 4;
+                t->ids = realloc(t->ids, t->cap * sizeof(uint32_t));
+            }
+            t->ids[t->n++] = H.indexed;    // ids arrive in ascending order
+        }
+    }
+    free(tris);
+}
+
+static int list_has(const tri_list_t *t, uint32_t id) {
+    size_t lo = 0, hi = t->n;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (t->ids[mid] < id) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < t->n && t->ids[lo] == id;
+}
+
+static void mark(uint32_t id) {
+    H.mark[id] = H.gen;
+    H.hits = grow(H.hits, &H.hits_cap, H.nhits + 1, sizeof(uint32_t));
+    H.hits[H.nhits++] = id;
+}
+
+/* mark every distinct command containing query; reused while query is unchanged */
+static void mark_matches(const char *query) {
+    size_t qlen = strlen(query);
+    if (H.query && H.query_ncmd == H.ncmd && strcmp(H.query, query) == 0) return;
+    free(H.query);
+    H.query = strdup(query);
+    H.query_ncmd = H.ncmd;
+
+    if (H.mark_cap < H.ncmd) {
+        H.mark = grow(H.mark, &H.mark_cap, H.ncmd, sizeof(uint32_t));
+        memset(H.mark, 0, H.mark_cap * sizeof(uint32_t));
+        H.gen = 0;
+    }
+    if (++H.gen == 0) {
+        memset(H.mark, 0, H.mark_cap * sizeof(uint32_t));
+        H.gen = 1;
+    }
+    H.nhits = 0;
+
+    if (qlen < 3) {
+        // too short for trigrams: check the distinct commands directly
+        for (size_t id = 0; id < H.ncmd; id++) {
+            if (memmem(H.cmd[id].s, H.cmd[id].len, query, qlen)) mark(id);
+        }
+        return;
+    }
+
+    index_update();
+    if (H.tri_cap == 0) return;
+
+    // intersect the posting lists, starting from the shortest one
+    size_t nt = qlen - 2;
+    tri_list_t **lists = malloc(nt * sizeof(tri_list_t *));
+    size_t best = 0;
+    for (size_t i = 0; i < nt; i++) {
+        lists[i] = tri_slot(trigram(query + i));
+        if (lists[i]->key == 0) { free(lists); return; }
+        if (lists[i]->n < lists[best]->n) best = i;
+    }
+    for (size_t j = 0; j < lists[best]->n; j++) {
+        uint32_t id = lists[best]->ids[j];
+        size_t i;
+        for (i = 0; i < nt; i++) {
+            if (i != best && !list_has(lists[i], id)) break;
+        }
+        // trigrams can match out of order, so confirm the substring
+        if (i == nt && memmem(H.cmd[id].s, H.cmd[id].len, query, qlen)) mark(id);
+    }
+    free(lists);
+}
+
+long history_search(const char *query, long before) {
+    if (before > (long)H.n) before = H.n;
+    if (before <= 0) return -1;
+    mark_matches(query);
+
+    // fast path: the latest occurrence of each matching command
+    long best = -1;
+    int need_scan = 0;
+    for (size_t j = 0; j < H.nhits; j++) {
+        long last = H.cmd[H.hits[j]].last;
+        if (last < before) { if (last > best) best = last; }
+        else need_scan = 1;
+    }
+    if (!need_scan) return best;
+
+    // a match also occurs later; an older copy may sit between best and before
+    for (long i = before - 1; i > best; i--) {
+        if (H.mark[H.ent[i]] == H.gen) return i;
+    }
+    return best;
+}
+
+void history_each_match(const char *query, void (*fn)(size_t i, const char *s, size_t len)) {
+    mark_matches(query);
+    if (H.nhits == 0) return;
+    for (size_t i = 0; i < H.n; i++) {
+        if (H.mark[H.ent[i]] == H.gen) {
+            hist_cmd_t *c = &H.cmd[H.ent[i]];
+            fn(i, c->s, c->len);
+        }
+    }
+}
@@ -0,0 +1,40 @@
+#ifndef CSESHELL_HISTORY_H
+#define CSESHELL_HISTORY_H
+
+#include <stddef.h>
+
+/*
+ Persistent command history.
+
+ The history file is append-only: every new command is added with a single
+ O_APPEND write, so several shell sessions can share one file without
+ rewriting it. At startup the file is mmap'ed and the entries point straight
+ into the mapping. There is no cap on the number of entries.
+
+ Identical commands are stored once; a trigram index over the distinct
+ commands (built on the first search) keeps substring lookups fast even
+ with millions of entries.
+*/
+
+// load the history file at path (created if missing) and keep it open for appends
+int history_open(const char *path);
+
+// record a command in memory and append it to the history file
+void history_add(const char *line);
+
+// number of entries, oldest first
+size_t history_size(void);
+
+// entry i (0 = oldest); the text is not NUL terminated, its length goes to *len
+const char *history_get(size_t i, size_t *len);
+
+/*
+ Index of the most recent entry before entry `before` that contains query,
+ or -1 if there is none. Pass history_size() to search from the newest.
+*/
+long history_search(const char *query, long before);
+
+// call fn for every entry containing query, oldest first
+void history_each_match(const char *query, void (*fn)(size_t i, const char *s, size_t len));
+
+#endif
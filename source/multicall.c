@@ -0,0 +1,97 @@
+#define _GNU_SOURCE
+#include "multicall.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <dirent.h>
+
+#define FD_TRACKED 1024
+
+static struct {
+    int       active;    // a program is running; exit() jumps back
+    pthread_t thread;    // only its own thread may jump
+    jmp_buf   jb;
+    int       status;
+} MC;
+
+// the descriptors below FD_TRACKED that are open now, as a bitmap; -1 if /proc cannot tell
+static int open_fds(unsigned char *set) {
+    memset(set, 0, FD_TRACKED / 8);
+    DIR *d = opendir("/proc/self/fd");
+    if (!d) return -1;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        int fd = atoi(e->d_name);
+        if (e->d_name[0] != '.' && fd < FD_TRACKED && fd != dirfd(d)) set[fd / 8] |= 1 << fd % 8;
+    }
+    closedir(d);
+    return 0;
+}
+
+int multicall_run(int (*main_fn)(int, char **), char **argv, int out_fd) {
+    int argc = 0;
+    while (argv[argc]) argc++;
+
+    // getopt permutes argv and programs may write to it: give them a copy
+    char **copy = malloc((argc + 1) * sizeof(char *));
+    char **orig = malloc((argc + 1) * sizeof(char *));
+    if (!copy || !orig) {
+        free(copy);
+        free(orig);
+        perror("cseshell");
+        return 126;
+    }
+    for (int i = 0; i < argc; i++) copy[i] = orig[i] = strdup(argv[i]);
+    copy[argc] = orig[argc] = NULL;
+
+    fflush(stdout);
+    int saved = -1;
+    if (out_fd >= 0 && out_fd != STDOUT_FILENO) {
+        saved = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+        dup2(out_fd, STDOUT_FILENO);
+    }
+
+    // a program that exit()s early skips its own cleanup: its descriptors are closed for it
+    unsigned char before[FD_TRACKED / 8];
+    int tracked = open_fds(before) == 0;
+
+    optind = 0;   // 0, not 1: also drops glibc's position inside a "-abc" cluster
+    opterr = 1;
+    MC.active = 1;
+    MC.thread = pthread_self();
+    int status;
+    if (setjmp(MC.jb) == 0) {
+        status = main_fn(argc, copy);
+    } else {
+        status = MC.status;
+        unsigned char after[FD_TRACKED / 8];
+        if (tracked && open_fds(after) == 0)
+            for (int fd = 0; fd < FD_TRACKED; fd++)
+                if (after[fd / 8] & ~before[fd / 8] & 1 << fd % 8) close(fd);
+    }
+    MC.active = 0;
+
+    fflush(stdout);
+    fflush(stderr);
+    if (saved >= 0) {
+        dup2(saved, STDOUT_FILENO);
+        close(saved);
+    }
+    for (int i = 0; i < argc; i++) free(orig[i]);
+    free(orig);
+    free(copy);
+    return status & 0xFF;
+}
+
+void sysprog_exit(int status) {
+    if (MC.active && pthread_equal(pthread_self(), MC.thread)) {
+        MC.status = status;
+        longjmp(MC.jb, 1);
+    }
+    exit(status);   // a worker thread, or a forked child: really exit
+}
@@ -0,0 +1,29 @@
+#ifndef CSESHELL_MULTICALL_H
+#define CSESHELL_MULTICALL_H
+
+/*
+ System programs run inside the shell process.
+
+ The makefile compiles each program in source/system_programs a second
+ time with -DMULTICALL -Dmain=<name>_main and links it into cseshell, the
+ way busybox does, so a script loop calling ld or find costs a function
+ call instead of a fork, an exec and a dynamic link. The standalone
+ binaries in bin/ are still built and used when the shell does not run
+ a program itself.
+
+ A program sees the same state it would as a fresh process where it
+ matters: its own copy of argv, getopt reset, and exit() returning to the
+ shell rather than ending it (system_program.h routes it here). The
+ descriptors it left open by exiting early are closed; memory it leaks
+ that way stays leaked. exit() can only return to the shell from the
+ thread that called main, so programs that start threads are not run
+ here but in a forked child (see multicall_threaded in shell.c).
+*/
+
+// run main_fn(argv) with stdout on out_fd (-1 to keep it); returns the exit status
+int multicall_run(int (*main_fn)(int, char **), char **argv, int out_fd);
+
+// exit() inside a program run by multicall_run()
+void sysprog_exit(int status) __attribute__((noreturn));
+
+#endif
@@ -1,4 +1,8 @@
+#define _GNU_SOURCE     // for pipe2(), clone()
 #include "shell.h"
+#include "history.h"
+#include "stats.h"
+#include "multicall.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -17,32 +21,79 @@
 #include <stdio.h>        // for printf()
 #include <ctype.h>
 #include <termios.h> // to detect up down button inputs
+#include <errno.h>
+#include <pwd.h>        // for getpwuid()
+#include <sys/uio.h>    // for writev()
+#include <spawn.h>      // for posix_spawnp()
+#include <sched.h>      // for clone()
+#include <poll.h>       // for poll()
+#include <sys/signalfd.h> // for signalfd()
+#include <sys/syscall.h>  // for SYS_perf_event_open
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <math.h>       // for sqrt() in bench
 
 void type_prompt(void);
+char *read_command(void);
 
 #define MAX_ARGS 64
-#define MAX_RC_LINES 100
 #define MAX_LINE_LEN 1024
+#define READER_BUFSIZE (64 * 1024)
 
-/*history list*/
-#define MAX_HISTORY 100
-static char *history[MAX_HISTORY];
-static int  history_count = 0;
+/*history file, relative to $HOME*/
+#define HISTORY_FILE ".cseshell_history"
+/*command telemetry log, relative to $HOME*/
+#define STATS_FILE ".cseshell_stats"
 
 
-//global snapshot variables
-static struct rusage prev_usage = {0};
-static struct rusage curr_usage;
+// how external commands are launched, see launch_stage()
+enum {
+  SPAWN_FORK,             // fork() a copy of the shell, then execvp()
+  SPAWN_POSIX,            // posix_spawnp(), no page table copy
+  SPAWN_VFORK,            // clone(CLONE_VM|CLONE_VFORK) on a private stack
+  SPAWN_BACKENDS
+};
+
+static const char *spawn_backend_names[SPAWN_BACKENDS] = {
+  "fork", "posix_spawn", "vfork"
+};
+
+// when the programs linked into the shell skip the exec, see "set multicall"
+enum {
+  MULTICALL_NEVER,        // always exec the binary in bin/
+  MULTICALL_AUTO,         // in-process in scripts, forked but not exec'ed at the prompt
+  MULTICALL_ALWAYS,       // in-process whenever it runs alone in the foreground
+  MULTICALL_MODES
+};
+
+static const char *multicall_mode_names[MULTICALL_MODES] = {
+  "never", "auto", "always"
+};
 
 //struct for customized appearance
 typedef struct {
   char *prompt_format;    // e.g. "\\u@\\h:\\w$ "
   char *color_scheme;     // e.g. "default", "dark", "light", "solarized"
   int   show_timestamp;   // 0 or 1
+  int   spawn_backend;    // SPAWN_FORK, SPAWN_POSIX or SPAWN_VFORK
+  int   spawn_timing;     // 0 or 1, report spawn-to-exec latency
+  long  resource_report;  // -1 never, 0 always, else only above this many ms
+  int   multicall;        // MULTICALL_NEVER, MULTICALL_AUTO or MULTICALL_ALWAYS
 } shell_config_t;
 
+// spawn-to-exec latency per backend, collected while spawn_timing is on
+typedef struct {
+  long   count;
+  double total_us, min_us, max_us;
+} spawn_stat_t;
+
+static spawn_stat_t spawn_stats[SPAWN_BACKENDS];
+
 static shell_config_t config;
 
+static int interactive = 0;   // 1 when reading commands from a terminal
+static int last_status = 0;   // exit status of the last command line
+
 static const char *calc_p;
 
 // forward decls
@@ -87,190 +138,1461 @@ static double parse_factor(void) {
   return v;
 }
 
-// Draw the prompt according to current config
-void draw_prompt() {
-    char buf[128], cwd[2048], host[2048];
-    char *p = config.prompt_format;
+/*
+ The prompt format is compiled into a list of segments whenever
+ prompt_format, color_scheme or show_timestamp changes, so drawing it is a
+ single writev() with no parsing. Login and hostname are looked up once,
+ and the cwd only after shell_cd() marks it dirty.
 
-    // optional timestamp
-    if (config.show_timestamp) {
-        time_t t = time(NULL);
-        struct tm *tm = localtime(&t);
-        strftime(buf, sizeof(buf), "[%H:%M:%S] ", tm);
-        printf("%s", buf);
-    }
-
-    // color logic
-    if (strcmp(config.color_scheme, "solarized")==0)
-        printf("\x1b[33m");
-    else if (strcmp(config.color_scheme, "dark")==0) {
-    	// bright white
-    	printf("\x1b[37m");   
-    } else if (strcmp(config.color_scheme, "light")==0) {
-    	// black text on white background
-    	printf("\x1b[30;47m");
-    } else if (strcmp(config.color_scheme, "blue")==0) {
-    	// blue text
-    	printf("\x1b[34m");
-    } else if (strcmp(config.color_scheme, "green")==0) {
-    	// green text
-    	printf("\x1b[32m");
-    } else if (strcmp(config.color_scheme, "red")==0) {
-    	// red text
-    	printf("\x1b[31m");
-    } else if (strcmp(config.color_scheme, "default")==0) {
-	//default text
-	printf("\x1b[0m");
-    }
-
-    // new parsing loop  
+ Escapes: \u user, \h host, \w cwd, \\ and \$ literals,
+          \D duration of the last command, \? its exit status.
+*/
+enum { SEG_TEXT, SEG_USER, SEG_HOST, SEG_CWD, SEG_DURATION, SEG_STATUS };
+
+typedef struct {
+    int    kind;
+    size_t off, len;          // SEG_TEXT: slice of prompt.text
+} prompt_seg_t;
+
+// escape sequence for each color_scheme value
+static const struct { const char *name, *code; } color_codes[] = {
+    { "solarized", "\x1b[33m" },
+    { "dark",      "\x1b[37m" },      // bright white
+    { "light",     "\x1b[30;47m" },   // black text on white background
+    { "blue",      "\x1b[34m" },
+    { "green",     "\x1b[32m" },
+    { "red",       "\x1b[31m" },
+    { "default",   "\x1b[0m" },
+};
+
+static struct {
+    prompt_seg_t *segs;
+    int           nsegs;
+    char         *text;           // literal text of all SEG_TEXT segments
+    const char   *color;          // "" when the scheme is unknown
+    int           reset;          // append "\x1b[0m" after the prompt
+    char          user[256], host[256], cwd[PATH_MAX];
+    int           cwd_dirty;
+} prompt = { .cwd_dirty = 1 };
+
+static double last_duration_us = 0;   // wall time of the last command line
+static struct rusage last_usage;      // wait4() usage summed over its processes
+
+static void compile_prompt(void) {
+    const char *p = config.prompt_format;
+    size_t n = strlen(p);
+
+    free(prompt.segs);
+    free(prompt.text);
+    prompt.segs = malloc((n + 1) * sizeof(prompt_seg_t));
+    prompt.text = malloc(n + 1);
+    prompt.nsegs = 0;
+
+    size_t tlen = 0;
     while (*p) {
-        if (p[0]=='\\' && p[1]) {
+        int kind = SEG_TEXT;
+        char lit = *p;
+        if (p[0] == '\\' && p[1]) {
             switch (p[1]) {
-                case 'u': 
-                    printf("%s", getlogin());  
-                    break;
-                case 'h':
-                    gethostname(host, sizeof(host));
-                    printf("%s", host);
-                    break;
-                case 'w':
-                    getcwd(cwd, sizeof(cwd));
-                    printf("%s", cwd);
-                    break;
-                case '\\': 
-                    putchar('\\'); 
-                    break;
-                case '$':  
-                    putchar('$'); 
-                    break;
-                default:
-                    // unknown escape: just print it literally
-                    putchar(p[1]);
+                case 'u': kind = SEG_USER; break;
+                case 'h': kind = SEG_HOST; break;
+                case 'w': kind = SEG_CWD; break;
+                case 'D': kind = SEG_DURATION; break;
+                case '?': kind = SEG_STATUS; break;
+                // unknown escape (and \\ or \$): just print it literally
+                default:  lit = p[1];
             }
             p += 2;
         } else {
-            putchar(*p++);
+            p++;
+        }
+
+        prompt_seg_t *last = prompt.nsegs ? &prompt.segs[prompt.nsegs - 1] : NULL;
+        if (kind == SEG_TEXT) {
+            prompt.text[tlen] = lit;
+            if (last && last->kind == SEG_TEXT) {   // merge runs of literal text
+                last->len++;
+                tlen++;
+                continue;
+            }
+            prompt.segs[prompt.nsegs++] = (prompt_seg_t){ SEG_TEXT, tlen++, 1 };
+        } else {
+            prompt.segs[prompt.nsegs++] = (prompt_seg_t){ kind, 0, 0 };
+        }
+    }
+
+    prompt.color = "";
+    for (size_t i = 0; i < sizeof(color_codes) / sizeof(color_codes[0]); i++) {
+        if (strcmp(config.color_scheme, color_codes[i].name) == 0)
+            prompt.color = color_codes[i].code;
+    }
+    prompt.reset = strcmp(config.color_scheme, "default") != 0;
+
+    // login and hostname do not change while the shell runs
+    if (!prompt.user[0]) {
+        const char *user = getlogin();
+        if (!user) {
+            struct passwd *pw = getpwuid(geteuid());
+            user = pw ? pw->pw_name : "unknown";
+        }
+        snprintf(prompt.user, sizeof(prompt.user), "%s", user);
+        gethostname(prompt.host, sizeof(prompt.host) - 1);
+    }
+}
+
+// Draw the prompt according to current config
+void draw_prompt() {
+    struct iovec iov[2 * 64 + 4];
+    char ts[32], dur[32], status[16];
+    int n = 0;
+
+    if (!prompt.segs) compile_prompt();
+    if (prompt.cwd_dirty) {
+        if (!getcwd(prompt.cwd, sizeof(prompt.cwd))) strcpy(prompt.cwd, "?");
+        prompt.cwd_dirty = 0;
+    }
+
+    // optional timestamp
+    if (config.show_timestamp) {
+        time_t t = time(NULL);
+        size_t k = strftime(ts, sizeof(ts), "[%H:%M:%S] ", localtime(&t));
+        iov[n++] = (struct iovec){ ts, k };
+    }
+    iov[n++] = (struct iovec){ (void *)prompt.color, strlen(prompt.color) };
+
+    for (int i = 0; i < prompt.nsegs; i++) {
+        const prompt_seg_t *seg = &prompt.segs[i];
+        const char *str = NULL;
+        size_t len = 0;
+        switch (seg->kind) {
+            case SEG_TEXT: str = prompt.text + seg->off; len = seg->len; break;
+            case SEG_USER: str = prompt.user; break;
+            case SEG_HOST: str = prompt.host; break;
+            case SEG_CWD:  str = prompt.cwd;  break;
+            case SEG_DURATION:
+                if (last_duration_us >= 1e6)
+                    snprintf(dur, sizeof(dur), "%.2fs", last_duration_us / 1e6);
+                else
+                    snprintf(dur, sizeof(dur), "%.0fms", last_duration_us / 1e3);
+                str = dur;
+                break;
+            case SEG_STATUS:
+                snprintf(status, sizeof(status), "%d", last_status);
+                str = status;
+                break;
         }
+        if (seg->kind != SEG_TEXT) len = strlen(str);
+        // flush early if a huge format outgrows the vector
+        if (n == (int)(sizeof(iov) / sizeof(iov[0])) - 1) {
+            writev(STDOUT_FILENO, iov, n);
+            n = 0;
+        }
+        iov[n++] = (struct iovec){ (void *)str, len };
     }
 
     // reset color
-    if (strcmp(config.color_scheme, "default")!=0)
-        printf("\x1b[0m");
+    if (prompt.reset) iov[n++] = (struct iovec){ "\x1b[0m", 4 };
 
-    fflush(stdout);
+    writev(STDOUT_FILENO, iov, n);
 }
 
 char output_file_path[2048];
 int already_ran_rc = 0;
 
-void process_rc_file() {
-    if (already_ran_rc) return;
-    already_ran_rc = 1;
+/* handle "set key=value" from the prompt or from .cseshellrc */
+static void apply_setting(const char *key, const char *value) {
+    if (strcmp(key, "prompt_format") == 0) {
+        free(config.prompt_format);
+        config.prompt_format = strdup(value);
+        compile_prompt();
+    } else if (strcmp(key, "color_scheme") == 0) {
+        free(config.color_scheme);
+        config.color_scheme = strdup(value);
+        compile_prompt();
+    } else if (strcmp(key, "show_timestamp") == 0) {
+        config.show_timestamp = atoi(value);
+    } else if (strcmp(key, "spawn_backend") == 0) {
+        for (int i = 0; i < SPAWN_BACKENDS; i++) {
+            if (strcmp(value, spawn_backend_names[i]) == 0) {
+                config.spawn_backend = i;
+                return;
+            }
+        }
+        fprintf(stderr, "Unknown spawn backend “%s” (fork, posix_spawn, vfork)\n", value);
+    } else if (strcmp(key, "spawn_timing") == 0) {
+        config.spawn_timing = atoi(value);
+    } else if (strcmp(key, "resource_report") == 0) {
+        if (strcmp(value, "always") == 0)          config.resource_report = 0;
+        else if (strcmp(value, "never") == 0)      config.resource_report = -1;
+        else if (isdigit((unsigned char)value[0])) config.resource_report = atol(value);
+        else fprintf(stderr, "Unknown resource_report “%s” (always, never or a threshold in ms)\n", value);
+    } else if (strcmp(key, "multicall") == 0) {
+        for (int i = 0; i < MULTICALL_MODES; i++) {
+            if (strcmp(value, multicall_mode_names[i]) == 0) {
+                config.multicall = i;
+                return;
+            }
+        }
+        fprintf(stderr, "Unknown multicall mode “%s” (never, auto, always)\n", value);
+    } else {
+        fprintf(stderr, "Unknown setting “%s”\n", key);
+    }
+}
 
-    FILE *file = fopen(".cseshellrc", "r");
-    if (!file) return;
-
-    char *commands[MAX_RC_LINES];
-    int command_count = 0;
-    char line[MAX_LINE_LEN];
-
-    while (fgets(line, sizeof(line), file) && command_count < MAX_RC_LINES) {
-        line[strcspn(line, "\n")] = '\0';
-        char *start = line;
-        while (*start == ' ' || *start == '\t') start++;
-        char *end = start + strlen(start) - 1;
-        while (end > start && (*end == ' ' || *end == '\t')) {
-            *end = '\0'; end--; }
-        if (strlen(start) == 0) continue;
-        commands[command_count++] = strdup(start);
-    }
-    fclose(file);
-
-    for (int k = 0; k < command_count; k++) {
-        if (strncmp(commands[k], "PATH=", 5) == 0) {
-            setenv("PATH", commands[k] + 5, 1);
-            free(commands[k]);
-            continue;
+static int  tokenize_line(char *line, char **cmd);
+static void execute_command(char **cmd);
+
+/*
+ Buffered reader for scripts, "-c" strings, piped stdin and .cseshellrc.
+ Input is pulled in READER_BUFSIZE chunks and lines may be any length.
+*/
+typedef struct {
+    int     fd;           // -1 when reading from a string
+    char   *buf;
+    size_t  pos, len;
+    char   *line;         // the current line, grown as needed
+    size_t  cap;
+} line_reader_t;
+
+static void reader_init(line_reader_t *r, int fd, char *str) {
+    memset(r, 0, sizeof(*r));
+    r->fd = fd;
+    if (fd == -1) {
+        r->buf = str;
+        r->len = strlen(str);
+    } else {
+        r->buf = malloc(READER_BUFSIZE);
+    }
+}
+
+static void reader_free(line_reader_t *r) {
+    if (r->fd != -1) free(r->buf);
+    free(r->line);
+}
+
+/* returns the next line without its '\n', or NULL at end of input */
+static char *reader_next_line(line_reader_t *r) {
+    size_t used = 0;
+    int got_any = 0;
+    for (;;) {
+        if (r->pos == r->len) {
+            ssize_t n = 0;
+            if (r->fd != -1) {
+                do n = read(r->fd, r->buf, READER_BUFSIZE);
+                while (n < 0 && errno == EINTR);
+            }
+            if (n <= 0) break;
+            r->pos = 0;
+            r->len = n;
         }
+        char *start = r->buf + r->pos;
+        char *nl = memchr(start, '\n', r->len - r->pos);
+        size_t chunk = nl ? (size_t)(nl - start) : r->len - r->pos;
 
-        //allow set command for customization
-        if (strncmp(commands[k], "set ", 4) == 0) {
-  	    char *eq = strchr(commands[k], '=');
-  	    if (eq) {
-    		*eq = '\0';
-    		char *key = commands[k] + 4;       // after “set ”
-    		char *value = eq + 1;
-    		if (strcmp(key, "prompt_format") == 0) {
-      		    config.prompt_format = strdup(value);
-    		} else if (strcmp(key, "color_scheme") == 0) {
-      		    config.color_scheme = strdup(value);
-    		} else if (strcmp(key, "show_timestamp") == 0) {
-      		    config.show_timestamp = atoi(value);
-    		}
-  	    }
-  	    continue;  // skip fork/exec for “set” lines
-	}
-
-
-        char *args[64]; int i = 0;
-        char *token = strtok(commands[k], " ");
-        while (token && i < 63) {
-            args[i++] = token;
-            token = strtok(NULL, " ");
-        }
-        args[i] = NULL;
-        if (!args[0]) { free(commands[k]); continue; }
-
-        //snapshot of usage
-        getrusage(RUSAGE_CHILDREN, &prev_usage);
-        pid_t pid = fork();
-        if (pid == 0) {
-            execvp(args[0], args);
-            fprintf(stderr, "cseshell: command not found: %s\n", args[0]);
-            exit(1);
-        } else if (pid > 0) {
-            wait(NULL);
-            getrusage(RUSAGE_CHILDREN, &curr_usage);
-            char *cmd_name = args[0];
-
-            // find before - after
-            double u = (curr_usage.ru_utime.tv_sec  - prev_usage.ru_utime.tv_sec)
-             + (curr_usage.ru_utime.tv_usec - prev_usage.ru_utime.tv_usec) / 1e6;
-            double s = (curr_usage.ru_stime.tv_sec  - prev_usage.ru_stime.tv_sec)
-             + (curr_usage.ru_stime.tv_usec - prev_usage.ru_stime.tv_usec) / 1e6;
-            long m = curr_usage.ru_maxrss - prev_usage.ru_maxrss;
-            long i = curr_usage.ru_inblock - prev_usage.ru_inblock;
-            long o = curr_usage.ru_oublock - prev_usage.ru_oublock;
-
-            // print resource stats
-            printf("\n");
-            printf("Resource usage for \"%s\":\n", cmd_name);
-            printf("  Amount of CPU time in user mode       : %.3f seconds\n", u);
-            printf("  Amount of CPU time in kernel mode     : %.3f seconds\n", s);
-            printf("  Peak RAM usage (max resident size)    : %ld KB\n", m);
-            printf("  Block I/O read operations             : %ld\n", i);
-            printf("  Block I/O write operations            : %ld\n", o);
-            printf("\n");
-
-           // reset for next command
-           prev_usage = curr_usage;
-        } else {
-            perror("fork failed");
+        if (used + chunk + 1 > r->cap) {
+            r->cap = (used + chunk + 1) * 2;
+            r->line = realloc(r->line, r->cap);
+        }
+        memcpy(r->line + used, start, chunk);
+        used += chunk;
+        got_any = 1;
+        r->pos += chunk + (nl ? 1 : 0);
+        if (nl) break;
+    }
+    if (!got_any) return NULL;
+    r->line[used] = '\0';
+    return r->line;
+}
+
+/*
+ Run one line of input: "PATH=..." and "set key=value" are handled here,
+ blank lines and '#' comments are skipped, everything else is tokenized and
+ executed.
+*/
+static void execute_line(char *line) {
+    while (*line == ' ' || *line == '\t') line++;
+    char *end = line + strlen(line);
+    while (end > line && isspace((unsigned char)end[-1])) *--end = '\0';
+    if (*line == '\0' || *line == '#') return;
+
+    if (strncmp(line, "PATH=", 5) == 0) {
+        setenv("PATH", line + 5, 1);
+        return;
+    }
+
+    //allow set command for customization
+    if (strncmp(line, "set ", 4) == 0) {
+        char *eq = strchr(line, '=');
+        if (eq) {
+            *eq = '\0';
+            apply_setting(line + 4, eq + 1);    // after “set ”
+            return;
         }
-        free(commands[k]);
     }
+
+    char *args[MAX_ARGS];
+    if (tokenize_line(line, args) > 0) execute_command(args);
+}
+
+/* execute every line from fd (or from str when fd is -1) */
+static void run_script(int fd, char *str) {
+    line_reader_t r;
+    char *line;
+    reader_init(&r, fd, str);
+    while ((line = reader_next_line(&r)) != NULL) {
+        execute_line(line);
+    }
+    reader_free(&r);
+}
+
+void process_rc_file() {
+    if (already_ran_rc) return;
+    already_ran_rc = 1;
+
+    int fd = open(".cseshellrc", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    run_script(fd, NULL);
+    close(fd);
 }
 
 int (*builtin_command_func[])(char **) = {
     &shell_cd, &shell_help, &shell_exit, &shell_usage,
     &list_env, &set_env_var, &unset_env_var, &shell_batman, &shell_cyclops, &shell_squidward, &shell_calc,
+    &shell_spawnstat, &shell_hash, &shell_history, &shell_jobs, &shell_fg, &shell_bg, &shell_perf, &shell_stats, &shell_bench,
+};
+
+int (*multicall_func[])(int, char **) = {
+    &ld_main, &ldr_main, &find_main, &sys_main, &dcheck_main, &backup_main,
+    &restore_main,
 };
 
+/*
+ Programs that start threads. One of their workers may call exit(), which
+ can only jump back to the shell from the thread that started the program,
+ and its threads would outlive an early exit; so these only ever run in a
+ forked child, never inside the shell.
+*/
+static const char multicall_threaded[] = {
+    0, 1, 1, 0, 0, 1, 1,   // ld ldr find sys dcheck backup restore
+};
+
+int num_multicall_programs() {
+    return sizeof(multicall_commands) / sizeof(char *);
+}
+
 int num_builtin_functions() {
     return sizeof(builtin_commands) / sizeof(char *);
 }
 
+static int find_builtin(const char *name) {
+    for (int i = 0; i < num_builtin_functions(); i++) {
+        if (!strcmp(name, builtin_commands[i])) return i;
+    }
+    return -1;
+}
+
+/*
+ Split a line into whitespace separated tokens, in place. '|' and '&' are
+ always tokens of their own so "ldr|grep x" and "ldr | grep x" parse the
+ same way, as do "sleep 5&" and "sleep 5 &".
+ Returns the number of tokens; cmd[] is NULL terminated.
+*/
+static int tokenize_line(char *line, char **cmd) {
+    int argc = 0;
+    char *p = line;
+    while (*p && argc < MAX_ARGS - 1) {
+        while (*p && isspace((unsigned char)*p)) p++;
+        if (!*p) break;
+        if (*p == '|' || *p == '&') {
+            cmd[argc++] = *p == '|' ? "|" : "&";
+            *p++ = '\0';
+            continue;
+        }
+        cmd[argc++] = p;
+        while (*p && !isspace((unsigned char)*p) && *p != '|' && *p != '&') p++;
+        if ((*p == '|' || *p == '&') && argc < MAX_ARGS - 1) {
+            // the operator glued to this word becomes the next token
+            cmd[argc++] = *p == '|' ? "|" : "&";
+            *p++ = '\0';
+        } else if (*p) {
+            *p++ = '\0';
+        }
+    }
+    cmd[argc] = NULL;
+    return argc;
+}
+
+/*
+ Print the accounting of one foreground command line: wall time plus the
+ rusage wait4() returned for each of its processes, summed. Peak RAM is the
+ largest single process, as ru_maxrss is a high-water mark and not additive.
+ spawn_us is the spawn-to-exec latency when it was measured (> 0).
+*/
+static void report_resource_usage(const char *cmd_name, const struct rusage *ru,
+                                  double wall_us, double spawn_us) {
+    // only report commands slower than the threshold, if one is set
+    if (config.resource_report < 0) return;
+    if (wall_us < config.resource_report * 1e3) return;
+
+    double u = ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6;
+    double s = ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6;
+
+    // print resource stats
+    printf("\n");
+    printf("Resource usage for \"%s\":\n", cmd_name);
+    printf("  Wall-clock time                       : %.3f seconds\n", wall_us / 1e6);
+    printf("  Amount of CPU time in user mode       : %.3f seconds\n", u);
+    printf("  Amount of CPU time in kernel mode     : %.3f seconds\n", s);
+    if (ru->ru_maxrss > 0)
+        printf("  Peak RAM usage (max resident size)    : %ld KB\n", ru->ru_maxrss);
+    else
+        printf("  Peak RAM usage (max resident size)    : unknown, ran inside the shell\n");
+    printf("  Page faults (minor / major)           : %ld / %ld\n", ru->ru_minflt, ru->ru_majflt);
+    printf("  Context switches (vol. / invol.)      : %ld / %ld\n", ru->ru_nvcsw, ru->ru_nivcsw);
+    printf("  Block I/O read operations             : %ld\n", ru->ru_inblock);
+    printf("  Block I/O write operations            : %ld\n", ru->ru_oublock);
+    if (spawn_us > 0) {
+        char what[64];
+        snprintf(what, sizeof(what), "Spawn-to-exec latency (%s)",
+                 spawn_backend_names[config.spawn_backend]);
+        printf("  %-38s: %.1f us\n", what, spawn_us);
+    }
+    printf("\n");
+}
+
+/*
+ Performance counters for the "perf" builtin. The counters are attached to
+ the child while it waits on a pipe just before exec; enable_on_exec starts
+ them at the exec, and inherit makes them follow every process it creates,
+ so the shell's own fork work is not counted. When the kernel refuses
+ hardware events (no PMU, or perf_event_paranoid) the software counters are
+ still reported.
+*/
+enum {
+    PC_TASK_CLOCK, PC_CTX_SWITCHES, PC_MIGRATIONS, PC_PAGE_FAULTS,   // software
+    PC_CYCLES, PC_INSTRUCTIONS, PC_CACHE_REFS, PC_CACHE_MISSES,      // hardware
+    PC_BRANCHES, PC_BRANCH_MISSES,
+    PC_COUNTERS
+};
+
+static const struct { const char *name; unsigned type, config; } perf_counters[PC_COUNTERS] = {
+    { "task-clock",       PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+    { "context-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+    { "cpu-migrations",   PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS },
+    { "page-faults",      PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+    { "cycles",           PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { "instructions",     PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { "cache-references", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES },
+    { "cache-misses",     PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { "branches",         PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS },
+    { "branch-misses",    PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+};
+
+/*
+ Open every counter on pid; unavailable ones are left at -1. The kernel
+ part is dropped if the first attempt is refused, which is all that
+ perf_event_paranoid=2 allows an unprivileged user to count.
+*/
+static void perf_open(pid_t pid, int *fds) {
+    int exclude_kernel = 0;
+    for (int i = 0; i < PC_COUNTERS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = perf_counters[i].type;
+        attr.config = perf_counters[i].config;
+        attr.disabled = 1;
+        attr.enable_on_exec = 1;
+        attr.inherit = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        attr.exclude_kernel = exclude_kernel;
+        fds[i] = syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+        if (fds[i] < 0 && (errno == EACCES || errno == EPERM) && !exclude_kernel) {
+            attr.exclude_kernel = exclude_kernel = 1;
+            fds[i] = syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+        }
+    }
+}
+
+/*
+ Read and close the counters. Values are scaled up when the kernel had to
+ multiplex them; a counter that never ran reads as -1.
+*/
+static void perf_read(int *fds, double *val) {
+    for (int i = 0; i < PC_COUNTERS; i++) {
+        uint64_t r[3];   // value, time enabled, time running
+        val[i] = -1;
+        if (fds[i] < 0) continue;
+        if (read(fds[i], r, sizeof(r)) == sizeof(r) && r[2] > 0)
+            val[i] = (double)r[0] * r[1] / r[2];
+        close(fds[i]);
+    }
+}
+
+static void report_perf_counters(const char *cmd_name, const double *val, double wall_us) {
+    printf("Performance counters for \"%s\":\n", cmd_name);
+    for (int i = 0; i < PC_COUNTERS; i++) {
+        if (val[i] < 0) continue;
+        if (i == PC_TASK_CLOCK) {
+            printf("  %-18s %16.2f ms", perf_counters[i].name, val[i] / 1e6);
+            if (wall_us > 0) printf("   %.2f CPUs utilized", val[i] / 1e3 / wall_us);
+        } else {
+            printf("  %-18s %16.0f", perf_counters[i].name, val[i]);
+        }
+        // derived ratios next to the counter they explain
+        if (i == PC_INSTRUCTIONS && val[PC_CYCLES] > 0)
+            printf("      %.2f insn per cycle", val[i] / val[PC_CYCLES]);
+        if (i == PC_CACHE_MISSES && val[PC_CACHE_REFS] > 0)
+            printf("      %.2f%% of cache refs", 100 * val[i] / val[PC_CACHE_REFS]);
+        if (i == PC_BRANCH_MISSES && val[PC_BRANCHES] > 0)
+            printf("      %.2f%% of branches", 100 * val[i] / val[PC_BRANCHES]);
+        printf("\n");
+    }
+    if (val[PC_CYCLES] < 0 && val[PC_INSTRUCTIONS] < 0) {
+        int paranoid = -1;
+        FILE *f = fopen("/proc/sys/kernel/perf_event_paranoid", "r");
+        if (f) {
+            if (fscanf(f, "%d", &paranoid) != 1) paranoid = -1;
+            fclose(f);
+        }
+        printf("  (hardware counters unavailable, perf_event_paranoid=%d)\n", paranoid);
+    }
+    printf("\n");
+}
+
+/*
+ Command location cache, like bash's "hash". Maps a command name to the
+ absolute path execvp() would have found, or to NULL when no PATH directory
+ has it, so repeated commands skip the failed execve() probes.
+
+ The whole table is dropped when PATH differs from the string it was built
+ for (setenv, unsetenv, PATH= in .cseshellrc all end up here), or when the
+ mtime of a PATH directory that a lookup depended on has changed. Every
+ directory is fstat'ed at most once per command line.
+*/
+typedef struct {
+    char *name;
+    char *path;           // NULL for a negative entry
+    long  hits;
+} hash_entry_t;
+
+typedef struct {
+    char           *dir;
+    int             fd;          // O_PATH handle, -1 for relative entries
+    struct timespec mtime;
+    unsigned long   checked;     // cmd_hash.line when last fstat'ed
+} hash_dir_t;
+
+static struct {
+    hash_entry_t *slots;         // open addressing, cap is a power of two
+    size_t        cap, count;
+    char         *path_env;      // PATH the table was built for
+    hash_dir_t   *dirs;
+    int           ndirs;
+    int           first_relative; // index of the first relative dir, or ndirs
+    unsigned long line;          // bumped once per command line
+} cmd_hash;
+
+static size_t hash_name(const char *s) {
+    size_t h = 14695981039346656037ULL;   // FNV-1a
+    while (*s) { h ^= (unsigned char)*s++; h *= 1099511628211ULL; }
+    return h;
+}
+
+static void cmd_hash_clear(void) {
+    for (size_t i = 0; i < cmd_hash.cap; i++) {
+        free(cmd_hash.slots[i].name);
+        free(cmd_hash.slots[i].path);
+    }
+    memset(cmd_hash.slots, 0, cmd_hash.cap * sizeof(hash_entry_t));
+    cmd_hash.count = 0;
+}
+
+/* split PATH into directories and remember their mtimes */
+static void cmd_hash_load_path(const char *path) {
+    for (int i = 0; i < cmd_hash.ndirs; i++) {
+        if (cmd_hash.dirs[i].fd != -1) close(cmd_hash.dirs[i].fd);
+        free(cmd_hash.dirs[i].dir);
+    }
+    free(cmd_hash.dirs);
+    free(cmd_hash.path_env);
+    cmd_hash.dirs = NULL;
+    cmd_hash.ndirs = 0;
+    cmd_hash.path_env = path ? strdup(path) : NULL;
+    cmd_hash_clear();
+    if (!path) { cmd_hash.first_relative = 0; return; }
+
+    int n = 1;
+    for (const char *p = path; *p; p++) if (*p == ':') n++;
+    cmd_hash.dirs = calloc(n, sizeof(hash_dir_t));
+    cmd_hash.first_relative = n;
+
+    const char *p = path;
+    for (int i = 0; i < n; i++) {
+        const char *end = strchrnul(p, ':');
+        hash_dir_t *d = &cmd_hash.dirs[cmd_hash.ndirs++];
+        // an empty component means the current directory
+        d->dir = (end == p) ? strdup(".") : strndup(p, end - p);
+        d->fd = -1;
+        if (d->dir[0] != '/') {
+            if (cmd_hash.first_relative > i) cmd_hash.first_relative = i;
+        } else {
+            struct stat st;
+            d->fd = open(d->dir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+            if (d->fd != -1 && fstat(d->fd, &st) == 0) d->mtime = st.st_mtim;
+        }
+        d->checked = cmd_hash.line;
+        p = *end ? end + 1 : end;
+    }
+}
+
+/*
+ Make sure PATH and directories 0..upto are unchanged since the table was
+ filled. Returns 0 if the table had to be dropped.
+*/
+static int cmd_hash_validate(int upto) {
+    const char *path = getenv("PATH");
+    if ((path == NULL) != (cmd_hash.path_env == NULL) ||
+        (path && strcmp(path, cmd_hash.path_env) != 0)) {
+        cmd_hash_load_path(path);
+        return 0;
+    }
+    int valid = 1;
+    for (int i = 0; i <= upto && i < cmd_hash.ndirs; i++) {
+        hash_dir_t *d = &cmd_hash.dirs[i];
+        if (d->fd == -1 || d->checked == cmd_hash.line) continue;
+        struct stat st;
+        d->checked = cmd_hash.line;
+        if (fstat(d->fd, &st) != 0 ||
+            st.st_mtim.tv_sec != d->mtime.tv_sec ||
+            st.st_mtim.tv_nsec != d->mtime.tv_nsec) {
+            d->mtime = st.st_mtim;
+            valid = 0;
+        }
+    }
+    if (!valid) cmd_hash_clear();
+    return valid;
+}
+
+static hash_entry_t *cmd_hash_slot(const char *name) {
+    size_t mask = cmd_hash.cap - 1;
+    for (size_t i = hash_name(name) & mask; ; i = (i + 1) & mask) {
+        if (!cmd_hash.slots[i].name || strcmp(cmd_hash.slots[i].name, name) == 0)
+            return &cmd_hash.slots[i];
+    }
+}
+
+static void cmd_hash_insert(const char *name, const char *path) {
+    if ((cmd_hash.count + 1) * 2 > cmd_hash.cap) {
+        hash_entry_t *old = cmd_hash.slots;
+        size_t old_cap = cmd_hash.cap;
+        cmd_hash.cap = old_cap ? old_cap * 2 : 64;
+        cmd_hash.slots = calloc(cmd_hash.cap, sizeof(hash_entry_t));
+        for (size_t i = 0; i < old_cap; i++) {
+            if (old[i].name) *cmd_hash_slot(old[i].name) = old[i];
+        }
+        free(old);
+    }
+    hash_entry_t *e = cmd_hash_slot(name);
+    e->name = strdup(name);
+    e->path = path ? strdup(path) : NULL;
+    e->hits = 0;
+    cmd_hash.count++;
+}
+
+/* the directory index a cached entry depends on, for validation */
+static int cmd_hash_dir_of(const char *path) {
+    for (int i = 0; i < cmd_hash.ndirs; i++) {
+        size_t len = strlen(cmd_hash.dirs[i].dir);
+        if (strncmp(path, cmd_hash.dirs[i].dir, len) == 0 && path[len] == '/'
+            && !strchr(path + len + 1, '/'))
+            return i;
+    }
+    return cmd_hash.ndirs - 1;
+}
+
+/* walk PATH the way execvp() would; writes the hit into out */
+static int search_path(const char *name, char *out, size_t outlen, int *dir_index) {
+    for (int i = 0; i < cmd_hash.ndirs; i++) {
+        struct stat st;
+        snprintf(out, outlen, "%s/%s", cmd_hash.dirs[i].dir, name);
+        if (stat(out, &st) == 0 && S_ISREG(st.st_mode) && access(out, X_OK) == 0) {
+            *dir_index = i;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ Resolve a command name to the path to exec. Names containing '/' are used
+ as they are. Returns NULL when the command does not exist.
+*/
+static const char *resolve_command(const char *name) {
+    static char found[PATH_MAX];
+    if (strchr(name, '/')) return name;
+
+    cmd_hash_validate(-1);
+    hash_entry_t *e = cmd_hash.cap ? cmd_hash_slot(name) : NULL;
+    if (e && e->name) {
+        int upto = e->path ? cmd_hash_dir_of(e->path) : cmd_hash.ndirs - 1;
+        if (cmd_hash_validate(upto)) {
+            e->hits++;
+            return e->path;
+        }
+    }
+
+    int idx;
+    int ok = search_path(name, found, sizeof(found), &idx);
+    // anything that depends on a relative PATH entry is not cacheable
+    if ((ok && idx < cmd_hash.first_relative) ||
+        (!ok && cmd_hash.first_relative == cmd_hash.ndirs)) {
+        cmd_hash_insert(name, ok ? found : NULL);
+        cmd_hash_slot(name)->hits = 1;
+    }
+    return ok ? found : NULL;
+}
+
+/*
+ Programs linked into the shell only stand in for the binaries they were
+ built from: the name must resolve through PATH to the very file (same
+ device and inode) that was in the shell's bin/ at startup. A different
+ "find" earlier in PATH, or a rebuilt binary, is exec'ed as usual.
+*/
+static struct { dev_t dev; ino_t ino; int ok; } multicall_bins[sizeof(multicall_commands) / sizeof(char *)];
+
+static void multicall_init(const char *bin_dir) {
+    for (int i = 0; i < num_multicall_programs(); i++) {
+        char path[PATH_MAX];
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", bin_dir, multicall_commands[i]);
+        multicall_bins[i].ok = stat(path, &st) == 0;
+        multicall_bins[i].dev = st.st_dev;
+        multicall_bins[i].ino = st.st_ino;
+    }
+}
+
+// index into multicall_func[] of the program name runs, or -1 to exec it
+static int find_multicall(const char *name) {
+    if (config.multicall == MULTICALL_NEVER) return -1;
+    for (int i = 0; i < num_multicall_programs(); i++) {
+        if (strcmp(name, multicall_commands[i]) != 0) continue;
+        const char *path = multicall_bins[i].ok ? resolve_command(name) : NULL;
+        struct stat st;
+        if (!path || stat(path, &st) != 0) return -1;
+        return st.st_dev == multicall_bins[i].dev && st.st_ino == multicall_bins[i].ino ? i : -1;
+    }
+    return -1;
+}
+
+/*
+ One stage of a pipeline: its argv points into the caller's token vector.
+ in_fd/out_fd/err_fd are put on stdin/stdout/stderr, or -1 to inherit.
+*/
+typedef struct {
+    char **argv;
+    const char *path;     // resolved executable, see resolve_command()
+    pid_t  pid;
+    int    in_fd, out_fd, err_fd;
+    double spawn_us;      // spawn-to-exec latency, when measured
+    pid_t  pgid;          // process group to join, 0 = start a new one
+    int    foreground;    // 1 if the stage should own the terminal
+} stage_t;
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/*
+ Job control. Every command line that starts processes becomes a job: one
+ process group holding all of its stages. Foreground jobs get the terminal
+ and are waited for; a trailing "&" leaves the job running in the background.
+
+ SIGCHLD is blocked and read through a signalfd, so children are reaped
+ when the line editor sees it become readable instead of inside a signal
+ handler. Finished background jobs are reported, with the resource usage
+ wait4() returned for their processes, before the next prompt.
+*/
+#define MAX_JOBS 32
+
+enum { JOB_FREE, JOB_RUNNING, JOB_STOPPED, JOB_DONE };
+
+typedef struct {
+    int    state;
+    pid_t  pgid;
+    pid_t  pids[MAX_ARGS];    // one per stage, -1 if it could not start
+    int    npids, nalive;
+    int    status;            // exit status of the last stage, as in $?
+    int    background;        // report it at the prompt when it changes
+    int    changed;           // state changed since it was last reported
+    double start_us, end_us;
+    struct rusage usage;      // summed over the stages reaped so far
+    char   cmd[MAX_LINE_LEN]; // command line as typed
+    char   label[MAX_LINE_LEN]; // command names only, the telemetry key
+} job_t;
+
+static job_t jobs[MAX_JOBS];
+static int   current_job = -1;   // the job fg/bg act on by default
+
+static int   job_control = 0;    // process groups and terminal handoff
+static int   sigchld_fd = -1;
+static pid_t shell_pgid;
+static struct termios shell_tmodes;
+static sigset_t job_signals;     // ignored by the shell, default in children
+
+static job_t *job_alloc(const char *cmd, const char *label, int background) {
+    for (int i = 0; i < MAX_JOBS; i++) {
+        job_t *j = &jobs[i];
+        if (j->state != JOB_FREE) continue;
+        memset(j, 0, sizeof(*j));
+        j->state = JOB_RUNNING;
+        j->background = background;
+        j->status = 127;
+        j->start_us = now_us();
+        snprintf(j->cmd, sizeof(j->cmd), "%s", cmd);
+        snprintf(j->label, sizeof(j->label), "%s", label);
+        return j;
+    }
+    fprintf(stderr, "cseshell: too many jobs\n");
+    return NULL;
+}
+
+// finished jobs go into the telemetry store on their way out
+static void job_free(job_t *j) {
+    if (j->state == JOB_DONE) {
+        const struct rusage *u = &j->usage;
+        stats_record(j->label, j->end_us - j->start_us,
+                     u->ru_utime.tv_sec * 1e6 + u->ru_utime.tv_usec +
+                     u->ru_stime.tv_sec * 1e6 + u->ru_stime.tv_usec,
+                     u->ru_maxrss);
+    }
+    if (current_job == j - jobs) current_job = -1;
+    j->state = JOB_FREE;
+}
+
+static void rusage_add(struct rusage *dst, const struct rusage *src) {
+    timeradd(&dst->ru_utime, &src->ru_utime, &dst->ru_utime);
+    timeradd(&dst->ru_stime, &src->ru_stime, &dst->ru_stime);
+    if (src->ru_maxrss > dst->ru_maxrss) dst->ru_maxrss = src->ru_maxrss;
+    dst->ru_minflt  += src->ru_minflt;
+    dst->ru_majflt  += src->ru_majflt;
+    dst->ru_inblock += src->ru_inblock;
+    dst->ru_oublock += src->ru_oublock;
+    dst->ru_nvcsw   += src->ru_nvcsw;
+    dst->ru_nivcsw  += src->ru_nivcsw;
+}
+
+static job_t *job_of_pid(pid_t pid) {
+    for (int i = 0; i < MAX_JOBS; i++) {
+        job_t *j = &jobs[i];
+        if (j->state == JOB_FREE || j->state == JOB_DONE) continue;
+        for (int k = 0; k < j->npids; k++) {
+            if (j->pids[k] == pid) return j;
+        }
+    }
+    return NULL;
+}
+
+/*
+ Apply one wait4() result to job j. A pid that is not one of its stages is
+ a descendant that was orphaned and reparented to the shell (we are a child
+ subreaper): only its usage is added.
+*/
+static void job_record(job_t *j, pid_t pid, int status, const struct rusage *ru) {
+    int k = 0;
+    while (k < j->npids && j->pids[k] != pid) k++;
+    if (k == j->npids) {
+        if (WIFEXITED(status) || WIFSIGNALED(status)) rusage_add(&j->usage, ru);
+        return;
+    }
+
+    j->changed = 1;
+    if (WIFSTOPPED(status)) {
+        j->state = JOB_STOPPED;
+        current_job = j - jobs;
+        return;
+    }
+    if (WIFCONTINUED(status)) {
+        j->state = JOB_RUNNING;
+        return;
+    }
+    rusage_add(&j->usage, ru);
+    j->pids[k] = -1;
+    if (k == j->npids - 1) {
+        if (WIFEXITED(status))        j->status = WEXITSTATUS(status);
+        else if (WIFSIGNALED(status)) j->status = 128 + WTERMSIG(status);
+    }
+    if (--j->nalive == 0) {
+        j->state = JOB_DONE;
+        j->end_us = now_us();
+    }
+}
+
+/*
+ Reap every child that has changed state, without blocking. Called when
+ the signalfd is readable and before each prompt; never while a foreground
+ job is being waited for. Each job's process group is drained first so
+ orphans still in it are charged to the job; whatever is left (daemons
+ that called setsid()) is reaped and dropped.
+*/
+static void reap_children(void) {
+    if (sigchld_fd != -1) {
+        struct signalfd_siginfo si;
+        while (read(sigchld_fd, &si, sizeof(si)) == sizeof(si))
+            ;   // drain; several exits can share one notification
+    }
+    int status;
+    struct rusage ru;
+    pid_t pid;
+    for (int i = 0; i < MAX_JOBS && job_control; i++) {
+        job_t *j = &jobs[i];
+        if (j->state == JOB_FREE || j->state == JOB_DONE || !j->pgid) continue;
+        while ((pid = wait4(-j->pgid, &status, WNOHANG | WUNTRACED | WCONTINUED, &ru)) > 0)
+            job_record(j, pid, status, &ru);
+    }
+    while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &ru)) > 0) {
+        job_t *j = job_of_pid(pid);
+        if (j) job_record(j, pid, status, &ru);
+    }
+}
+
+static const char *job_state_name(const job_t *j) {
+    if (j->state == JOB_STOPPED) return "Stopped";
+    if (j->state == JOB_RUNNING) return "Running";
+    return "Done";
+}
+
+static void print_job(const job_t *j) {
+    int id = j - jobs;
+    if (j->state == JOB_DONE && j->status) {
+        char what[16];
+        snprintf(what, sizeof(what), "Exit %d", j->status);
+        printf("[%d]%c  %-10s %s\n", id + 1, id == current_job ? '+' : ' ', what, j->cmd);
+    } else {
+        printf("[%d]%c  %-10s %s%s\n", id + 1, id == current_job ? '+' : ' ',
+               job_state_name(j), j->cmd, j->state == JOB_RUNNING ? " &" : "");
+    }
+}
+
+/*
+ Print background jobs that finished or stopped since the last prompt, and
+ drop the finished ones. Scripts reap silently.
+*/
+static void notify_jobs(void) {
+    for (int i = 0; i < MAX_JOBS; i++) {
+        job_t *j = &jobs[i];
+        if (j->state == JOB_FREE || !j->changed || !j->background) continue;
+        j->changed = 0;
+        if (interactive && j->state != JOB_RUNNING) {
+            print_job(j);
+            if (j->state == JOB_DONE) {
+                const struct rusage *u = &j->usage;
+                printf("      %.3fs wall, %.3fs user, %.3fs sys, %ld KB peak RAM\n",
+                       (j->end_us - j->start_us) / 1e6,
+                       u->ru_utime.tv_sec + u->ru_utime.tv_usec / 1e6,
+                       u->ru_stime.tv_sec + u->ru_stime.tv_usec / 1e6,
+                       u->ru_maxrss);
+            }
+        }
+        if (j->state == JOB_DONE) job_free(j);
+    }
+    fflush(stdout);
+}
+
+/*
+ Wait until the job finishes or stops. Under job control only its own
+ process group is waited for, and exited orphans left in it are collected
+ afterwards. A script waits for any child: results for background jobs
+ land in their own entries and unknown pids are charged to this job.
+*/
+static void wait_for_job(job_t *j) {
+    int status;
+    struct rusage ru;
+    pid_t pid;
+    while (j->state == JOB_RUNNING) {
+        pid = wait4(job_control ? -j->pgid : -1, &status, WUNTRACED, &ru);
+        if (pid < 0) {
+            if (errno == EINTR) continue;
+            j->state = JOB_DONE;   // ECHILD: nothing left to wait for
+            j->end_us = now_us();
+            break;
+        }
+        job_t *owner = job_control ? j : job_of_pid(pid);
+        job_record(owner ? owner : j, pid, status, &ru);
+    }
+    if (job_control && j->state == JOB_DONE) {
+        while ((pid = wait4(-j->pgid, &status, WNOHANG, &ru)) > 0)
+            job_record(j, pid, status, &ru);
+    }
+}
+
+/*
+ Run job j in the foreground: hand it the terminal, continue it if it was
+ stopped, and take the terminal back once it finishes or stops again.
+*/
+static void foreground_job(job_t *j, int cont) {
+    j->background = 0;
+    if (job_control) tcsetpgrp(STDIN_FILENO, j->pgid);
+    if (cont) {
+        j->state = JOB_RUNNING;
+        kill(-j->pgid, SIGCONT);
+    }
+    wait_for_job(j);
+    if (job_control) {
+        tcsetpgrp(STDIN_FILENO, shell_pgid);
+        // the job may have left the terminal in raw mode
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &shell_tmodes);
+    }
+
+    if (j->state == JOB_STOPPED) {
+        j->background = 1;
+        j->changed = 0;
+        current_job = j - jobs;
+        printf("\n");
+        print_job(j);
+        last_status = 128 + SIGTSTP;
+        last_duration_us = now_us() - j->start_us;
+        last_usage = j->usage;
+    } else {
+        // Ctrl-C leaves the cursor after "^C"
+        if (job_control && j->status == 128 + SIGINT) printf("\n");
+        last_status = j->status;
+        last_duration_us = j->end_us - j->start_us;
+        last_usage = j->usage;
+        job_free(j);
+    }
+}
+
+/*
+ Interactive shells put themselves in their own process group, take the
+ terminal and ignore the job control signals; children get them back.
+*/
+static void init_job_control(void) {
+    // wait until we are in the foreground, e.g. after "cseshell &"
+    while (tcgetpgrp(STDIN_FILENO) != (shell_pgid = getpgrp()))
+        kill(-shell_pgid, SIGTTIN);
+
+    sigemptyset(&job_signals);
+    sigaddset(&job_signals, SIGINT);
+    sigaddset(&job_signals, SIGQUIT);
+    sigaddset(&job_signals, SIGTSTP);
+    sigaddset(&job_signals, SIGTTIN);
+    sigaddset(&job_signals, SIGTTOU);
+    for (int sig = 1; sig < NSIG; sig++) {
+        if (sigismember(&job_signals, sig) == 1) signal(sig, SIG_IGN);
+    }
+
+    shell_pgid = getpid();
+    if (setpgid(shell_pgid, shell_pgid) < 0 && errno != EPERM) {
+        perror("setpgid");   // EPERM: we already lead a session
+    }
+    shell_pgid = getpgrp();
+    tcsetpgrp(STDIN_FILENO, shell_pgid);
+    tcgetattr(STDIN_FILENO, &shell_tmodes);
+
+    sigset_t chld;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, NULL);
+    sigchld_fd = signalfd(-1, &chld, SFD_NONBLOCK | SFD_CLOEXEC);
+    job_control = 1;
+}
+
+/* hang up stopped jobs on exit so they don't linger forever */
+static void hangup_jobs(void) {
+    for (int i = 0; i < MAX_JOBS; i++) {
+        if (jobs[i].state != JOB_STOPPED) continue;
+        kill(-jobs[i].pgid, SIGHUP);
+        kill(-jobs[i].pgid, SIGCONT);
+    }
+}
+
+/*
+ Child side of job control, run before exec: join the job's process group,
+ take the terminal for a foreground job, then undo the shell's signal setup.
+*/
+static void setup_stage_job(const stage_t *st) {
+    if (job_control) {
+        setpgid(0, st->pgid);
+        if (st->foreground) tcsetpgrp(STDIN_FILENO, getpgrp());
+        for (int sig = 1; sig < NSIG; sig++) {
+            if (sigismember(&job_signals, sig) == 1) signal(sig, SIG_DFL);
+        }
+    }
+    sigset_t none;
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+}
+
+/* wire the stage's descriptors onto stdin/stdout/stderr in the child */
+static void setup_stage_fds(const stage_t *st) {
+    if (st->in_fd != -1) dup2(st->in_fd, STDIN_FILENO);
+    if (st->out_fd != -1) dup2(st->out_fd, STDOUT_FILENO);
+    if (st->err_fd != -1) dup2(st->err_fd, STDERR_FILENO);
+}
+
+/*
+ State shared with the clone(CLONE_VM|CLONE_VFORK) child. The parent is
+ suspended until the child execs or exits, so one static stack is enough.
+*/
+#define VFORK_STACK_SIZE (64 * 1024)
+static char vfork_stack[VFORK_STACK_SIZE] __attribute__((aligned(16)));
+
+typedef struct {
+    const stage_t *stage;
+    volatile int   err;   // errno of a failed exec, written by the child
+} vfork_args_t;
+
+static int vfork_child(void *arg) {
+    vfork_args_t *a = arg;
+    setup_stage_job(a->stage);
+    setup_stage_fds(a->stage);
+    execv(a->stage->path, a->stage->argv);
+    a->err = errno;
+    _exit(127);
+}
+
+/*
+ Launch one external stage with the configured backend. Returns the pid, or
+ -1 if the command could not be started. For posix_spawn and vfork the
+ parent only resumes once the child has exec'd, so the elapsed time is the
+ spawn-to-exec latency for free; fork needs an O_CLOEXEC pipe to see it.
+*/
+static pid_t launch_stage(stage_t *st) {
+    const char *name = st->argv[0];
+    double t0 = now_us();
+    pid_t pid = -1;
+    int err = 0;
+
+    switch (config.spawn_backend) {
+    case SPAWN_POSIX: {
+        extern char **environ;
+        posix_spawn_file_actions_t fa;
+        posix_spawnattr_t attr;
+        sigset_t none;
+        posix_spawn_file_actions_init(&fa);
+        posix_spawnattr_init(&attr);
+        if (st->in_fd != -1)
+            posix_spawn_file_actions_adddup2(&fa, st->in_fd, STDIN_FILENO);
+        if (st->out_fd != -1)
+            posix_spawn_file_actions_adddup2(&fa, st->out_fd, STDOUT_FILENO);
+        if (st->err_fd != -1)
+            posix_spawn_file_actions_adddup2(&fa, st->err_fd, STDERR_FILENO);
+
+        // same job setup as setup_stage_job(), done by posix_spawn itself
+        short flags = POSIX_SPAWN_SETSIGMASK;
+        sigemptyset(&none);
+        posix_spawnattr_setsigmask(&attr, &none);
+        if (job_control) {
+            flags |= POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGDEF;
+            posix_spawnattr_setpgroup(&attr, st->pgid);
+            posix_spawnattr_setsigdefault(&attr, &job_signals);
+#ifdef __GLIBC_PREREQ
+#if __GLIBC_PREREQ(2, 35)
+            if (st->foreground)
+                posix_spawn_file_actions_addtcsetpgrp_np(&fa, STDIN_FILENO);
+#endif
+#endif
+        }
+        posix_spawnattr_setflags(&attr, flags);
+        err = posix_spawn(&pid, st->path, &fa, &attr, st->argv, environ);
+        posix_spawnattr_destroy(&attr);
+        posix_spawn_file_actions_destroy(&fa);
+        if (err) pid = -1;
+        break;
+    }
+    case SPAWN_VFORK: {
+        vfork_args_t a = { st, 0 };
+        pid = clone(vfork_child, vfork_stack + VFORK_STACK_SIZE,
+                    CLONE_VM | CLONE_VFORK | SIGCHLD, &a);
+        if (pid < 0) {
+            perror("clone failed");
+            return -1;
+        }
+        err = a.err;   // the child has already exited if this is set
+        break;
+    }
+    default: {
+        // the write end closes on a successful exec; an errno arrives otherwise
+        int sync[2] = {-1, -1};
+        if (config.spawn_timing && pipe2(sync, O_CLOEXEC) < 0) sync[0] = sync[1] = -1;
+
+        pid = fork();
+        if (pid == 0) {
+            setup_stage_job(st);
+            setup_stage_fds(st);
+            execv(st->path, st->argv);
+            int e = errno;
+            if (sync[1] != -1) write(sync[1], &e, sizeof(e));
+            _exit(127);
+        } else if (pid < 0) {
+            perror("fork failed");
+            if (sync[0] != -1) { close(sync[0]); close(sync[1]); }
+            return -1;
+        }
+        if (sync[0] != -1) {
+            close(sync[1]);
+            if (read(sync[0], &err, sizeof(err)) != sizeof(err)) err = 0;
+            close(sync[0]);
+        } else {
+            // no sync pipe: the child reports its own failure
+            return pid;
+        }
+        break;
+    }
+    }
+
+    if (err) {
+        if (err == ENOENT)
+            fprintf(stderr, "cseshell: command not found: %s\n", name);
+        else
+            fprintf(stderr, "cseshell: %s: %s\n", name, strerror(err));
+        return pid;   // a vfork/fork child still has to be reaped
+    }
+
+    if (config.spawn_timing) {
+        spawn_stat_t *ss = &spawn_stats[config.spawn_backend];
+        st->spawn_us = now_us() - t0;
+        if (ss->count == 0 || st->spawn_us < ss->min_us) ss->min_us = st->spawn_us;
+        if (st->spawn_us > ss->max_us) ss->max_us = st->spawn_us;
+        ss->total_us += st->spawn_us;
+        ss->count++;
+    }
+    return pid;
+}
+
+/*
+ Cut the token vector on "|" into stages. The "|" slots are overwritten with
+ NULL so every stage gets its own NULL terminated argv.
+ Returns the number of stages, or -1 on a syntax error.
+*/
+static int split_pipeline(char **cmd, stage_t *stages) {
+    int n = 0;
+    stages[n++].argv = cmd;
+    for (int i = 0; cmd[i]; i++) {
+        if (strcmp(cmd[i], "|") != 0) continue;
+        cmd[i] = NULL;
+        stages[n++].argv = &cmd[i + 1];
+    }
+    for (int i = 0; i < n; i++) {
+        if (!stages[i].argv[0]) {
+            fprintf(stderr, "cseshell: syntax error near '|'\n");
+            return -1;
+        }
+        stages[i].pid = -1;
+        stages[i].path = NULL;
+        stages[i].in_fd = stages[i].out_fd = stages[i].err_fd = -1;
+        stages[i].spawn_us = 0;
+        stages[i].pgid = 0;
+        stages[i].foreground = 1;
+    }
+    return n;
+}
+
+/*
+ Start every stage of the pipeline at once, connected by O_CLOEXEC pipes,
+ as job j. Builtins inside a multi-stage pipeline run in a forked child so
+ "history | grep ls" works like any other stage; external commands go
+ through launch_stage() and whichever backend is configured. A foreground
+ job is waited for; a background one is left to reap_children().
+*/
+static void run_pipeline(stage_t *stages, int n, job_t *j) {
+    int prev_read = -1;
+
+    fflush(stdout);  // don't let children inherit pending prompt output
+
+    for (int i = 0; i < n; i++) {
+        int fds[2] = {-1, -1};
+        if (i < n - 1 && pipe2(fds, O_CLOEXEC) < 0) {
+            perror("pipe2");
+            break;
+        }
+        stages[i].in_fd  = prev_read;
+        stages[i].out_fd = fds[1];
+        stages[i].pgid = j->pgid;   // 0 until the first stage has started
+        stages[i].foreground = !j->background;
+
+        int b = find_builtin(stages[i].argv[0]);
+        if (b >= 0) {
+            pid_t pid = fork();
+            if (pid == 0) {
+                setup_stage_job(&stages[i]);
+                setup_stage_fds(&stages[i]);
+                builtin_command_func[b](stages[i].argv);
+                fflush(stdout);
+                _exit(EXIT_SUCCESS);
+            } else if (pid < 0) {
+                perror("fork failed");
+            }
+            stages[i].pid = pid;
+        } else if ((b = find_multicall(stages[i].argv[0])) >= 0) {
+            // a program linked into the shell: fork, but skip the exec
+            int argc = 0;
+            while (stages[i].argv[argc]) argc++;
+            pid_t pid = fork();
+            if (pid == 0) {
+                setup_stage_job(&stages[i]);
+                setup_stage_fds(&stages[i]);
+                optind = 0;
+                int status = multicall_func[b](argc, stages[i].argv);
+                fflush(stdout);
+                fflush(stderr);
+                _exit(status);
+            } else if (pid < 0) {
+                perror("fork failed");
+            }
+            stages[i].pid = pid;
+        } else if ((stages[i].path = resolve_command(stages[i].argv[0])) != NULL) {
+            stages[i].pid = launch_stage(&stages[i]);
+        } else {
+            fprintf(stderr, "cseshell: command not found: %s\n", stages[i].argv[0]);
+        }
+
+        pid_t pid = stages[i].pid;
+        j->pids[j->npids++] = pid;
+        if (pid > 0) {
+            j->nalive++;
+            if (!j->pgid) j->pgid = pid;
+            // also done here so the group exists whichever side runs first
+            if (job_control) setpgid(pid, j->pgid);
+        }
+
+        // parent: the child owns its ends now
+        if (prev_read != -1) close(prev_read);
+        if (fds[1] != -1) close(fds[1]);
+        prev_read = fds[0];
+    }
+    if (prev_read != -1) close(prev_read);
+
+    if (j->nalive == 0) {
+        last_status = j->status;
+        last_duration_us = 0;
+        memset(&last_usage, 0, sizeof(last_usage));
+        job_free(j);
+    } else if (j->background) {
+        current_job = j - jobs;
+        if (interactive) printf("[%d] %d\n", (int)(j - jobs) + 1, (int)j->pgid);
+        last_status = 0;
+    } else {
+        foreground_job(j, 0);
+    }
+}
+
+/*
+ Run program t of multicall_func[] inside the shell, accounted like a job:
+ the rusage is the shell's own growth over the call. ru_maxrss is the
+ shell's lifetime high-water mark, not the program's, so it is reported as
+ unknown (0) and left out of the statistics.
+*/
+static void run_multicall(int t, char **argv, const char *label) {
+    struct rusage before, after;
+    double start = now_us();
+    getrusage(RUSAGE_SELF, &before);
+    last_status = multicall_run(multicall_func[t], argv, -1);
+    getrusage(RUSAGE_SELF, &after);
+    last_duration_us = now_us() - start;
+
+    last_usage = after;
+    last_usage.ru_maxrss = 0;
+    timersub(&after.ru_utime, &before.ru_utime, &last_usage.ru_utime);
+    timersub(&after.ru_stime, &before.ru_stime, &last_usage.ru_stime);
+    last_usage.ru_minflt  -= before.ru_minflt;
+    last_usage.ru_majflt  -= before.ru_majflt;
+    last_usage.ru_inblock -= before.ru_inblock;
+    last_usage.ru_oublock -= before.ru_oublock;
+    last_usage.ru_nvcsw   -= before.ru_nvcsw;
+    last_usage.ru_nivcsw  -= before.ru_nivcsw;
+
+    const struct rusage *u = &last_usage;
+    stats_record(label, last_duration_us,
+                 u->ru_utime.tv_sec * 1e6 + u->ru_utime.tv_usec +
+                 u->ru_stime.tv_sec * 1e6 + u->ru_stime.tv_usec,
+                 u->ru_maxrss);
+    report_resource_usage(label, &last_usage, last_duration_us, 0);
+}
+
+/*
+ Run one tokenized command line: a builtin, a single external command, or a
+ pipeline of them, in the background if the line ends with "&". The tokens
+ are left for the caller to free.
+*/
+static void execute_command(char **cmd) {
+    stage_t stages[MAX_ARGS];
+    int argc = 0, background = 0;
+
+    // scripts never reach a prompt, so collect finished jobs here as well
+    reap_children();
+    notify_jobs();
+
+    while (cmd[argc]) argc++;
+    if (strcmp(cmd[argc - 1], "&") == 0) {
+        background = 1;
+        cmd[--argc] = NULL;
+        if (argc == 0) {
+            fprintf(stderr, "cseshell: syntax error near '&'\n");
+            return;
+        }
+    }
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(cmd[i], "&") == 0) {
+            fprintf(stderr, "cseshell: syntax error near '&'\n");
+            return;
+        }
+    }
+
+    // the line as typed, for jobs and notifications
+    char text[MAX_LINE_LEN] = {0};
+    for (int i = 0; i < argc; i++) {
+        if (i) strncat(text, " ", sizeof(text) - strlen(text) - 1);
+        strncat(text, cmd[i], sizeof(text) - strlen(text) - 1);
+    }
+
+    int n = split_pipeline(cmd, stages);
+    if (n < 0) return;
+    cmd_hash.line++;   // PATH directories get re-checked once per line
+
+    // a lone builtin runs inside the shell so cd/setenv affect it
+    if (n == 1 && !background) {
+        int b = find_builtin(cmd[0]);
+        if (b >= 0) {
+            builtin_command_func[b](cmd);
+            last_status = 0;
+            last_duration_us = 0;
+            return;
+        }
+        // at the prompt a forked child keeps Ctrl-C and Ctrl-Z working
+        int t = find_multicall(cmd[0]);
+        if (t >= 0 && !multicall_threaded[t] && (!interactive || config.multicall == MULTICALL_ALWAYS)) {
+            run_multicall(t, cmd, cmd[0]);
+            return;
+        }
+    }
+
+    // label such as "ldr | grep" for the resource report
+    char label[MAX_LINE_LEN] = {0};
+    for (int i = 0; i < n; i++) {
+        if (i) strncat(label, " | ", sizeof(label) - strlen(label) - 1);
+        strncat(label, stages[i].argv[0], sizeof(label) - strlen(label) - 1);
+    }
+
+    job_t *j = job_alloc(text, label, background);
+    if (!j) return;
+
+    run_pipeline(stages, n, j);
+    if (background) return;   // reported when it finishes
+
+    // mean spawn-to-exec latency over the stages that were measured
+    double spawn_us = 0; int launched = 0;
+    for (int i = 0; i < n; i++) {
+        if (stages[i].spawn_us > 0) { spawn_us += stages[i].spawn_us; launched++; }
+    }
+    report_resource_usage(label, &last_usage, last_duration_us, launched ? spawn_us / launched : 0);
+}
+
 /*void read_command(char **cmd) {
     char line[MAX_LINE]; int count = 0, i = 0;
     char *array[MAX_ARGS], *command_token;
@@ -291,88 +1613,302 @@ int num_builtin_functions() {
     for (int j = 0; j < i; j++) cmd[j] = array[j];
     cmd[i] = NULL;
 }*/
-void read_command(char **cmd) {
-    struct termios orig, raw;
-    char prompt_buf[64] = {0};
-    char buf[MAX_LINE]     = {0};
-    int  pos = 0, hist_i;
+/*
+ Interactive line editor. Keystrokes are read in chunks of up to
+ EDIT_CHUNK bytes and every screen update is queued in ed.out, which is
+ written once before the next blocking read. A pasted 4 KB command
+ therefore costs a couple of syscalls, and each keypress at most one write.
+ Only the part of the line that changed is redrawn; the prompt itself is
+ never repainted while editing.
+*/
+#define EDIT_CHUNK 4096
+
+static struct {
+    unsigned char in[EDIT_CHUNK];  // typed-ahead bytes survive across lines
+    size_t in_pos, in_len;
+    char  *out;                    // pending terminal output
+    size_t out_len, out_cap;
+    char  *line;                   // the line being edited
+    size_t len, cap;
+    size_t pos;                    // cursor position inside line
+} ed;
+
+static void ed_emit(const char *s, size_t n) {
+    if (ed.out_len + n > ed.out_cap) {
+        ed.out_cap = (ed.out_len + n) * 2;
+        ed.out = realloc(ed.out, ed.out_cap);
+    }
+    memcpy(ed.out + ed.out_len, s, n);
+    ed.out_len += n;
+}
 
-    // 1) enable raw mode
-    tcgetattr(STDIN_FILENO, &orig);
-    raw = orig;
-    raw.c_lflag &= ~(ECHO | ICANON);
-    tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
+static void ed_flush(void) {
+    size_t off = 0;
+    while (off < ed.out_len) {
+        ssize_t n = write(STDOUT_FILENO, ed.out + off, ed.out_len - off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        off += n;
+    }
+    ed.out_len = 0;
+}
 
-    hist_i = history_count;  // start "below" the latest history entry
+/* move the cursor n columns left or right */
+static void ed_move(long n) {
+    char seq[32];
+    if (n == 0) return;
+    if (n == -1) { ed_emit("\b", 1); return; }
+    int k = snprintf(seq, sizeof(seq), "\x1b[%ld%c", n < 0 ? -n : n, n < 0 ? 'D' : 'C');
+    ed_emit(seq, k);
+}
 
-    // 3) read keystroke-by-keystroke
-    while (1) {
-        char c;
-        if (read(STDIN_FILENO, &c, 1) != 1) break;
+/* next input byte, or -1 at end of input; flushes output before blocking */
+static int ed_getc(void) {
+    if (ed.in_pos == ed.in_len) {
+        ed_flush();
+        // children that exit while we wait for a key are reaped right away
+        if (sigchld_fd != -1) {
+            struct pollfd pfd[2] = { { STDIN_FILENO, POLLIN, 0 }, { sigchld_fd, POLLIN, 0 } };
+            for (;;) {
+                if (poll(pfd, 2, -1) < 0) {
+                    if (errno == EINTR) continue;
+                    break;
+                }
+                if (pfd[1].revents) reap_children();
+                if (pfd[0].revents) break;
+            }
+        }
+        ssize_t n;
+        do n = read(STDIN_FILENO, ed.in, sizeof(ed.in));
+        while (n < 0 && errno == EINTR);
+        if (n <= 0) return -1;
+        ed.in_pos = 0;
+        ed.in_len = n;
+    }
+    return ed.in[ed.in_pos++];
+}
 
-        // Enter: finish reading
-        if (c == '\r' || c == '\n') {
-            write(STDIN_FILENO, "\r\n", 2);
+static void ed_reserve(size_t need) {
+    if (need + 1 > ed.cap) {
+        ed.cap = (need + 1) * 2;
+        ed.line = realloc(ed.line, ed.cap);
+    }
+}
+
+/* insert a run of bytes at the cursor, redrawing only the tail */
+static void ed_insert(const char *s, size_t n) {
+    ed_reserve(ed.len + n);
+    memmove(ed.line + ed.pos + n, ed.line + ed.pos, ed.len - ed.pos);
+    memcpy(ed.line + ed.pos, s, n);
+    ed.len += n;
+    ed_emit(ed.line + ed.pos, ed.len - ed.pos);
+    ed.pos += n;
+    ed_move(-(long)(ed.len - ed.pos));
+}
+
+/* delete n bytes starting at the cursor */
+static void ed_delete(size_t n) {
+    if (n == 0) return;
+    memmove(ed.line + ed.pos, ed.line + ed.pos + n, ed.len - ed.pos - n);
+    ed.len -= n;
+    ed_emit(ed.line + ed.pos, ed.len - ed.pos);
+    ed_emit("\x1b[K", 3);
+    ed_move(-(long)(ed.len - ed.pos));
+}
+
+/* replace the whole line, only rewriting what differs from the old text */
+static void ed_replace(const char *s, size_t n) {
+    size_t common = 0;
+    while (common < n && common < ed.len && ed.line[common] == s[common]) common++;
+    ed_move((long)common - (long)ed.pos);
+    ed_reserve(n);
+    memcpy(ed.line, s, n);
+    ed_emit(ed.line + common, n - common);
+    if (n < ed.len) ed_emit("\x1b[K", 3);
+    ed.len = ed.pos = n;
+}
+
+/*
+ Ctrl-R incremental reverse search through the history index. Returns 1 if
+ Enter accepted the match; any other key that is not part of the search
+ leaves the match in the line for editing and is handled by the editor.
+*/
+static int ed_reverse_search(void) {
+    char query[256] = {0};
+    size_t qlen = 0;
+    long match = -1;
+    int failing = 0, accept = 0, cancel = 0;
+
+    for (;;) {
+        size_t mlen = 0;
+        const char *m = match >= 0 ? history_get(match, &mlen) : "";
+        ed_emit("\r\x1b[K", 4);
+        if (failing) ed_emit("failing ", 8);
+        ed_emit("(reverse-i-search)`", 19);
+        ed_emit(query, qlen);
+        ed_emit("': ", 3);
+        ed_emit(m, mlen);
+
+        int c = ed_getc();
+        if (c < 0 || c == 3 || c == 7) { cancel = 1; break; }   // Ctrl-C / Ctrl-G
+        if (c == '\r' || c == '\n') { accept = 1; break; }
+        if (c == 18) {                                         // Ctrl-R: older match
+            long older = qlen ? history_search(query, match >= 0 ? match : (long)history_size()) : -1;
+            failing = (older < 0);
+            if (older >= 0) match = older;
+        } else if (c == 127 || c == '\b') {
+            if (qlen) query[--qlen] = '\0';
+            match = qlen ? history_search(query, history_size()) : -1;
+            failing = 0;
+        } else if (c >= 32) {
+            if (qlen < sizeof(query) - 1) query[qlen++] = c;
+            // the current match may still fit the longer query
+            long m2 = history_search(query, match >= 0 ? match + 1 : (long)history_size());
+            failing = (m2 < 0);
+            if (m2 >= 0) match = m2;
+        } else {
+            ed.in_pos--;        // let the editor see this key
             break;
         }
-        // Backspace
-        else if (c == 127 || c == '\b') {
-            if (pos > 0) {
-                pos--;
-                write(STDOUT_FILENO, "\b \b", 3);
+    }
+
+    if (!cancel && match >= 0) {
+        size_t mlen;
+        const char *m = history_get(match, &mlen);
+        ed_reserve(mlen);
+        memcpy(ed.line, m, mlen);
+        ed.len = mlen;
+    }
+    ed.pos = ed.len;
+
+    // back to the normal prompt with the chosen line
+    ed_emit("\r\x1b[K", 4);
+    ed_flush();
+    type_prompt();
+    ed_emit(ed.line, ed.len);
+    return accept;
+}
+
+/*
+ Read one line from the terminal. Returns the line, which stays valid until
+ the next call, or NULL at end of input (Ctrl-D on an empty line).
+*/
+char *read_command(void) {
+    struct termios orig, raw;
+    size_t hist_i = history_size();  // start "below" the latest history entry
+    char *eof = NULL, *result = NULL;
+
+    // 1) enable raw mode; TCSADRAIN keeps keys typed while a command ran
+    tcgetattr(STDIN_FILENO, &orig);
+    raw = orig;
+    raw.c_lflag &= ~(ECHO | ICANON | ISIG | IEXTEN);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+
+    ed_reserve(0);
+    ed.len = ed.pos = 0;
+
+    while (!result) {
+        int c = ed_getc();
+        if (c < 0) { result = eof; break; }
+
+        switch (c) {
+        case '\r': case '\n':                 // Enter: finish reading
+            ed_emit("\r\n", 2);
+            result = ed.line;
+            break;
+        case 127: case '\b':                  // Backspace
+            if (ed.pos > 0) {
+                ed.pos--;
+                ed_emit("\b", 1);
+                ed_delete(1);
             }
+            break;
+        case 1:  ed_move(-(long)ed.pos); ed.pos = 0; break;          // Ctrl-A
+        case 5:  ed_emit(ed.line + ed.pos, ed.len - ed.pos);          // Ctrl-E
+                 ed.pos = ed.len; break;
+        case 11: ed_delete(ed.len - ed.pos); break;                   // Ctrl-K
+        case 21: {                                                    // Ctrl-U
+            size_t n = ed.pos;
+            ed_move(-(long)n);
+            ed.pos = 0;
+            ed_delete(n);
+            break;
         }
-        // Escape sequence? → arrow keys
-        else if (c == 0x1B) {
-            char seq[2];
-            if (read(STDIN_FILENO, &seq[0], 1) != 1) continue;
-            if (read(STDIN_FILENO, &seq[1], 1) != 1) continue;
-
-            if (seq[0] == '[') {
-        	if (seq[1] == 'A' && hist_i > 0)      hist_i--;
-        	else if (seq[1] == 'B' && hist_i < history_count) hist_i++;
-        	else continue;
-
-        	// erase the whole line
-        	write(STDOUT_FILENO, "\r\x1b[2K", 5);
-
-        	// copy history or blank
-        	if (hist_i < history_count) {
-            	    strcpy(buf, history[hist_i]);
-            	    pos = strlen(buf);
-        	} else {
-            	    buf[0] = '\0'; pos = 0;
-        	}
-
-       		type_prompt();
-        	write(STDOUT_FILENO, buf, pos);
-    	    }
-        }
-        // Normal character
-        else {
-            if (pos < MAX_LINE - 1) {
-                buf[pos++] = c;
-                write(STDOUT_FILENO, &c, 1);
+        case 18:                              // Ctrl-R: reverse search
+            if (ed_reverse_search()) {
+                ed_emit("\r\n", 2);
+                result = ed.line;
+            }
+            break;
+        case 3:                               // Ctrl-C: drop the line
+            ed_emit("^C\r\n", 4);
+            ed.len = 0;
+            result = ed.line;
+            break;
+        case 4:                               // Ctrl-D: EOF on an empty line
+            if (ed.len == 0) { ed_emit("\r\n", 2); goto done; }
+            if (ed.pos < ed.len) ed_delete(1);
+            break;
+        case 0x1B: {                          // Escape sequence: arrows etc.
+            int c1 = ed_getc(), c2 = ed_getc();
+            if (c1 != '[' && c1 != 'O') break;
+            if (c2 >= '0' && c2 <= '9') {     // ESC [ n ~
+                int c3 = ed_getc();
+                if (c3 != '~') break;
+                if (c2 == '1' || c2 == '7') c2 = 'H';
+                else if (c2 == '4' || c2 == '8') c2 = 'F';
+                else if (c2 == '3') { if (ed.pos < ed.len) ed_delete(1); break; }
+                else break;
+            }
+            switch (c2) {
+            case 'A': case 'B': {             // Up / Down: history recall
+                size_t hlen = 0;
+                const char *h = "";
+                if (c2 == 'A' && hist_i > 0) hist_i--;
+                else if (c2 == 'B' && hist_i < history_size()) hist_i++;
+                else break;
+                if (hist_i < history_size()) h = history_get(hist_i, &hlen);
+                ed_replace(h, hlen);
+                break;
             }
+            case 'D':                         // Left
+                if (ed.pos > 0) { ed.pos--; ed_move(-1); }
+                break;
+            case 'C':                         // Right
+                if (ed.pos < ed.len) { ed_emit(ed.line + ed.pos, 1); ed.pos++; }
+                break;
+            case 'H':                         // Home
+                ed_move(-(long)ed.pos); ed.pos = 0;
+                break;
+            case 'F':                         // End
+                ed_emit(ed.line + ed.pos, ed.len - ed.pos); ed.pos = ed.len;
+                break;
+            }
+            break;
+        }
+        default: {                            // Normal characters, in runs
+            if (c < 32) break;
+            size_t start = ed.in_pos - 1, end = ed.in_pos;
+            while (end < ed.in_len && ed.in[end] >= 32 && ed.in[end] != 127) end++;
+            ed_insert((char *)ed.in + start, end - start);
+            ed.in_pos = end;
+        }
         }
     }
+    ed.line[ed.len] = '\0';
 
+done:
+    ed_flush();
     // 4) disable raw mode
-    tcsetattr(STDIN_FILENO, TCSAFLUSH, &orig);
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &orig);
 
     // 5) record non-empty line into history
-    if (pos > 0 && history_count < MAX_HISTORY) {
-        history[history_count++] = strdup(buf);
+    if (result && ed.len > 0) {
+        history_add(ed.line);
     }
-
-    // 6) tokenize into cmd[]
-    int argc = 0;
-    char *tok = strtok(buf, " \n");
-    while (tok && argc < MAX_ARGS-1) {
-        cmd[argc++] = strdup(tok);
-        tok = strtok(NULL, " \n");
-    }
-    cmd[argc] = NULL;
+    return result;
 }
 
 // Draw the prompt according to current config
@@ -413,18 +1949,59 @@ void type_prompt() {
 }
 
 
-int main(void) {
+int main(int argc, char **argv) {
     //set initial values for prompt style config
     config.prompt_format  = strdup("\\u@\\w$ ");
     config.color_scheme   = strdup("default");
     config.show_timestamp = 0;
 
-    process_rc_file();
-    char *cmd[MAX_ARGS]; pid_t pid; int running = 1;
+    /*
+     cseshell -c 'cmd'   run the string and exit
+     cseshell script.sh  run the script and exit
+     cseshell < file     run stdin when it is not a terminal
+    */
+    int script_fd = -1;
+    char *script_str = NULL;
+    if (argc > 1 && strcmp(argv[1], "-c") == 0) {
+        if (argc < 3) {
+            fprintf(stderr, "cseshell: -c: option requires an argument\n");
+            return 2;
+        }
+        script_str = argv[2];
+    } else if (argc > 1) {
+        script_fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+        if (script_fd < 0) {
+            fprintf(stderr, "cseshell: %s: %s\n", argv[1], strerror(errno));
+            return 127;
+        }
+    } else if (!isatty(STDIN_FILENO)) {
+        script_fd = STDIN_FILENO;
+    }
+    interactive = (script_fd == -1 && script_str == NULL);
+    if (interactive) init_job_control();
+
+    // the resource report is interactive feedback; scripts and -c stay quiet
+    config.resource_report = interactive ? 0 : -1;
+
+    // orphaned grandchildren are reparented to us, so their usage is counted
+    prctl(PR_SET_CHILD_SUBREAPER, 1);
 
     static char root_path[2048] = "";
     if (!getcwd(root_path, sizeof(root_path))) { perror("getcwd"); exit(1); }
 
+    config.multicall = MULTICALL_AUTO;
+    char bin_dir[PATH_MAX];
+    snprintf(bin_dir, sizeof(bin_dir), "%s/bin", root_path);
+    multicall_init(bin_dir);
+    const char *home = getenv("HOME");
+
+    // every command is recorded, scripts included; see "stats"
+    char statsfile[PATH_MAX];
+    snprintf(statsfile, sizeof(statsfile), "%s/%s", home ? home : root_path, STATS_FILE);
+    stats_open(statsfile);
+
+    process_rc_file();
+
     // Prepend ./bin to PATH so our programs take precedence
     char *oldpath = getenv("PATH");
     char newpath[4096];
@@ -435,94 +2012,27 @@ int main(void) {
     }
     setenv("PATH", newpath, 1);
 
-    while (running) {
-        type_prompt();
-        read_command(cmd);
-        if (!cmd[0]) continue;
-        if (!strcmp(cmd[0], "exit")) { running = 0; continue; }
-
-	//built-in for set command
-    	if (strcmp(cmd[0], "set") == 0 && cmd[1] && strchr(cmd[1], '=')) {
-            char *eq    = strchr(cmd[1], '=');
-            *eq         = '\0';
-            char *key   = cmd[1];
-            char *value = eq + 1;
-
-            if (strcmp(key, "prompt_format") == 0) {
-            	free(config.prompt_format);
-            	config.prompt_format = strdup(value);
-            } else if (strcmp(key, "color_scheme") == 0) {
-            	free(config.color_scheme);
-            	config.color_scheme = strdup(value);
-            } else if (strcmp(key, "show_timestamp") == 0) {
-            	config.show_timestamp = atoi(value);
-            } else {
-            	fprintf(stderr, "Unknown setting “%s”\n", key);
-            }
-            continue;
-    	}
-
-	//built-in for history command
-	if (strcmp(cmd[0], "history") == 0) {
-    	    for (int i = 0; i < history_count; i++) {
-        // print with 1-based index
-        	printf("%4d  %s\n", i + 1, history[i]);
-    	    }
-    	continue;  // skip forking/execution
-	}
-
-
-
-        // Built-ins
-        int is_builtin = 0;
-        for (int i = 0; i < num_builtin_functions(); i++) {
-            if (!strcmp(cmd[0], builtin_commands[i])) {
-                builtin_command_func[i](cmd);
-                for (int j = 0; cmd[j]; j++) free(cmd[j]);
-                is_builtin = 1; break;
-            }
-        }
-        if (is_builtin) continue;
+    // non-interactive: no termios, prompt or history, just run the lines
+    if (!interactive) {
+        run_script(script_fd, script_str);
+        fflush(stdout);
+        return last_status;
+    }
 
-        // External commands
-        //snapshot of resource usage
-        getrusage(RUSAGE_CHILDREN, &prev_usage);
-        pid = fork();
-        if (pid == 0) {
-            execvp(cmd[0], cmd);
-            fprintf(stderr, "command %s not found\n", cmd[0]);
-            exit(EXIT_FAILURE);
-        } else if (pid > 0) {
-            wait(NULL);
-            getrusage(RUSAGE_CHILDREN, &curr_usage);
-            char *cmd_name = cmd[0];
-            // find before - after
-            double u = (curr_usage.ru_utime.tv_sec  - prev_usage.ru_utime.tv_sec)
-             + (curr_usage.ru_utime.tv_usec - prev_usage.ru_utime.tv_usec) / 1e6;
-            double s = (curr_usage.ru_stime.tv_sec  - prev_usage.ru_stime.tv_sec)
-             + (curr_usage.ru_stime.tv_usec - prev_usage.ru_stime.tv_usec) / 1e6;
-            long m = curr_usage.ru_maxrss - prev_usage.ru_maxrss;
-            long i = curr_usage.ru_inblock - prev_usage.ru_inblock;
-            long o = curr_usage.ru_oublock - prev_usage.ru_oublock;
-
-            // print resource stats
-            printf("\n");
-            printf("Resource usage for \"%s\":\n", cmd_name);
-            printf("  Amount of CPU time in user mode       : %.3f seconds\n", u);
-            printf("  Amount of CPU time in kernel mode     : %.3f seconds\n", s);
-            printf("  Peak RAM usage (max resident size)    : %ld KB\n", m);
-            printf("  Block I/O read operations             : %ld\n", i);
-            printf("  Block I/O write operations            : %ld\n", o);
-            printf("\n");
-
-
-            // reset for next command
-            prev_usage = curr_usage;
-            for (int i = 0; cmd[i]; i++) free(cmd[i]);
-        } else {
-            perror("fork failed"); running = 0;
-        }
+    // history lives in ~/.cseshell_history and is shared by all sessions
+    char histfile[PATH_MAX];
+    snprintf(histfile, sizeof(histfile), "%s/%s", home ? home : root_path, HISTORY_FILE);
+    if (history_open(histfile) != 0) perror(histfile);
+
+    for (;;) {
+        reap_children();
+        notify_jobs();
+        type_prompt();
+        char *line = read_command();
+        if (!line) break;                 // Ctrl-D on an empty line
+        execute_line(line);
     }
+    hangup_jobs();
     return 0;
 }
 
@@ -561,6 +2071,8 @@ int shell_cd(char **args) {
         chdir(root_path);
     }
 
+    prompt.cwd_dirty = 1;   // the prompt refreshes its cached cwd
+
     return 1;
 }
 
@@ -569,11 +2081,17 @@ int shell_help(char **args) {
     for (int i = 0; i < num_builtin_functions(); i++) {
         printf("  %s\n", builtin_commands[i]);
     }
+    printf("System programs built into the shell:\n");
+    for (int i = 0; i < num_multicall_programs(); i++) {
+        printf("  %s\n", multicall_commands[i]);
+    }
     return 1;
 }
 
 int shell_exit(char **args) {
-    exit(0);
+    hangup_jobs();
+    fflush(stdout);
+    exit(args[1] ? atoi(args[1]) : last_status);
 }
 
 int shell_usage(char **args) {
@@ -747,3 +2265,437 @@ int shell_calc(char **args) {
   printf("%g\n", result);
   return 1;
 }
+
+/*
+ Show the spawn-to-exec latency collected per launch backend while
+ "set spawn_timing=1" is on. "spawnstat -r" clears the counters.
+*/
+int shell_spawnstat(char **args) {
+    if (args[1] && strcmp(args[1], "-r") == 0) {
+        memset(spawn_stats, 0, sizeof(spawn_stats));
+        return 1;
+    }
+    printf("Current spawn backend: %s%s\n", spawn_backend_names[config.spawn_backend],
+           config.spawn_timing ? "" : " (timing off, use set spawn_timing=1)");
+    printf("  %-12s %8s %12s %12s %12s\n", "backend", "count", "mean(us)", "min(us)", "max(us)");
+    for (int i = 0; i < SPAWN_BACKENDS; i++) {
+        spawn_stat_t *ss = &spawn_stats[i];
+        if (ss->count == 0) {
+            printf("  %-12s %8d %12s %12s %12s\n", spawn_backend_names[i], 0, "-", "-", "-");
+            continue;
+        }
+        printf("  %-12s %8ld %12.1f %12.1f %12.1f\n", spawn_backend_names[i], ss->count,
+               ss->total_us / ss->count, ss->min_us, ss->max_us);
+    }
+    return 1;
+}
+
+/*
+ hash          list the cached command locations and their hit counts
+ hash -r       forget every cached location
+ hash name...  look the names up now and remember them
+*/
+int shell_hash(char **args) {
+    if (args[1] && strcmp(args[1], "-r") == 0) {
+        cmd_hash_clear();
+        return 1;
+    }
+    if (args[1]) {
+        for (int i = 1; args[i]; i++) {
+            if (!resolve_command(args[i]))
+                fprintf(stderr, "hash: %s: not found\n", args[i]);
+        }
+        return 1;
+    }
+    if (cmd_hash.count == 0) {
+        printf("hash: hash table empty\n");
+        return 1;
+    }
+    printf("hits\tcommand\n");
+    for (size_t i = 0; i < cmd_hash.cap; i++) {
+        hash_entry_t *e = &cmd_hash.slots[i];
+        if (!e->name) continue;
+        if (e->path) printf("%4ld\t%s\n", e->hits, e->path);
+        else         printf("%4ld\t%s (not found)\n", e->hits, e->name);
+    }
+    return 1;
+}
+
+static void print_history_entry(size_t i, const char *s, size_t len) {
+    // print with 1-based index
+    printf("%5zu  %.*s\n", i + 1, (int)len, s);
+}
+
+/*
+ history              list every entry
+ history N            list the last N entries
+ history search TEXT  list the entries containing TEXT, using the index
+*/
+int shell_history(char **args) {
+    size_t n = history_size(), from = 0;
+    if (args[1] && strcmp(args[1], "search") == 0) {
+        if (!args[2]) {
+            fprintf(stderr, "Usage: history search <text>\n");
+            return 1;
+        }
+        // the words after "search" form one query, as typed
+        char query[MAX_LINE_LEN] = {0};
+        for (int i = 2; args[i]; i++) {
+            if (i > 2) strncat(query, " ", sizeof(query) - strlen(query) - 1);
+            strncat(query, args[i], sizeof(query) - strlen(query) - 1);
+        }
+        history_each_match(query, print_history_entry);
+        return 1;
+    }
+    if (args[1] && atol(args[1]) > 0 && (size_t)atol(args[1]) < n) {
+        from = n - atol(args[1]);
+    }
+    for (size_t i = from; i < n; i++) {
+        size_t len;
+        const char *s = history_get(i, &len);
+        print_history_entry(i, s, len);
+    }
+    return 1;
+}
+
+/*
+ Resolve a job argument: "%2" or "2", or the current job when omitted.
+ Returns NULL after printing an error.
+*/
+static job_t *find_job(const char *cmd, const char *arg) {
+    int i = current_job;
+    if (arg) i = atoi(arg[0] == '%' ? arg + 1 : arg) - 1;
+    if (i < 0 || i >= MAX_JOBS || jobs[i].state == JOB_FREE || jobs[i].state == JOB_DONE) {
+        fprintf(stderr, "%s: %s: no such job\n", cmd, arg ? arg : "current");
+        return NULL;
+    }
+    return &jobs[i];
+}
+
+// list the background and stopped jobs
+int shell_jobs(char **args) {
+    (void)args;
+    reap_children();
+    for (int i = 0; i < MAX_JOBS; i++) {
+        if (jobs[i].state == JOB_FREE) continue;
+        print_job(&jobs[i]);
+        if (jobs[i].state == JOB_DONE) job_free(&jobs[i]);
+    }
+    return 1;
+}
+
+// fg [%n]: bring a job to the foreground and wait for it
+int shell_fg(char **args) {
+    job_t *j = find_job("fg", args[1]);
+    if (!j) return 1;
+    printf("%s\n", j->cmd);
+    fflush(stdout);
+    foreground_job(j, 1);
+    return 1;
+}
+
+// bg [%n]: let a stopped job continue in the background
+int shell_bg(char **args) {
+    job_t *j = find_job("bg", args[1]);
+    if (!j) return 1;
+    if (j->state == JOB_STOPPED) {
+        j->state = JOB_RUNNING;
+        j->background = 1;
+        kill(-j->pgid, SIGCONT);
+    }
+    current_job = j - jobs;
+    printf("[%d] %s &\n", (int)(j - jobs) + 1, j->cmd);
+    return 1;
+}
+
+/*
+ perf cmd [args...]: run one external command in the foreground with
+ performance counters attached and print them after the resource report.
+ The child is held on a pipe until the counters are open, whatever
+ spawn_backend is set to.
+*/
+int shell_perf(char **args) {
+    if (!args[1]) {
+        fprintf(stderr, "Usage: perf <command> [args...]\n");
+        return 1;
+    }
+    const char *path = resolve_command(args[1]);
+    if (!path) {
+        fprintf(stderr, "cseshell: command not found: %s\n", args[1]);
+        return 1;
+    }
+
+    char text[MAX_LINE_LEN] = {0};
+    for (int i = 1; args[i]; i++) {
+        if (i > 1) strncat(text, " ", sizeof(text) - strlen(text) - 1);
+        strncat(text, args[i], sizeof(text) - strlen(text) - 1);
+    }
+    job_t *j = job_alloc(text, args[1], 0);
+    if (!j) return 1;
+
+    stage_t st = { .argv = args + 1, .path = path, .pid = -1,
+                   .in_fd = -1, .out_fd = -1, .err_fd = -1, .pgid = 0, .foreground = 1 };
+    int go[2];
+    if (pipe2(go, O_CLOEXEC) < 0) {
+        perror("pipe2");
+        job_free(j);
+        return 1;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        char c;
+        setup_stage_job(&st);
+        close(go[1]);
+        if (read(go[0], &c, 1) < 0) _exit(127);   // EOF once the counters are open
+        execv(path, st.argv);
+        fprintf(stderr, "cseshell: %s: %s\n", args[1], strerror(errno));
+        _exit(127);
+    }
+    close(go[0]);
+    if (pid < 0) {
+        perror("fork failed");
+        close(go[1]);
+        job_free(j);
+        return 1;
+    }
+    j->pids[j->npids++] = pid;
+    j->nalive = 1;
+    j->pgid = pid;
+    if (job_control) setpgid(pid, pid);
+
+    int fds[PC_COUNTERS];
+    double val[PC_COUNTERS];
+    perf_open(pid, fds);
+    close(go[1]);
+
+    foreground_job(j, 0);
+    perf_read(fds, val);
+    if (j->state == JOB_STOPPED) return 1;   // counted only up to the stop
+    report_resource_usage(text, &last_usage, last_duration_us, 0);
+    report_perf_counters(text, val, last_duration_us);
+    return 1;
+}
+
+/*
+ stats          count, mean and percentiles of every recorded command
+ stats NAME     the same for NAME and the pipelines starting with it
+ stats -r       forget everything recorded so far
+*/
+int shell_stats(char **args) {
+    if (args[1] && strcmp(args[1], "-r") == 0) {
+        stats_reset();
+        return 1;
+    }
+    stats_print(args[1]);
+    return 1;
+}
+
+/*
+ Benchmarking. Each run goes through launch_stage(), so it uses the same
+ backend and PATH cache as a normal command, with stdin, stdout and stderr
+ on /dev/null. The child stays in the shell's process group: Ctrl-C
+ reaches it, which the shell (ignoring SIGINT) sees and stops the bench.
+*/
+typedef struct {
+    char      **argv;
+    int         runs;
+    double     *wall, *user, *sys;   // per run, in microseconds
+    int         failed;              // runs with a non-zero exit status
+} bench_t;
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double mean_of(const double *v, int n) {
+    double s = 0;
+    for (int i = 0; i < n; i++) s += v[i];
+    return n ? s / n : 0;
+}
+
+// sample standard deviation
+static double stddev_of(const double *v, int n) {
+    if (n < 2) return 0;
+    double m = mean_of(v, n), s = 0;
+    for (int i = 0; i < n; i++) s += (v[i] - m) * (v[i] - m);
+    return sqrt(s / (n - 1));
+}
+
+// linear interpolation between closest ranks; v must be sorted
+static double quantile_of(const double *v, int n, double q) {
+    double pos = q * (n - 1);
+    int i = (int)pos;
+    return i + 1 < n ? v[i] + (pos - i) * (v[i + 1] - v[i]) : v[n - 1];
+}
+
+// two-sided 95% Student t quantile for df degrees of freedom
+static double t95(double df) {
+    static const double t[] = { 0, 12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365,
+        2.306, 2.262, 2.228, 2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101,
+        2.093, 2.086, 2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042 };
+    int d = (int)df;
+    if (d < 1) d = 1;
+    if (d <= 30) return t[d];
+    return d <= 60 ? 2.000 : d <= 120 ? 1.980 : 1.960;
+}
+
+static void fmt_ms(char *out, size_t n, double us) {
+    snprintf(out, n, "%.3f ms", us / 1e3);
+}
+
+/*
+ Run b->argv warmup + b->runs times. Returns 0 if every run could be
+ started and none was interrupted.
+*/
+static int bench_run(bench_t *b, int warmup, int devnull) {
+    stage_t st = { .argv = b->argv, .pid = -1, .in_fd = devnull, .out_fd = devnull,
+                   .err_fd = devnull, .pgid = shell_pgid, .foreground = 0 };
+    st.path = resolve_command(b->argv[0]);
+    if (!st.path) {
+        fprintf(stderr, "cseshell: command not found: %s\n", b->argv[0]);
+        return -1;
+    }
+
+    for (int i = -warmup; i < b->runs; i++) {
+        int status;
+        struct rusage ru;
+        double t0 = now_us();
+        pid_t pid = launch_stage(&st);
+        if (pid < 0) return -1;
+        while (wait4(pid, &status, 0, &ru) < 0 && errno == EINTR)
+            ;
+        double wall = now_us() - t0;
+        if (WIFSIGNALED(status) && WTERMSIG(status) == SIGINT) {
+            fprintf(stderr, "\nbench: interrupted\n");
+            return -1;
+        }
+        if (i < 0) continue;   // warmup run, not measured
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) b->failed++;
+        b->wall[i] = wall;
+        b->user[i] = ru.ru_utime.tv_sec * 1e6 + ru.ru_utime.tv_usec;
+        b->sys[i]  = ru.ru_stime.tv_sec * 1e6 + ru.ru_stime.tv_usec;
+    }
+    return 0;
+}
+
+static void bench_report(int index, const bench_t *b) {
+    static const char *labels[] = { "wall", "user", "sys" };
+    const double *series[] = { b->wall, b->user, b->sys };
+    int n = b->runs;
+    double *v = malloc(n * sizeof(double));
+
+    printf("Benchmark %d:", index);
+    for (int i = 0; b->argv[i]; i++) printf(" %s", b->argv[i]);
+    printf("  (%d run%s)\n", n, n == 1 ? "" : "s");
+    printf("  %-5s %12s %12s %12s %12s %12s\n", "", "mean", "stddev", "min", "median", "max");
+    for (int k = 0; k < 3; k++) {
+        char s[5][32];
+        memcpy(v, series[k], n * sizeof(double));
+        qsort(v, n, sizeof(double), cmp_double);
+        fmt_ms(s[0], sizeof(s[0]), mean_of(v, n));
+        fmt_ms(s[1], sizeof(s[1]), stddev_of(v, n));
+        fmt_ms(s[2], sizeof(s[2]), v[0]);
+        fmt_ms(s[3], sizeof(s[3]), quantile_of(v, n, 0.5));
+        fmt_ms(s[4], sizeof(s[4]), v[n - 1]);
+        printf("  %-5s %12s %12s %12s %12s %12s\n", labels[k], s[0], s[1], s[2], s[3], s[4]);
+    }
+
+    // Tukey's fences on wall time: outside [Q1 - 1.5 IQR, Q3 + 1.5 IQR]
+    memcpy(v, b->wall, n * sizeof(double));
+    qsort(v, n, sizeof(double), cmp_double);
+    double q1 = quantile_of(v, n, 0.25), q3 = quantile_of(v, n, 0.75), iqr = q3 - q1;
+    int outliers = 0;
+    for (int i = 0; i < n; i++) {
+        if (v[i] < q1 - 1.5 * iqr || v[i] > q3 + 1.5 * iqr) outliers++;
+    }
+    if (outliers)
+        printf("  %d outlier%s in wall time (Tukey fences); the system may have been busy\n",
+               outliers, outliers == 1 ? "" : "s");
+    if (b->failed)
+        printf("  exited with a non-zero status in %d run%s\n", b->failed, b->failed == 1 ? "" : "s");
+    printf("\n");
+    free(v);
+}
+
+/*
+ Ratio of the mean wall times with a 95% confidence interval from the
+ delta method and Welch's degrees of freedom.
+*/
+static void bench_compare(const bench_t *a, const bench_t *b) {
+    double ma = mean_of(a->wall, a->runs), mb = mean_of(b->wall, b->runs);
+    double va = pow(stddev_of(a->wall, a->runs), 2) / a->runs;   // variance of the mean
+    double vb = pow(stddev_of(b->wall, b->runs), 2) / b->runs;
+    const bench_t *fast = ma <= mb ? a : b;
+    int fast_index = fast == a ? 1 : 2;
+    double r = ma <= mb ? mb / ma : ma / mb;
+    double se = r * sqrt(va / (ma * ma) + vb / (mb * mb));
+
+    double df = 1e9;   // Welch-Satterthwaite
+    if (va + vb > 0 && a->runs > 1 && b->runs > 1)
+        df = (va + vb) * (va + vb) / (va * va / (a->runs - 1) + vb * vb / (b->runs - 1));
+    double h = t95(df) * se;
+
+    printf("Benchmark %d (%s) ran %.2f ± %.2f times faster than benchmark %d (%s)\n",
+           fast_index, fast->argv[0], r, h, 3 - fast_index, (fast == a ? b : a)->argv[0]);
+    printf("  95%% confidence interval: %.2f … %.2f", r - h, r + h);
+    if (r - h <= 1.0) printf("  (not a significant difference)");
+    printf("\n");
+}
+
+/*
+ bench [-n N] [-w W] cmd [args...] [--vs cmd [args...]]
+ Run the command N times (default 10) after W warmup runs (default 0)
+ with its output discarded, and report wall, user and sys time. With
+ --vs both commands are measured and their speed compared.
+*/
+int shell_bench(char **args) {
+    int runs = 10, warmup = 0, i = 1;
+    for (; args[i] && args[i][0] == '-' && args[i + 1]; i += 2) {
+        if (strcmp(args[i], "-n") == 0)      runs = atoi(args[i + 1]);
+        else if (strcmp(args[i], "-w") == 0) warmup = atoi(args[i + 1]);
+        else break;
+    }
+    if (!args[i] || runs < 1 || warmup < 0) {
+        fprintf(stderr, "Usage: bench [-n runs] [-w warmup] <command> [args...] [--vs <command> [args...]]\n");
+        return 1;
+    }
+
+    bench_t b[2];
+    int nb = 1;
+    b[0].argv = &args[i];
+    for (; args[i]; i++) {
+        if (strcmp(args[i], "--vs") != 0) continue;
+        args[i] = NULL;   // ends the first command's argv
+        if (!args[i + 1]) {
+            fprintf(stderr, "bench: --vs needs a command\n");
+            return 1;
+        }
+        b[nb++].argv = &args[i + 1];
+        break;
+    }
+
+    int devnull = open("/dev/null", O_RDWR | O_CLOEXEC);
+    if (devnull < 0) {
+        perror("/dev/null");
+        return 1;
+    }
+    cmd_hash.line++;
+    int ok = 1;
+    for (int k = 0; k < nb; k++) {
+        b[k].runs = runs;
+        b[k].failed = 0;
+        b[k].wall = malloc(3 * runs * sizeof(double));
+        b[k].user = b[k].wall + runs;
+        b[k].sys  = b[k].user + runs;
+    }
+    for (int k = 0; k < nb && ok; k++) {
+        if (bench_run(&b[k], warmup, devnull) != 0) ok = 0;
+        else bench_report(k + 1, &b[k]);
+    }
+    if (ok && nb == 2) bench_compare(&b[0], &b[1]);
+    for (int k = 0; k < nb; k++) free(b[k].wall);
+    close(devnull);
+    return 1;
+}
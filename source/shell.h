@@ -23,7 +23,16 @@ const char *builtin_commands[] = {
     "batman",
     "cyclops",
     "squidward",
-    "calc"
+    "calc",
+    "spawnstat", // Shows spawn-to-exec latency per launch backend
+    "hash",      // Lists or clears the cached command locations
+    "history",   // Displays a list of previously entered commands
+    "jobs",      // Lists background and stopped jobs
+    "fg",        // Brings a job to the foreground
+    "bg",        // Resumes a stopped job in the background
+    "perf",      // Runs a command with hardware performance counters
+    "stats",     // Shows timing and memory statistics of past commands
+    "bench"      // Runs a command repeatedly and reports timing statistics
     };
 
     /*
@@ -40,3 +49,35 @@ int shell_batman(char **args);
 int shell_cyclops(char **args);
 int shell_squidward(char **args);
 int shell_calc(char **args);
+int shell_spawnstat(char **args);
+int shell_hash(char **args);
+int shell_history(char **args);
+int shell_jobs(char **args);
+int shell_fg(char **args);
+int shell_bg(char **args);
+int shell_perf(char **args);
+int shell_stats(char **args);
+int shell_bench(char **args);
+
+/*
+ System programs that are also linked into the shell (see multicall.h).
+ When PATH leads to one of these in the shell's bin directory it can run
+ in-process instead of being exec'ed; see "set multicall".
+*/
+const char *multicall_commands[] = {
+    "ld",     // Lists a directory
+    "ldr",    // Lists a directory tree
+    "find",   // Finds files by name
+    "sys",    // Shows system information
+    "dcheck", // Counts the running daemons
+    "backup", // Backs up BACKUP_DIR into ./archive
+    "restore" // Lists, verifies or restores a backup archive
+    };
+
+int ld_main(int argc, char **argv);
+int ldr_main(int argc, char **argv);
+int find_main(int argc, char **argv);
+int sys_main(int argc, char **argv);
+int dcheck_main(int argc, char **argv);
+int backup_main(int argc, char **argv);
+int restore_main(int argc, char **argv);
@@ -0,0 +1,319 @@
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ Log format: an 8 byte magic, then one record per command:
+   u8 name length, the name, then wall_us, cpu_us and rss_kb as LEB128
+ varints. A typical record is 10-20 bytes. Sessions that created the file
+ at the same time may each have written the magic; it is skipped wherever
+ it appears between records.
+*/
+#define STATS_MAGIC   "CSESTAT1"
+#define STATS_BUFSIZE (16 * 1024)
+#define STATS_MAXREC  (1 + 255 + 3 * 10)   // name length, name, 3 varints
+
+/*
+ Log-linear histogram in the style of HdrHistogram: values below 64 get a
+ bucket each, every power of two above that is split into 32 buckets, so
+ the relative error stays under 1/32. Values go up to 2^40 (12 days in
+ microseconds), larger ones land in the last bucket.
+*/
+#define SUB_BITS  6
+#define SUB_COUNT (1 << SUB_BITS)
+#define SUB_HALF  (SUB_COUNT / 2)
+#define MAX_SHIFT 34
+#define NBUCKETS  (SUB_COUNT + MAX_SHIFT * SUB_HALF)
+
+typedef struct {
+    uint32_t count[NBUCKETS];
+    uint64_t n, min, max;
+    double   sum;
+} hist_t;
+
+enum { M_WALL, M_CPU, M_RSS, METRICS };
+
+typedef struct {
+    char    *name;
+    uint32_t hash;
+    hist_t   h[METRICS];
+} stat_cmd_t;
+
+static struct {
+    char        *path;
+    int          fd;            // log opened O_APPEND on the first flush
+    pid_t        owner;         // forked children must not flush our buffer
+    char         buf[STATS_BUFSIZE];
+    size_t       len;
+
+    int          loaded;        // the log has been folded into the table
+    stat_cmd_t **slots;         // open addressing, cap is a power of two
+    size_t       cap, count;
+} S = { .fd = -1 };
+
+static size_t bucket_of(uint64_t v) {
+    if (v < SUB_COUNT) return v;
+    int shift = 63 - __builtin_clzll(v) - (SUB_BITS - 1);   // v >> shift in [32, 64)
+    if (shift > MAX_SHIFT) return NBUCKETS - 1;
+    return SUB_COUNT + (shift - 1) * SUB_HALF + ((v >> shift) - SUB_HALF);
+}
+
+// midpoint of the values that land in bucket i
+static uint64_t bucket_value(size_t i) {
+    if (i < SUB_COUNT) return i;
+    size_t shift = (i - SUB_COUNT) / SUB_HALF + 1;
+    uint64_t sub = (i - SUB_COUNT) % SUB_HALF + SUB_HALF;
+    return (sub << shift) + (1ull << (shift - 1));
+}
+
+static void hist_add(hist_t *h, uint64_t v) {
+    h->count[bucket_of(v)]++;
+    if (h->n == 0 || v < h->min) h->min = v;
+    if (v > h->max) h->max = v;
+    h->sum += v;
+    h->n++;
+}
+
+static uint64_t hist_percentile(const hist_t *h, double p) {
+    uint64_t rank = (uint64_t)(p / 100 * h->n + 0.5), seen = 0;
+    if (rank < 1) rank = 1;
+    for (size_t i = 0; i < NBUCKETS; i++) {
+        seen += h->count[i];
+        if (seen < rank) continue;
+        uint64_t v = bucket_value(i);
+        return v < h->min ? h->min : v > h->max ? h->max : v;
+    }
+    return h->max;
+}
+
+static uint32_t hash_name(const char *s, size_t len) {
+    uint32_t h = 2166136261u;   // FNV-1a
+    while (len--) h = (h ^ (unsigned char)*s++) * 16777619u;
+    return h;
+}
+
+static stat_cmd_t *lookup(const char *name, size_t len) {
+    if ((S.count + 1) * 2 > S.cap) {
+        size_t cap = S.cap ? S.cap * 2 : 64;
+        stat_cmd_t **slots = calloc(cap, sizeof(*slots));
+        for (size_t i = 0; i < S.cap; i++) {
+            stat_cmd_t *c = S.slots[i];
+            if (!c) continue;
+            size_t j = c->hash & (cap - 1);
+            while (slots[j]) j = (j + 1) & (cap - 1);
+            slots[j] = c;
+        }
+        free(S.slots);
+        S.slots = slots;
+        S.cap = cap;
+    }
+
+    uint32_t hash = hash_name(name, len);
+    size_t i = hash & (S.cap - 1);
+    for (; S.slots[i]; i = (i + 1) & (S.cap - 1)) {
+        stat_cmd_t *c = S.slots[i];
+        if (c->hash == hash && strlen(c->name) == len && memcmp(c->name, name, len) == 0)
+            return c;
+    }
+    stat_cmd_t *c = calloc(1, sizeof(*c));
+    c->name = strndup(name, len);
+    c->hash = hash;
+    S.slots[i] = c;
+    S.count++;
+    return c;
+}
+
+static void add_sample(const char *name, size_t len, const uint64_t *v) {
+    stat_cmd_t *c = lookup(name, len);
+    for (int m = 0; m < METRICS; m++)
+        if (m != M_RSS || v[m] > 0) hist_add(&c->h[m], v[m]);   // an RSS of 0 is unknown
+}
+
+static size_t put_varint(char *p, uint64_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        p[n++] = (char)(v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (char)v;
+    return n;
+}
+
+// decode one varint; returns 0 if it runs past end
+static size_t get_varint(const unsigned char *p, const unsigned char *end, uint64_t *v) {
+    size_t n = 0;
+    int shift = 0;
+    *v = 0;
+    while (p + n < end && shift < 64) {
+        unsigned char b = p[n++];
+        *v |= (uint64_t)(b & 0x7F) << shift;
+        if (!(b & 0x80)) return n;
+        shift += 7;
+    }
+    return 0;
+}
+
+void stats_open(const char *path) {
+    free(S.path);
+    S.path = strdup(path);
+    S.owner = getpid();
+    atexit(stats_flush);
+}
+
+void stats_flush(void) {
+    if (S.len == 0 || !S.path || getpid() != S.owner) return;
+    if (S.fd < 0) {
+        S.fd = open(S.path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+        if (S.fd < 0) {
+            S.len = 0;   // telemetry is best effort; drop it
+            return;
+        }
+        struct stat st;
+        if (fstat(S.fd, &st) == 0 && st.st_size == 0)
+            write(S.fd, STATS_MAGIC, sizeof(STATS_MAGIC) - 1);
+    }
+    write(S.fd, S.buf, S.len);
+    S.len = 0;
+}
+
+void stats_record(const char *name, double wall_us, double cpu_us, long rss_kb) {
+    size_t len = strlen(name);
+    if (len > 255) len = 255;
+    uint64_t v[METRICS] = {
+        wall_us > 0 ? (uint64_t)wall_us : 0,
+        cpu_us > 0 ? (uint64_t)cpu_us : 0,
+        rss_kb > 0 ? (uint64_t)rss_kb : 0,
+    };
+
+    if (S.len + STATS_MAXREC > sizeof(S.buf)) stats_flush();
+    char *p = S.buf + S.len;
+    *p++ = (char)len;
+    memcpy(p, name, len);
+    p += len;
+    for (int m = 0; m < METRICS; m++) p += put_varint(p, v[m]);
+    S.len = p - S.buf;
+
+    if (S.loaded) add_sample(name, len, v);
+}
+
+/* fold the whole log into the table; a torn record at the end is ignored */
+static void load(void) {
+    S.loaded = 1;
+    stats_flush();
+    int fd = S.path ? open(S.path, O_RDONLY | O_CLOEXEC) : -1;
+    if (fd < 0) return;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        return;
+    }
+    const unsigned char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return;
+
+    const unsigned char *p = map, *end = map + st.st_size;
+    const size_t magic = sizeof(STATS_MAGIC) - 1;
+    while (p < end) {
+        if ((size_t)(end - p) >= magic && memcmp(p, STATS_MAGIC, magic) == 0) {
+            p += magic;
+            continue;
+        }
+        size_t len = *p++;
+        if ((size_t)(end - p) < len) break;
+        const char *name = (const char *)p;
+        p += len;
+
+        uint64_t v[METRICS];
+        int m;
+        for (m = 0; m < METRICS; m++) {
+            size_t n = get_varint(p, end, &v[m]);
+            if (!n) break;
+            p += n;
+        }
+        if (m < METRICS) break;
+        add_sample(name, len, v);
+    }
+    munmap((void *)map, st.st_size);
+}
+
+static void fmt_time(char *out, size_t n, uint64_t us) {
+    if (us < 1000)        snprintf(out, n, "%luus", (unsigned long)us);
+    else if (us < 1000000) snprintf(out, n, "%.2fms", us / 1e3);
+    else                  snprintf(out, n, "%.2fs", us / 1e6);
+}
+
+static void fmt_size(char *out, size_t n, uint64_t kb) {
+    if (kb < 1024) snprintf(out, n, "%luKB", (unsigned long)kb);
+    else           snprintf(out, n, "%.1fMB", kb / 1024.0);
+}
+
+static void print_cmd(const stat_cmd_t *c) {
+    static const char *labels[METRICS] = { "wall", "cpu", "rss" };
+    printf("%s (%lu run%s)\n", c->name, (unsigned long)c->h[M_WALL].n,
+           c->h[M_WALL].n == 1 ? "" : "s");
+    printf("  %-6s %10s %10s %10s %10s\n", "", "mean", "p50", "p95", "p99");
+    for (int m = 0; m < METRICS; m++) {
+        const hist_t *h = &c->h[m];
+        if (h->n == 0) {
+            printf("  %-6s %10s %10s %10s %10s\n", labels[m], "-", "-", "-", "-");
+            continue;
+        }
+        uint64_t v[4] = { (uint64_t)(h->sum / h->n + 0.5), hist_percentile(h, 50),
+                          hist_percentile(h, 95), hist_percentile(h, 99) };
+        char s[4][32];
+        for (int k = 0; k < 4; k++) {
+            if (m == M_RSS) fmt_size(s[k], sizeof(s[k]), v[k]);
+            else            fmt_time(s[k], sizeof(s[k]), v[k]);
+        }
+        printf("  %-6s %10s %10s %10s %10s\n", labels[m], s[0], s[1], s[2], s[3]);
+    }
+}
+
+static int cmp_name(const void *a, const void *b) {
+    return strcmp((*(stat_cmd_t *const *)a)->name, (*(stat_cmd_t *const *)b)->name);
+}
+
+// name itself, or a pipeline whose first command is name
+static int matches(const char *cmd, const char *name) {
+    size_t n = strlen(name);
+    return strncmp(cmd, name, n) == 0 && (cmd[n] == '\0' || strncmp(cmd + n, " | ", 3) == 0);
+}
+
+void stats_print(const char *name) {
+    if (!S.loaded) load();
+    stat_cmd_t **all = malloc((S.count + 1) * sizeof(*all));
+    size_t n = 0;
+    for (size_t i = 0; i < S.cap; i++) {
+        stat_cmd_t *c = S.slots[i];
+        if (c && (!name || matches(c->name, name))) all[n++] = c;
+    }
+    if (n == 0) {
+        if (name) printf("stats: no runs of %s recorded\n", name);
+        else      printf("stats: nothing recorded yet\n");
+    }
+    qsort(all, n, sizeof(*all), cmp_name);
+    for (size_t i = 0; i < n; i++) print_cmd(all[i]);
+    free(all);
+}
+
+void stats_reset(void) {
+    for (size_t i = 0; i < S.cap; i++) {
+        if (!S.slots[i]) continue;
+        free(S.slots[i]->name);
+        free(S.slots[i]);
+    }
+    free(S.slots);
+    S.slots = NULL;
+    S.cap = S.count = 0;
+    S.len = 0;
+    S.loaded = 1;   // the log is empty now, nothing left to load
+    if (S.fd >= 0) close(S.fd);
+    S.fd = -1;      // reopened, with a fresh magic, by the next flush
+    if (S.path) truncate(S.path, 0);
+}
@@ -0,0 +1,36 @@
+#ifndef CSESHELL_STATS_H
+#define CSESHELL_STATS_H
+
+/*
+ Command telemetry.
+
+ Every finished command line is recorded under its name ("ldr",
+ "ldr | grep") with its wall time, CPU time and peak RSS. Records are
+ buffered in memory and appended to the log file in large O_APPEND writes,
+ so recording costs no syscall on the prompt path and several sessions
+ can share one file.
+
+ The log is only read when the statistics are first asked for; it is then
+ folded into one HDR-style histogram per command and metric, which keeps
+ percentiles within ~3% with fixed memory however many runs there are.
+*/
+
+// remember where the log lives; nothing is read or written yet
+void stats_open(const char *path);
+
+// record one finished command; wall and CPU time in microseconds, RSS in KB (0 if unknown)
+void stats_record(const char *name, double wall_us, double cpu_us, long rss_kb);
+
+// append the buffered records to the log
+void stats_flush(void);
+
+/*
+ Print count, mean and percentiles for command name and the pipelines it
+ starts, or for every command when name is NULL.
+*/
+void stats_print(const char *name);
+
+// forget every record, in memory and in the log
+void stats_reset(void);
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef CSA_FORMAT_H
+#define CSA_FORMAT_H
+
+#include <stdint.h>
+
+/*
+ The streaming archive written by "backup -a" (archive/backup-<ts>.csa).
+
+   "CSEARCH2"
+   for every entry, in path order:
+       csa_entry_t, path, symlink target
+       csa_block_t, data        for each block of a regular file
+   csa_entry_t tagged CSA_TAG_END, all else 0
+   index                         for every entry: csa_entry_t (nblocks set),
+                                 path, symlink target, nblocks csa_block_t
+                                 (offset set)
+   csa_trailer_t
+
+ Files are cut into CSA_BLOCK_SIZE blocks and each block is deflated on
+ its own (zlib format), so blocks are compressed, checked and restored in
+ parallel. A block that would not shrink is stored as is, which is marked
+ by comp_len == raw_len. The stream can be extracted front to back
+ without seeking: every record starts with its tag, blocks belong to the
+ entry before them, and the end record says the index follows. The index
+ at the end lets a reader list the archive or jump to any block.
+ "CSEARCH1" archives have no end record and can only be read through
+ their index.
+*/
+
+#define CSA_MAGIC       "CSEARCH2"
+#define CSA_END_MAGIC   "CSAEND01"
+#define CSA_BLOCK_SIZE  (1024 * 1024)
+#define CSA_TAG_ENTRY   0x59544e45u   // "ENTY"
+#define CSA_TAG_BLOCK   0x4b434c42u   // "BLCK"
+#define CSA_TAG_END     0x20444e45u   // "END "
+
+typedef struct {
+    uint32_t tag;           // CSA_TAG_ENTRY
+    uint32_t mode;
+    uint64_t size;          // in the index, the bytes actually stored
+    int64_t  mtime_ns;
+    uint32_t path_len, link_len;
+    uint64_t nblocks;       // 0 in the stream
+} csa_entry_t;
+
+typedef struct {
+    uint32_t tag;           // CSA_TAG_BLOCK
+    uint32_t raw_len, comp_len;
+    uint32_t crc;           // crc32 of the raw data
+    uint64_t offset;        // in the index, where the data starts; 0 in the stream
+} csa_block_t;
+
+typedef struct {
+    uint64_t index_off, index_len, nentries;
+    uint32_t index_crc, pad;
+    char     magic[8];      // CSA_END_MAGIC
+} csa_trailer_t;
+
+#endif
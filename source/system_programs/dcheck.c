@@ -1,21 +1,183 @@
-#include <stdio.h>
-#include <stdlib.h>
+#define _GNU_SOURCE
+#include "system_program.h"
+#include <libgen.h>   // dirname()
+#include <sys/file.h> // flock()
+#include <sys/socket.h>
+#include <sys/un.h>
 
-int main() {
-    FILE *fp = popen("ps -axo comm | grep dspawn_daemon | wc -l", "r");
-    if (!fp) {
-        perror("popen failed");
-        return 1;
+/*
+ Report the dspawn daemons that are alive, with their PID, uptime and RSS.
+
+ Every daemon holds an flock on <project>/run/dspawn.<pid>.pid while it
+ runs, so a check is one directory read plus an open and a non-blocking
+ flock per pidfile: a file that cannot be locked belongs to a live daemon,
+ one that can is left over from a dead one and is removed. When there is
+ no run directory (daemons started by an older dspawn) the daemons are
+ found by reading /proc/<pid>/comm of every process instead, or always
+ with -s.
+
+ A daemon running jobs (dspawn -f) also listens on run/dspawn.<pid>.sock;
+ its status table is printed under its line.
+*/
+
+#define DAEMON_COMM "dspawn_daemon"
+#define MAX_DAEMONS 1024
+
+// <project>/run, from where this program (or the shell it is built into) lives
+static int run_dir(char *out, size_t n) {
+    char exe[PATH_MAX];
+    ssize_t len = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+    if (len < 0) return -1;
+    exe[len] = '\0';
+    char *dir = dirname(exe);   // .../bin, or the project itself for cseshell
+#ifndef MULTICALL
+    dir = dirname(dir);
+#endif
+    snprintf(out, n, "%s/run", dir);
+    return 0;
+}
+
+static int by_pidfile(const char *dir, pid_t *pids) {
+    DIR *d = opendir(dir);
+    if (!d) return -1;
+    int dfd = dirfd(d), count = 0;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL && count < MAX_DAEMONS) {
+        int pid;
+        char tail[8];
+        if (sscanf(e->d_name, "dspawn.%d.%7s", &pid, tail) != 2 || strcmp(tail, "pid") != 0)
+            continue;
+        int fd = openat(dfd, e->d_name, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) continue;
+        if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+            if (errno == EWOULDBLOCK) pids[count++] = pid;
+        } else {
+            // its daemon is gone; unless a new one with the same PID just took the name
+            struct stat held, named;
+            if (fstat(fd, &held) == 0 && fstatat(dfd, e->d_name, &named, 0) == 0 &&
+                held.st_ino == named.st_ino)
+                unlinkat(dfd, e->d_name, 0);
+        }
+        close(fd);
     }
+    closedir(d);
+    return count;
+}
 
+static int by_proc_scan(pid_t *pids) {
+    DIR *d = opendir("/proc");
+    if (!d) return -1;
     int count = 0;
-    fscanf(fp, "%d", &count);
-    pclose(fp);
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL && count < MAX_DAEMONS) {
+        if (!isdigit((unsigned char)e->d_name[0])) continue;
+        char path[NAME_MAX + sizeof("/comm")], comm[32];   // relative to /proc, which d holds open
+        snprintf(path, sizeof(path), "%s/comm", e->d_name);
+        int fd = openat(dirfd(d), path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) continue;   // exited meanwhile
+        ssize_t n = read(fd, comm, sizeof(comm) - 1);
+        close(fd);
+        if (n <= 0) continue;
+        comm[n] = '\0';
+        if (strcmp(comm, DAEMON_COMM "\n") == 0) pids[count++] = atoi(e->d_name);
+    }
+    closedir(d);
+    return count;
+}
+
+static int cmp_pid(const void *a, const void *b) {
+    return *(const pid_t *)a - *(const pid_t *)b;
+}
+
+// uptime and RSS from /proc/<pid>/stat; returns -1 if it has exited
+static int daemon_info(pid_t pid, double *uptime_s, long *rss_kb) {
+    char path[64], buf[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) return -1;
+    buf[n] = '\0';
+
+    // fields after the ")" that closes comm: 3 is state, 22 starttime, 24 rss
+    char *p = strrchr(buf, ')');
+    if (!p) return -1;
+    unsigned long long start = 0;
+    long rss = 0;
+    int field = 2;
+    for (p++; *p && field < 24; ) {
+        while (*p == ' ') p++;
+        field++;
+        if (field == 22) start = strtoull(p, NULL, 10);
+        if (field == 24) rss = strtol(p, NULL, 10);
+        while (*p && *p != ' ') p++;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_BOOTTIME, &now);
+    *uptime_s = now.tv_sec + now.tv_nsec / 1e9 - (double)start / sysconf(_SC_CLK_TCK);
+    *rss_kb = rss * (sysconf(_SC_PAGESIZE) / 1024);
+    return 0;
+}
+
+// print what a supervisor's status socket says, indented; nothing if there is none
+static void print_jobs(const char *dir, pid_t pid) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if ((size_t)snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/dspawn.%d.sock", dir, (int)pid) >=
+        sizeof(addr.sun_path))
+        return;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return;
+    struct timeval tv = { .tv_sec = 1 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        char buf[4096];
+        int at_line_start = 1;
+        ssize_t n;
+        while ((n = read(fd, buf, sizeof(buf))) > 0) {
+            for (ssize_t i = 0; i < n; i++) {
+                if (at_line_start) fputs("         ", stdout);
+                putchar(buf[i]);
+                at_line_start = buf[i] == '\n';
+            }
+        }
+        if (!at_line_start) putchar('\n');
+    }
+    close(fd);
+}
+
+int main(int argc, char **argv) {
+    int scan = argc > 1 && strcmp(argv[1], "-s") == 0;
+    pid_t pids[MAX_DAEMONS];
+    char dir[PATH_MAX];
+
+    int count = -1, have_dir = run_dir(dir, sizeof(dir)) == 0;
+    if (!scan && have_dir) count = by_pidfile(dir, pids);
+    if (count < 0) count = by_proc_scan(pids);
+    if (count < 0) {
+        perror("dcheck");
+        return 1;
+    }
+
+    qsort(pids, count, sizeof(pid_t), cmp_pid);
+    int alive = 0;
+    for (int i = 0; i < count; i++) {
+        double up;
+        long rss;
+        if (daemon_info(pids[i], &up, &rss) < 0) continue;
+        if (alive++ == 0) printf("%8s %12s %10s\n", "PID", "UPTIME", "RSS");
+        long s = (long)up;
+        char uptime[32];
+        snprintf(uptime, sizeof(uptime), "%ld:%02ld:%02ld", s / 3600, s / 60 % 60, s % 60);
+        printf("%8d %12s %7.1f MB\n", (int)pids[i], uptime, rss / 1024.0);
+        if (have_dir) print_jobs(dir, pids[i]);
+    }
 
-    if (count == 0)
+    if (alive == 0)
         printf("No daemon is alive right now.\n");
     else
-        printf("Live daemons: %d\n", count);
+        printf("Live daemons: %d\n", alive);
 
     return 0;
 }
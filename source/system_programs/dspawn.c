@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -10,9 +11,23 @@
 #include <limits.h>
 #include <sys/wait.h>
 #include <libgen.h>   // dirname()
+#include <sys/file.h> // flock()
+#include <errno.h>
+#include <stdarg.h>
+#include <time.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
 
 static char project_dir[2048];
 static char invocation_dir[2048];
+static char pidfile[2100];
 
 static void discover_project_dir(void) {
     char exe_path[2048];
@@ -27,38 +42,789 @@ static void discover_project_dir(void) {
     strncpy(project_dir, root_dir, sizeof(project_dir));
 }
 
+/*
+ Each daemon holds an exclusive flock on <project>/run/dspawn.<pid>.pid for
+ as long as it lives; dcheck counts the files it cannot lock. The file is
+ locked under a temporary name and only then renamed into place, so any
+ pidfile dcheck can lock belongs to a daemon that is gone.
+*/
+static int write_pidfile(void) {
+    char dir[2100], tmp[2200];
+    snprintf(dir, sizeof(dir), "%s/run", project_dir);
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) return -1;
+    snprintf(pidfile, sizeof(pidfile), "%s/dspawn.%d.pid", dir, (int)getpid());
+    snprintf(tmp, sizeof(tmp), "%s.tmp", pidfile);
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return -1;
+    if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    char line[32];
+    int n = snprintf(line, sizeof(line), "%d\n", (int)getpid());
+    write(fd, line, n);
+    if (rename(tmp, pidfile) < 0) {
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    return fd;   // kept open: the lock lasts until we exit
+}
+
+/*
+ Daemon log. One O_APPEND descriptor stays open for the daemon's life and
+ records are collected in a buffer that goes out in a single write(), so
+ a record costs a memcpy and daemons sharing the file can never split
+ each other's lines. The buffer is written when it fills, when its oldest
+ record is older than the flush interval, before the daemon goes to sleep
+ (log_idle) and, unless disabled, on exit.
+
+ The file is rotated (dspawn.log -> dspawn.log.1 -> ... -> .N) when it
+ outgrows the size limit or when the clock crosses into a new rotation
+ period. Rotation happens under an flock on the old file and only after
+ the pending buffer has been written to it, so no record is lost. Other
+ daemons still holding the old file notice that the path now names a
+ different inode and reopen it on their next flush.
+
+ Tunables, read from the environment when the daemon starts:
+   DSPAWN_LOG_MAX_BYTES      rotate above this size (default 10 MB, 0 = never)
+   DSPAWN_LOG_ROTATE_SECS    also rotate every this many seconds (default 0 = never)
+   DSPAWN_LOG_KEEP           rotated files to keep (default 5)
+   DSPAWN_LOG_FLUSH_MS       longest a record waits in the buffer (default 1000)
+   DSPAWN_LOG_FSYNC          never | flush | rotate: when to fsync (default rotate)
+   DSPAWN_LOG_FLUSH_ON_EXIT  1 to write pending records at exit (default), 0 to drop them
+*/
+#define LOG_BUFSIZE (64 * 1024)
+#define LOG_MAXREC  4096
+
+enum { FSYNC_NEVER, FSYNC_FLUSH, FSYNC_ROTATE };
+
+static struct {
+    int    fd;
+    char   path[2100];
+    char   buf[LOG_BUFSIZE];
+    size_t len;
+    double oldest;           // when the first pending record was written
+    long   period;           // rotation period the file was opened in
+
+    long long max_bytes;
+    long   rotate_secs;
+    int    keep;
+    double flush_s;
+    int    fsync_policy;
+    int    flush_on_exit;
+
+    time_t stamp_sec;        // the formatted timestamp is reused within a second
+    char   stamp[32];
+} LOG = { .fd = -1 };
+
+static double mono_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long env_long(const char *name, long def) {
+    const char *v = getenv(name);
+    return v && *v ? strtol(v, NULL, 10) : def;
+}
+
+static long current_period(void) {
+    return LOG.rotate_secs > 0 ? (long)(time(NULL) / LOG.rotate_secs) : 0;
+}
+
+static int log_reopen(void) {
+    if (LOG.fd >= 0) close(LOG.fd);
+    LOG.fd = open(LOG.path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    LOG.period = current_period();
+    return LOG.fd;
+}
+
+static void log_config(const char *path) {
+    snprintf(LOG.path, sizeof(LOG.path), "%s", path);
+    LOG.max_bytes = env_long("DSPAWN_LOG_MAX_BYTES", 10L * 1024 * 1024);
+    LOG.rotate_secs = env_long("DSPAWN_LOG_ROTATE_SECS", 0);
+    LOG.keep = env_long("DSPAWN_LOG_KEEP", 5);
+    LOG.flush_s = env_long("DSPAWN_LOG_FLUSH_MS", 1000) / 1e3;
+    LOG.flush_on_exit = env_long("DSPAWN_LOG_FLUSH_ON_EXIT", 1) != 0;
+    const char *sync = getenv("DSPAWN_LOG_FSYNC");
+    LOG.fsync_policy = !sync                     ? FSYNC_ROTATE
+                     : strcmp(sync, "never") == 0 ? FSYNC_NEVER
+                     : strcmp(sync, "flush") == 0 ? FSYNC_FLUSH
+                     :                              FSYNC_ROTATE;
+    if (LOG.keep < 1) LOG.keep = 1;
+}
+
+// shift dspawn.log.N-1 -> .N ... dspawn.log -> .1; the caller holds the lock
+static void log_rotate_files(void) {
+    char from[2200], to[2200];
+    for (int i = LOG.keep - 1; i >= 1; i--) {
+        snprintf(from, sizeof(from), "%s.%d", LOG.path, i);
+        snprintf(to, sizeof(to), "%s.%d", LOG.path, i + 1);
+        rename(from, to);
+    }
+    snprintf(to, sizeof(to), "%s.1", LOG.path);
+    rename(LOG.path, to);
+}
+
+/*
+ Make sure LOG.fd is the file at LOG.path and rotate it if it is due.
+ Called with nothing pending, right after a flush.
+*/
+static void log_check_rotation(void) {
+    struct stat held, named;
+    if (fstat(LOG.fd, &held) < 0) return;
+    if (stat(LOG.path, &named) < 0 || named.st_ino != held.st_ino || named.st_dev != held.st_dev) {
+        log_reopen();   // someone else rotated it
+        return;
+    }
+    int by_size = LOG.max_bytes > 0 && held.st_size >= LOG.max_bytes;
+    int by_time = LOG.rotate_secs > 0 && current_period() != LOG.period;
+    if (!by_size && !by_time) return;
+
+    flock(LOG.fd, LOCK_EX);
+    // another daemon may have rotated while we waited for the lock
+    if (stat(LOG.path, &named) == 0 && named.st_ino == held.st_ino && named.st_dev == held.st_dev) {
+        if (LOG.fsync_policy != FSYNC_NEVER) fsync(LOG.fd);
+        log_rotate_files();
+    }
+    flock(LOG.fd, LOCK_UN);
+    log_reopen();
+}
+
+static void log_flush(void) {
+    if (LOG.len > 0 && (LOG.fd >= 0 || log_reopen() >= 0)) {
+        size_t off = 0;
+        while (off < LOG.len) {
+            ssize_t n = write(LOG.fd, LOG.buf + off, LOG.len - off);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;   // disk full: drop the batch rather than spin
+            off += n;
+        }
+        if (LOG.fsync_policy == FSYNC_FLUSH) fdatasync(LOG.fd);
+    }
+    LOG.len = 0;
+    if (LOG.fd >= 0) log_check_rotation();
+}
+
+static void log_exit(void) {
+    if (LOG.flush_on_exit) log_flush();
+    if (LOG.fd >= 0 && LOG.fsync_policy != FSYNC_NEVER) fsync(LOG.fd);
+}
+
+static void log_open(const char *path) {
+    log_config(path);
+    log_reopen();
+    atexit(log_exit);
+}
+
+/* append one line, prefixed with the time and our PID */
+static void log_printf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+static void log_printf(const char *fmt, ...) {
+    time_t now = time(NULL);
+    if (now != LOG.stamp_sec) {
+        struct tm tm;
+        localtime_r(&now, &tm);
+        strftime(LOG.stamp, sizeof(LOG.stamp), "%Y-%m-%d %H:%M:%S", &tm);
+        LOG.stamp_sec = now;
+    }
+    if (LOG.len + LOG_MAXREC > sizeof(LOG.buf)) log_flush();
+    if (LOG.len == 0) LOG.oldest = mono_now();
+
+    char *p = LOG.buf + LOG.len;
+    size_t room = LOG_MAXREC - 1;   // keep one byte for the newline
+    int n = snprintf(p, room, "%s [%d] ", LOG.stamp, (int)getpid());
+    va_list ap;
+    va_start(ap, fmt);
+    int m = vsnprintf(p + n, room - n, fmt, ap);
+    va_end(ap);
+    size_t len = n + (m < 0 ? 0 : (size_t)m < room - n ? (size_t)m : room - n - 1);
+    if (len == 0 || p[len - 1] != '\n') p[len++] = '\n';
+    LOG.len += len;
+
+    if (mono_now() - LOG.oldest >= LOG.flush_s) log_flush();
+}
+
+// the daemon is about to block: nothing should wait in the buffer meanwhile
+static void log_idle(void) {
+    log_flush();
+}
+
+static volatile sig_atomic_t stopping;
+
+static void on_stop(int sig) {
+    (void)sig;
+    stopping = 1;   // sleep() returns early; the loop logs and exits normally
+}
+
 static int daemon_work(void) {
     char logpath[2048];
     snprintf(logpath, sizeof(logpath), "%s/dspawn.log", project_dir);
+    log_open(logpath);
+
+    struct sigaction sa = { .sa_handler = on_stop };
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
 
     // Initial header
-    FILE *f = fopen(logpath, "a");
+    log_printf("Daemon process running with PID: %d, PPID: %d, opening logfile: %s",
+               getpid(), getppid(), logpath);
+    log_printf("Current working directory: %s", invocation_dir);
+
+    // Periodic lines
+    for (int i = 0; i < 5 && !stopping; ++i) {
+        log_idle();
+        sleep(5);
+        if (stopping) break;
+        log_printf("PID %d Daemon writing line %d to the file.", getpid(), i);
+    }
+    if (stopping) log_printf("Stopping on signal");
+    return EXIT_SUCCESS;
+}
+
+/*
+ Supervisor mode: dspawn -f jobs.conf
+
+ The job file lists the programs to keep running, one section per job:
+
+   [worker]
+   command     = python3 worker.py --queue jobs   # split on blanks, "..." quotes
+   instances   = 4                                # copies to run (default 1)
+   restart     = on-failure                       # always | on-failure | never
+   backoff     = 500                              # first restart delay in ms
+   backoff_max = 30000                            # delays double up to this
+   cwd         = /srv/worker                      # default: where dspawn ran
+   rlimit_nofile = 1024                           # any of the rlimits below,
+   rlimit_as     = 512M                           # K/M/G suffixes allowed
+
+ One process watches every child from a single epoll loop: a pidfd per
+ child (readable once it exits), the pipe carrying its stdout and stderr
+ into the log, a timerfd armed for the earliest pending restart, a
+ signalfd for SIGTERM/SIGINT, and the status socket. Nothing polls. A
+ child that ran for STABLE_SECS gets its backoff reset. On SIGTERM every
+ child gets SIGTERM, then SIGKILL if it is still alive STOP_GRACE_SECS
+ later.
+
+ run/dspawn.<pid>.sock answers every connection with a status table and
+ closes it; dcheck prints it under the supervisor's line.
+*/
+#define MAX_JOBS        64
+#define MAX_INSTANCES   1024
+#define MAX_JOB_ARGS    64
+#define STABLE_SECS     10
+#define STOP_GRACE_SECS 5
+
+#ifndef P_PIDFD
+#define P_PIDFD 3
+#endif
+
+enum { RESTART_ALWAYS, RESTART_ON_FAILURE, RESTART_NEVER };
+static const char *restart_names[] = { "always", "on-failure", "never" };
+
+enum { INST_RUNNING, INST_WAITING, INST_DONE };
+static const char *inst_state_names[] = { "running", "backoff", "stopped" };
+
+// epoll user data: what the fd is, and which instance it belongs to
+enum { EV_PIDFD, EV_OUTPUT, EV_TIMER, EV_SIGNAL, EV_LISTEN };
+#define EV(type, idx) ((uint64_t)(type) << 32 | (uint32_t)(idx))
+
+typedef struct {
+    char    name[64];
+    char   *argv[MAX_JOB_ARGS + 1];
+    char    cwd[PATH_MAX];
+    int     instances, restart;
+    long    backoff_ms, backoff_max_ms;
+    int     nrlimits;
+    struct { int resource; rlim_t value; } rlimits[16];
+} job_spec_t;
+
+typedef struct {
+    job_spec_t *spec;
+    int     index;                // which copy of the job
+    int     state;
+    pid_t   pid;
+    int     pidfd, out_fd;
+    char    line[1024];           // output not yet ended by a newline
+    size_t  line_len;
+    double  started, restart_at;
+    long    backoff_ms;
+    int     restarts;
+    char    last_exit[32];
+} instance_t;
+
+static struct {
+    job_spec_t  jobs[MAX_JOBS];
+    int         njobs;
+    instance_t *inst;
+    int         ninst;
+    int         epfd, timer_fd, signal_fd, listen_fd;
+    char        sock_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    int         stopping;
+    double      kill_at, started;
+} S = { .listen_fd = -1 };
+
+static const struct { const char *name; int resource; } rlimit_names[] = {
+    { "as", RLIMIT_AS },       { "core", RLIMIT_CORE },   { "cpu", RLIMIT_CPU },
+    { "data", RLIMIT_DATA },   { "fsize", RLIMIT_FSIZE }, { "memlock", RLIMIT_MEMLOCK },
+    { "nofile", RLIMIT_NOFILE }, { "nproc", RLIMIT_NPROC }, { "rss", RLIMIT_RSS },
+    { "stack", RLIMIT_STACK },
+};
+
+static char *trim(char *s) {
+    while (isspace((unsigned char)*s)) s++;
+    char *end = s + strlen(s);
+    while (end > s && isspace((unsigned char)end[-1])) *--end = '\0';
+    return s;
+}
+
+// "512M" -> 536870912; "unlimited" -> RLIM_INFINITY
+static int parse_size(const char *s, rlim_t *out) {
+    if (strcmp(s, "unlimited") == 0) {
+        *out = RLIM_INFINITY;
+        return 0;
+    }
+    char *end;
+    unsigned long long v = strtoull(s, &end, 10);
+    if (end == s) return -1;
+    switch (toupper((unsigned char)*end)) {
+    case 'K': v <<= 10; end++; break;
+    case 'M': v <<= 20; end++; break;
+    case 'G': v <<= 30; end++; break;
+    }
+    if (*end) return -1;
+    *out = v;
+    return 0;
+}
+
+// split a command line on blanks, honouring "double quotes"
+static int split_command(char *s, char **argv) {
+    int argc = 0;
+    while (*s) {
+        while (isspace((unsigned char)*s)) s++;
+        if (!*s) break;
+        if (argc == MAX_JOB_ARGS) return -1;
+        char *out = s;
+        argv[argc++] = out;
+        int quoted = 0;
+        for (; *s && (quoted || !isspace((unsigned char)*s)); s++) {
+            if (*s == '"') quoted = !quoted;
+            else *out++ = *s;
+        }
+        if (*s) s++;
+        *out = '\0';
+    }
+    argv[argc] = NULL;
+    return argc;
+}
+
+static int config_error(const char *file, int line, const char *msg, const char *what) {
+    fprintf(stderr, "dspawn: %s:%d: %s%s%s\n", file, line, msg, what ? ": " : "", what ? what : "");
+    return -1;
+}
+
+static int set_job_key(job_spec_t *j, const char *key, char *value, const char *file, int line) {
+    if (strcmp(key, "command") == 0) {
+        char *copy = strdup(value);
+        if (split_command(copy, j->argv) <= 0) return config_error(file, line, "bad command", value);
+    } else if (strcmp(key, "instances") == 0) {
+        j->instances = atoi(value);
+        if (j->instances < 1) return config_error(file, line, "instances must be at least 1", NULL);
+    } else if (strcmp(key, "restart") == 0) {
+        for (j->restart = 0; j->restart < 3; j->restart++)
+            if (strcmp(value, restart_names[j->restart]) == 0) return 0;
+        return config_error(file, line, "restart is always, on-failure or never", value);
+    } else if (strcmp(key, "backoff") == 0) {
+        j->backoff_ms = atol(value);
+    } else if (strcmp(key, "backoff_max") == 0) {
+        j->backoff_max_ms = atol(value);
+    } else if (strcmp(key, "cwd") == 0) {
+        // the daemon itself runs in /, so relative paths are taken from here
+        if (value[0] == '/') snprintf(j->cwd, sizeof(j->cwd), "%s", value);
+        else snprintf(j->cwd, sizeof(j->cwd), "%s/%s", invocation_dir, value);
+    } else if (strncmp(key, "rlimit_", 7) == 0) {
+        size_t k;
+        for (k = 0; k < sizeof(rlimit_names) / sizeof(rlimit_names[0]); k++)
+            if (strcmp(key + 7, rlimit_names[k].name) == 0) break;
+        if (k == sizeof(rlimit_names) / sizeof(rlimit_names[0]))
+            return config_error(file, line, "unknown rlimit", key);
+        if (j->nrlimits == 16) return config_error(file, line, "too many rlimits", NULL);
+        rlim_t v;
+        if (parse_size(value, &v) < 0) return config_error(file, line, "bad limit", value);
+        j->rlimits[j->nrlimits].resource = rlimit_names[k].resource;
+        j->rlimits[j->nrlimits++].value = v;
+    } else {
+        return config_error(file, line, "unknown key", key);
+    }
+    return 0;
+}
+
+/* read the job file; errors go to the terminal, before daemonizing */
+static int load_jobs(const char *file) {
+    FILE *f = fopen(file, "r");
     if (!f) {
-        perror("fopen initial log");
-        return EXIT_FAILURE;
+        fprintf(stderr, "dspawn: %s: %s\n", file, strerror(errno));
+        return -1;
+    }
+    char buf[4096];
+    int line = 0, rc = 0;
+    job_spec_t *j = NULL;
+    while (rc == 0 && fgets(buf, sizeof(buf), f)) {
+        line++;
+        char *hash = strchr(buf, '#');
+        if (hash) *hash = '\0';
+        char *s = trim(buf);
+        if (!*s) continue;
+        if (*s == '[') {
+            char *end = strchr(s, ']');
+            if (!end) { rc = config_error(file, line, "unterminated section", s); break; }
+            if (S.njobs == MAX_JOBS) { rc = config_error(file, line, "too many jobs", NULL); break; }
+            *end = '\0';
+            j = &S.jobs[S.njobs++];
+            memset(j, 0, sizeof(*j));
+            snprintf(j->name, sizeof(j->name), "%s", trim(s + 1));
+            snprintf(j->cwd, sizeof(j->cwd), "%s", invocation_dir);
+            j->instances = 1;
+            j->restart = RESTART_ON_FAILURE;
+            j->backoff_ms = 1000;
+            j->backoff_max_ms = 60000;
+            continue;
+        }
+        char *eq = strchr(s, '=');
+        if (!eq) { rc = config_error(file, line, "expected key = value", s); break; }
+        if (!j) { rc = config_error(file, line, "key outside of a [job] section", NULL); break; }
+        *eq = '\0';
+        rc = set_job_key(j, trim(s), trim(eq + 1), file, line);
     }
-    fprintf(f,
-        "Daemon process running with PID: %d, PPID: %d, opening logfile: %s\n",
-        getpid(), getppid(), logpath);
-    fprintf(f, "Current working directory: %s\n", invocation_dir);
     fclose(f);
+    if (rc < 0) return -1;
 
-    // Periodic lines
-    for (int i = 0; i < 5; ++i) {
-        sleep(5);
-        f = fopen(logpath, "a");
-        if (!f) {
-            perror("fopen periodic log");
-            return EXIT_FAILURE;
+    int total = 0;
+    for (int i = 0; i < S.njobs; i++) {
+        if (!S.jobs[i].argv[0]) {
+            fprintf(stderr, "dspawn: %s: job [%s] has no command\n", file, S.jobs[i].name);
+            return -1;
         }
-        fprintf(f, "PID %d Daemon writing line %d to the file.\n",
-                getpid(), i);
-        fclose(f);
+        total += S.jobs[i].instances;
+    }
+    if (total == 0 || total > MAX_INSTANCES) {
+        fprintf(stderr, "dspawn: %s: %d instances (1 to %d allowed)\n", file, total, MAX_INSTANCES);
+        return -1;
     }
+    return 0;
+}
+
+static void epoll_watch(int fd, int type, int idx) {
+    struct epoll_event ev = { .events = EPOLLIN, .data.u64 = EV(type, idx) };
+    epoll_ctl(S.epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static void close_watched(int *fd) {
+    if (*fd < 0) return;
+    epoll_ctl(S.epfd, EPOLL_CTL_DEL, *fd, NULL);
+    close(*fd);
+    *fd = -1;
+}
+
+// log the complete lines a child printed; with eof, whatever is left too
+static void drain_output(instance_t *in) {
+    for (;;) {
+        ssize_t n = read(in->out_fd, in->line + in->line_len, sizeof(in->line) - 1 - in->line_len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (n == 0 || errno != EAGAIN) {
+                if (in->line_len) log_printf("%s#%d: %.*s", in->spec->name, in->index, (int)in->line_len, in->line);
+                in->line_len = 0;
+                close_watched(&in->out_fd);
+            }
+            return;
+        }
+        in->line_len += n;
+        char *start = in->line, *nl;
+        while ((nl = memchr(start, '\n', in->line + in->line_len - start)) != NULL) {
+            log_printf("%s#%d: %.*s", in->spec->name, in->index, (int)(nl - start), start);
+            start = nl + 1;
+        }
+        in->line_len -= start - in->line;
+        memmove(in->line, start, in->line_len);
+        if (in->line_len == sizeof(in->line) - 1) {   // a very long line: log it in pieces
+            log_printf("%s#%d: %.*s", in->spec->name, in->index, (int)in->line_len, in->line);
+            in->line_len = 0;
+        }
+    }
+}
+
+static void spawn_instance(instance_t *in) {
+    int fds[2];
+    if (in->out_fd >= 0) drain_output(in);
+    close_watched(&in->out_fd);
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        log_printf("%s#%d: pipe: %s", in->spec->name, in->index, strerror(errno));
+        fds[0] = fds[1] = -1;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        signal(SIGHUP, SIG_DFL);
+        if (fds[1] >= 0) {
+            dup2(fds[1], STDOUT_FILENO);
+            dup2(fds[1], STDERR_FILENO);
+        }
+        setpgid(0, 0);
+        for (int i = 0; i < in->spec->nrlimits; i++) {
+            struct rlimit rl = { in->spec->rlimits[i].value, in->spec->rlimits[i].value };
+            if (setrlimit(in->spec->rlimits[i].resource, &rl) < 0) perror("setrlimit");
+        }
+        if (chdir(in->spec->cwd) < 0) {
+            fprintf(stderr, "cwd %s: %s\n", in->spec->cwd, strerror(errno));
+            _exit(127);
+        }
+        execvp(in->spec->argv[0], in->spec->argv);
+        fprintf(stderr, "exec %s: %s\n", in->spec->argv[0], strerror(errno));
+        _exit(127);
+    }
+    if (fds[1] >= 0) close(fds[1]);
+    if (pid < 0) {
+        log_printf("%s#%d: fork: %s", in->spec->name, in->index, strerror(errno));
+        if (fds[0] >= 0) close(fds[0]);
+        in->state = INST_WAITING;
+        in->restart_at = mono_now() + in->backoff_ms / 1e3;
+        return;
+    }
+
+    in->pid = pid;
+    in->state = INST_RUNNING;
+    in->started = mono_now();
+    in->pidfd = syscall(SYS_pidfd_open, pid, 0);
+    if (in->pidfd >= 0) epoll_watch(in->pidfd, EV_PIDFD, in - S.inst);
+    else log_printf("%s#%d: pidfd_open: %s", in->spec->name, in->index, strerror(errno));
+    in->out_fd = fds[0];
+    if (in->out_fd >= 0) {
+        fcntl(in->out_fd, F_SETFL, O_NONBLOCK);
+        epoll_watch(in->out_fd, EV_OUTPUT, in - S.inst);
+    }
+    log_printf("%s#%d: started pid %d", in->spec->name, in->index, (int)pid);
+}
+
+// the child and anything it started: it leads its own process group
+static void signal_instance(instance_t *in, int sig) {
+    if (in->state != INST_RUNNING || in->pidfd < 0) return;
+    syscall(SYS_pidfd_send_signal, in->pidfd, sig, NULL, 0);
+    kill(-in->pid, sig);   // not reaped yet, so the group id is still ours
+}
+
+// the timer goes off at the next restart, or at the SIGKILL deadline when stopping
+static void arm_timer(void) {
+    double next = 0;
+    for (int i = 0; i < S.ninst; i++) {
+        if (S.inst[i].state == INST_WAITING && (next == 0 || S.inst[i].restart_at < next))
+            next = S.inst[i].restart_at;
+    }
+    if (S.stopping) next = S.kill_at;
+    struct itimerspec its = { 0 };
+    if (next > 0) {
+        its.it_value.tv_sec = (time_t)next;
+        its.it_value.tv_nsec = (long)((next - (time_t)next) * 1e9);
+        if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0) its.it_value.tv_nsec = 1;
+    }
+    timerfd_settime(S.timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static void child_exited(instance_t *in) {
+    siginfo_t si = { 0 };
+    if (waitid(P_PIDFD, in->pidfd, &si, WEXITED | WNOHANG) < 0 || si.si_pid == 0) return;
+    close_watched(&in->pidfd);
+
+    int failed = !(si.si_code == CLD_EXITED && si.si_status == 0);
+    if (si.si_code == CLD_EXITED) snprintf(in->last_exit, sizeof(in->last_exit), "exit %d", si.si_status);
+    else snprintf(in->last_exit, sizeof(in->last_exit), "signal %d", si.si_status);
+
+    double ran = mono_now() - in->started;
+    if (ran >= STABLE_SECS) in->backoff_ms = in->spec->backoff_ms;
+    int restart = !S.stopping && (in->spec->restart == RESTART_ALWAYS ||
+                                  (in->spec->restart == RESTART_ON_FAILURE && failed));
+    in->pid = 0;
+    if (!restart) {
+        in->state = INST_DONE;
+        log_printf("%s#%d: %s after %.1fs", in->spec->name, in->index, in->last_exit, ran);
+        return;
+    }
+    in->state = INST_WAITING;
+    in->restart_at = mono_now() + in->backoff_ms / 1e3;
+    log_printf("%s#%d: %s after %.1fs, restarting in %ld ms", in->spec->name, in->index,
+               in->last_exit, ran, in->backoff_ms);
+    in->backoff_ms = in->backoff_ms * 2 > in->spec->backoff_max_ms ? in->spec->backoff_max_ms
+                                                                   : in->backoff_ms * 2;
+}
+
+static void timer_fired(void) {
+    uint64_t expirations;
+    read(S.timer_fd, &expirations, sizeof(expirations));
+    double now = mono_now();
+    if (S.stopping) {
+        if (now < S.kill_at) return;
+        for (int i = 0; i < S.ninst; i++) {
+            if (S.inst[i].state != INST_RUNNING) continue;
+            log_printf("%s#%d: still running, sending SIGKILL", S.inst[i].spec->name, S.inst[i].index);
+            signal_instance(&S.inst[i], SIGKILL);
+        }
+        S.kill_at = now + 3600;   // nothing left to escalate to
+        return;
+    }
+    for (int i = 0; i < S.ninst; i++) {
+        if (S.inst[i].state == INST_WAITING && S.inst[i].restart_at <= now) {
+            S.inst[i].restarts++;
+            spawn_instance(&S.inst[i]);
+        }
+    }
+}
+
+static void begin_stop(int sig) {
+    if (S.stopping) return;
+    S.stopping = 1;
+    S.kill_at = mono_now() + STOP_GRACE_SECS;
+    log_printf("Stopping on signal %d", sig);
+    for (int i = 0; i < S.ninst; i++) {
+        instance_t *in = &S.inst[i];
+        if (in->state == INST_WAITING) in->state = INST_DONE;
+        signal_instance(in, SIGTERM);
+    }
+}
+
+static void fmt_duration(char *out, size_t n, double secs) {
+    long s = (long)secs;
+    snprintf(out, n, "%ld:%02ld:%02ld", s / 3600, s / 60 % 60, s % 60);
+}
+
+static void send_status(void) {
+    int fd = accept4(S.listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0) return;
+    static char buf[64 * 1024];
+    size_t len = 0;
+    char up[32];
+    double now = mono_now();
+    fmt_duration(up, sizeof(up), now - S.started);
+    len += snprintf(buf + len, sizeof(buf) - len, "supervisor: %d job%s, %d instance%s, up %s\n",
+                    S.njobs, S.njobs == 1 ? "" : "s", S.ninst, S.ninst == 1 ? "" : "s", up);
+    len += snprintf(buf + len, sizeof(buf) - len, "%-20s %8s %-8s %8s %10s %s\n",
+                    "JOB", "PID", "STATE", "RESTARTS", "UPTIME", "LAST EXIT");
+    for (int i = 0; i < S.ninst && len < sizeof(buf) - 256; i++) {
+        instance_t *in = &S.inst[i];
+        char name[80];
+        snprintf(name, sizeof(name), "%s#%d", in->spec->name, in->index);
+        if (in->state == INST_RUNNING) fmt_duration(up, sizeof(up), now - in->started);
+        else snprintf(up, sizeof(up), "-");
+        len += snprintf(buf + len, sizeof(buf) - len, "%-20s %8d %-8s %8d %10s %s\n",
+                        name, (int)in->pid, inst_state_names[in->state], in->restarts, up,
+                        in->last_exit[0] ? in->last_exit : "-");
+    }
+    for (size_t off = 0; off < len; ) {
+        ssize_t n = send(fd, buf + off, len - off, MSG_NOSIGNAL);
+        if (n <= 0) break;
+        off += n;
+    }
+    close(fd);
+}
+
+static void open_status_socket(void) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if ((size_t)snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/run/dspawn.%d.sock",
+                         project_dir, (int)getpid()) >= sizeof(addr.sun_path)) {
+        log_printf("Project path too long for a status socket");
+        return;
+    }
+    S.listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    unlink(addr.sun_path);
+    if (S.listen_fd < 0 || bind(S.listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(S.listen_fd, 16) < 0) {
+        log_printf("Status socket %s: %s", addr.sun_path, strerror(errno));
+        if (S.listen_fd >= 0) close(S.listen_fd);
+        S.listen_fd = -1;
+        return;
+    }
+    chmod(addr.sun_path, 0600);
+    snprintf(S.sock_path, sizeof(S.sock_path), "%s", addr.sun_path);
+    epoll_watch(S.listen_fd, EV_LISTEN, 0);
+}
+
+static int supervise(void) {
+    char logpath[2048];
+    snprintf(logpath, sizeof(logpath), "%s/dspawn.log", project_dir);
+    log_open(logpath);
+    signal(SIGCHLD, SIG_DFL);   // SIG_IGN from daemonizing would auto-reap our children
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGINT);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+
+    S.started = mono_now();
+    S.epfd = epoll_create1(EPOLL_CLOEXEC);
+    S.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    S.signal_fd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+    if (S.epfd < 0 || S.timer_fd < 0 || S.signal_fd < 0) {
+        log_printf("Supervisor setup failed: %s", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    epoll_watch(S.timer_fd, EV_TIMER, 0);
+    epoll_watch(S.signal_fd, EV_SIGNAL, 0);
+    open_status_socket();
+
+    for (int i = 0; i < S.njobs; i++) S.ninst += S.jobs[i].instances;
+    S.inst = calloc(S.ninst, sizeof(instance_t));
+    log_printf("Supervisor running with PID %d: %d jobs, %d instances", getpid(), S.njobs, S.ninst);
+    for (int i = 0, k = 0; i < S.njobs; i++) {
+        for (int n = 0; n < S.jobs[i].instances; n++, k++) {
+            instance_t *in = &S.inst[k];
+            in->spec = &S.jobs[i];
+            in->index = n;
+            in->pidfd = in->out_fd = -1;
+            in->backoff_ms = in->spec->backoff_ms;
+            spawn_instance(in);
+        }
+    }
+    arm_timer();
+
+    for (;;) {
+        int live = 0;
+        for (int i = 0; i < S.ninst; i++) live += S.inst[i].state != INST_DONE;
+        if (live == 0) break;
+
+        log_idle();
+        struct epoll_event evs[64];
+        int n = epoll_wait(S.epfd, evs, 64, -1);
+        if (n < 0 && errno != EINTR) break;
+        for (int e = 0; e < n; e++) {
+            int type = evs[e].data.u64 >> 32, idx = (uint32_t)evs[e].data.u64;
+            switch (type) {
+            case EV_PIDFD:  child_exited(&S.inst[idx]); break;
+            case EV_OUTPUT: drain_output(&S.inst[idx]); break;
+            case EV_TIMER:  timer_fired(); break;
+            case EV_LISTEN: send_status(); break;
+            case EV_SIGNAL: {
+                struct signalfd_siginfo si;
+                while (read(S.signal_fd, &si, sizeof(si)) == sizeof(si)) begin_stop(si.ssi_signo);
+                break;
+            }
+            }
+        }
+        arm_timer();
+    }
+
+    for (int i = 0; i < S.ninst; i++) {
+        if (S.inst[i].out_fd >= 0) drain_output(&S.inst[i]);
+    }
+    log_printf("Supervisor exiting");
+    if (S.sock_path[0]) unlink(S.sock_path);
     return EXIT_SUCCESS;
 }
 
-int main(void) {
+int main(int argc, char **argv) {
     // Capture invocation directory
     if (!getcwd(invocation_dir, sizeof(invocation_dir))) {
         perror("getcwd");
@@ -68,6 +834,16 @@ int main(void) {
     // Determine project directory
     discover_project_dir();
 
+    // a job file is checked here, while errors can still reach the terminal
+    const char *jobs_file = NULL;
+    if (argc == 3 && strcmp(argv[1], "-f") == 0) {
+        jobs_file = argv[2];
+    } else if (argc != 1) {
+        fprintf(stderr, "usage: dspawn [-f jobs.conf]\n");
+        exit(EXIT_FAILURE);
+    }
+    if (jobs_file && load_jobs(jobs_file) < 0) exit(EXIT_FAILURE);
+
     // First fork
     pid_t pid = fork();
     if (pid < 0) { perror("fork"); exit(EXIT_FAILURE); }
@@ -97,5 +873,9 @@ int main(void) {
 
     prctl(PR_SET_NAME, "dspawn_daemon", 0, 0, 0);
 
-    exit(daemon_work());
+    // without a pidfile dcheck still finds us by scanning /proc
+    int lock_fd = write_pidfile();
+    int status = jobs_file ? supervise() : daemon_work();
+    if (lock_fd >= 0) unlink(pidfile);
+    exit(status);
 }
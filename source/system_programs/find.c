@@ -1,99 +1,1280 @@
+#define _GNU_SOURCE
 #include "system_program.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <fnmatch.h>
+#include <regex.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include <sys/syscall.h>
+
 /*
- List all files matching the name in args[1] under current directory and subdirectories
+ List all files whose name matches one of the patterns, under the current
+ directory and its subdirectories.
+
+   find [-j N] [-s] [-g GLOB]... [-e REGEX]... [keyword...]
+   find [-f FILE] --updatedb
+   find [-f FILE] --index [-g GLOB]... [-e REGEX]... [keyword...]
+
+ The tree is walked by a pool of threads (-j, default twice the CPUs).
+ Each worker keeps a deque of directories: it pushes and pops at the back
+ (depth first, so few directories are open at once) and idle workers steal
+ from the front of someone else's deque. Directories are opened with
+ openat() relative to their parent's fd and read with getdents64, using
+ d_type instead of a stat, so full paths are only assembled for the names
+ that are printed and there is no limit on their length.
+
+ Output is buffered per worker and written a buffer at a time, in whatever
+ order the workers finish. -s collects the matches and prints them sorted,
+ so the output is the same on every run.
+
+ --updatedb saves the tree in an index file (.find.idx, or -f FILE) and
+ --index answers from it without walking anything; see the index section
+ below.
 */
-int execute(char **args)
-{
 
-    if (args[1] == NULL)
-    {
-        printf("Usage: find [keyword], to find any matching filename in this directory or its children\n");
-        return 1;
+#define DENTS_BUFSIZE (64 * 1024)
+#define OUT_BUFSIZE   (64 * 1024)
+#define MAX_WORKERS   256
+
+// the layout getdents64 fills in; glibc has no header for it
+struct linux_dirent64 {
+    ino64_t        d_ino;
+    off64_t        d_off;
+    unsigned short d_reclen;
+    unsigned char  d_type;
+    char           d_name[];
+};
+
+/*
+ A directory still to be scanned, or whose descendants are. Nodes form a
+ tree through parent, which is how paths are rebuilt for printing.
+ refs:    1 for its own scan + 1 per child node alive; frees the node
+ fd_refs: 1 for its own scan + 1 per child not yet opened; closes fd
+*/
+typedef struct dir_node {
+    struct dir_node *parent;
+    int              fd;
+    atomic_int       refs, fd_refs;
+    size_t           namelen;
+    char             name[];
+} dir_node_t;
+
+typedef struct {
+    pthread_mutex_t lock;           // guards the deque
+    dir_node_t    **items;          // thieves take items[head], the owner items[tail - 1]
+    size_t          head, tail, cap;
+
+    char           *dents;          // getdents64 buffer
+    char           *out;            // pending output, whole lines only
+    size_t          out_len;
+    char           *path;           // scratch for building a path
+    size_t          path_cap;
+    char          **matches;        // -s: every printed path, sorted at the end
+    size_t          nmatches, matches_cap;
+    unsigned        seed;           // picks steal victims
+} worker_t;
+
+static struct {
+    int             sorted;
+    int             nworkers;
+    worker_t       *workers;
+    atomic_long     pending;        // directories queued or being scanned
+    atomic_long     queued;         // directories sitting in some deque
+    atomic_int      sleepers;       // workers waiting on idle_cond
+    pthread_mutex_t idle_lock;
+    pthread_cond_t  idle_cond;      // signalled on push and when the walk ends
+    pthread_mutex_t out_lock;       // keeps workers' buffers from interleaving
+} F;
+
+static void *xmalloc(size_t n) {
+    void *p = malloc(n);
+    if (!p) {
+        perror("find");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+/*
+ Name matching. A name matches if any pattern does: a substring
+ (positional arguments), a shell glob (-g) or an extended POSIX regex
+ (-e), all tested against the file name alone.
+
+ The substrings are compiled into one Aho-Corasick automaton, stored as a
+ full transition table, so a name is scanned once whatever the number of
+ substrings. While the automaton is at its root nothing has started to
+ match, so it skips ahead to the next byte that begins some substring;
+ with SSE2 and a few distinct first bytes that skip looks at 16 bytes at
+ a time.
+*/
+#define MAX_PREFILTER 8   // most first bytes compared with SIMD
+
+static struct {
+    uint32_t     (*delta)[256];     // automaton transitions, state 0 is the root
+    uint8_t       *accept;          // some substring ends in this state
+    size_t         nstates, nsubs;
+    int            match_all;       // an empty substring matches every name
+    uint8_t        first[256];      // bytes that leave the root
+    unsigned char  firsts[MAX_PREFILTER];
+    int            nfirsts;         // 0 when there are too many for SIMD
+    const char   **globs;
+    size_t         nglobs;
+    regex_t       *regexes;
+    size_t         nregexes;
+} M;
+
+static void match_add_glob(const char *glob) {
+    M.globs = realloc(M.globs, (M.nglobs + 1) * sizeof(*M.globs));
+    M.globs[M.nglobs++] = glob;
+}
+
+static int match_add_regex(const char *re) {
+    M.regexes = realloc(M.regexes, (M.nregexes + 1) * sizeof(*M.regexes));
+    int rc = regcomp(&M.regexes[M.nregexes], re, REG_EXTENDED | REG_NOSUB);
+    if (rc != 0) {
+        char msg[256];
+        regerror(rc, &M.regexes[M.nregexes], msg, sizeof(msg));
+        fprintf(stderr, "find: bad regex '%s': %s\n", re, msg);
+        return -1;
+    }
+    M.nregexes++;
+    return 0;
+}
+
+/* build the automaton for subs[0..n) */
+static void match_compile(char **subs, size_t n) {
+    size_t cap = 1;
+    for (size_t i = 0; i < n; i++) cap += strlen(subs[i]);
+    M.delta = calloc(cap, sizeof(*M.delta));
+    M.accept = calloc(cap, 1);
+    uint32_t *parent = calloc(cap, sizeof(uint32_t));
+    uint32_t *fail = calloc(cap, sizeof(uint32_t));
+    uint32_t *queue = xmalloc(cap * sizeof(uint32_t));
+    M.nstates = 1;
+    M.nsubs = n;
+
+    // the trie; a child always has a larger number than its parent, so 0 means no edge
+    for (size_t i = 0; i < n; i++) {
+        const unsigned char *s = (const unsigned char *)subs[i];
+        if (!*s) M.match_all = 1;
+        uint32_t st = 0;
+        for (; *s; s++) {
+            if (!M.delta[st][*s]) {
+                parent[M.nstates] = st;
+                M.delta[st][*s] = M.nstates++;
+            }
+            st = M.delta[st][*s];
+        }
+        M.accept[st] = 1;
+    }
+
+    // breadth first, turn the trie into a DFA by following the failure links
+    size_t qh = 0, qt = 0;
+    for (int c = 0; c < 256; c++) {
+        if (M.delta[0][c]) queue[qt++] = M.delta[0][c];
+    }
+    while (qh < qt) {
+        uint32_t s = queue[qh++];
+        M.accept[s] |= M.accept[fail[s]];
+        for (int c = 0; c < 256; c++) {
+            uint32_t u = M.delta[s][c];
+            if (u && parent[u] == s) {
+                fail[u] = M.delta[fail[s]][c];
+                queue[qt++] = u;
+            } else {
+                M.delta[s][c] = M.delta[fail[s]][c];
+            }
+        }
+    }
+
+    M.nfirsts = 0;
+    for (int c = 0; c < 256; c++) {
+        M.first[c] = M.delta[0][c] != 0;
+        if (!M.first[c]) continue;
+        if (M.nfirsts >= 0 && M.nfirsts < MAX_PREFILTER) M.firsts[M.nfirsts++] = c;
+        else M.nfirsts = -1;
+    }
+    if (M.nfirsts < 0) M.nfirsts = 0;
+    free(parent);
+    free(fail);
+    free(queue);
+}
+
+// index of the first byte at or after i that starts some substring, or len
+static size_t next_start(const unsigned char *s, size_t i, size_t len) {
+#ifdef __SSE2__
+    if (M.nfirsts > 0) {
+        for (; i + 16 <= len; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+            __m128i hit = _mm_cmpeq_epi8(v, _mm_set1_epi8((char)M.firsts[0]));
+            for (int k = 1; k < M.nfirsts; k++)
+                hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, _mm_set1_epi8((char)M.firsts[k])));
+            int mask = _mm_movemask_epi8(hit);
+            if (mask) return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+    while (i < len && !M.first[s[i]]) i++;
+    return i;
+}
+
+static int match_substrings(const char *name, size_t len) {
+    const unsigned char *s = (const unsigned char *)name;
+    uint32_t st = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (st == 0) {
+            i = next_start(s, i, len);
+            if (i == len) break;
+        }
+        st = M.delta[st][s[i]];
+        if (M.accept[st]) return 1;
+    }
+    return 0;
+}
+
+static int match_name(const char *name, size_t len) {
+    if (M.match_all) return 1;
+    if (M.nsubs && match_substrings(name, len)) return 1;
+    for (size_t i = 0; i < M.nglobs; i++) {
+        if (fnmatch(M.globs[i], name, 0) == 0) return 1;
+    }
+    for (size_t i = 0; i < M.nregexes; i++) {
+        if (regexec(&M.regexes[i], name, 0, NULL, 0) == 0) return 1;
+    }
+    return 0;
+}
+
+static void match_free(void) {
+    for (size_t i = 0; i < M.nregexes; i++) regfree(&M.regexes[i]);
+    free(M.regexes);
+    free(M.globs);
+    free(M.delta);
+    free(M.accept);
+    memset(&M, 0, sizeof(M));
+}
+
+static void push(worker_t *w, dir_node_t *n) {
+    atomic_fetch_add(&F.pending, 1);
+    pthread_mutex_lock(&w->lock);
+    if (w->tail == w->cap) {
+        // compact first; grow only when the deque is really full
+        if (w->head > 0) {
+            memmove(w->items, w->items + w->head, (w->tail - w->head) * sizeof(*w->items));
+            w->tail -= w->head;
+            w->head = 0;
+        }
+        if (w->tail == w->cap) {
+            w->cap = w->cap ? w->cap * 2 : 256;
+            w->items = realloc(w->items, w->cap * sizeof(*w->items));
+        }
+    }
+    w->items[w->tail++] = n;
+    pthread_mutex_unlock(&w->lock);
+
+    atomic_fetch_add(&F.queued, 1);
+    if (atomic_load(&F.sleepers) > 0) {
+        pthread_mutex_lock(&F.idle_lock);
+        pthread_cond_signal(&F.idle_cond);
+        pthread_mutex_unlock(&F.idle_lock);
+    }
+}
+
+static dir_node_t *pop(worker_t *w) {
+    dir_node_t *n = NULL;
+    pthread_mutex_lock(&w->lock);
+    if (w->tail > w->head) n = w->items[--w->tail];
+    pthread_mutex_unlock(&w->lock);
+    if (n) atomic_fetch_sub(&F.queued, 1);
+    return n;
+}
+
+static dir_node_t *steal(worker_t *victim) {
+    dir_node_t *n = NULL;
+    if (pthread_mutex_trylock(&victim->lock) != 0) return NULL;
+    if (victim->tail > victim->head) n = victim->items[victim->head++];
+    pthread_mutex_unlock(&victim->lock);
+    if (n) atomic_fetch_sub(&F.queued, 1);
+    return n;
+}
+
+static dir_node_t *node_new(dir_node_t *parent, const char *name, size_t len) {
+    dir_node_t *n = xmalloc(sizeof(*n) + len + 1);
+    n->parent = parent;
+    n->fd = -1;
+    atomic_init(&n->refs, 1);
+    atomic_init(&n->fd_refs, 1);
+    n->namelen = len;
+    memcpy(n->name, name, len + 1);
+    if (parent) {
+        atomic_fetch_add(&parent->refs, 1);
+        atomic_fetch_add(&parent->fd_refs, 1);
+    }
+    return n;
+}
+
+static void node_close_fd(dir_node_t *n) {
+    if (atomic_fetch_sub(&n->fd_refs, 1) == 1 && n->fd >= 0) close(n->fd);
+}
+
+static void node_release(dir_node_t *n) {
+    while (n && atomic_fetch_sub(&n->refs, 1) == 1) {
+        dir_node_t *parent = n->parent;
+        free(n);
+        n = parent;
+    }
+}
+
+/*
+ Path of name inside directory n, built back to front into w->path.
+ Returns its length; the text is NUL terminated.
+*/
+static size_t build_path(worker_t *w, const dir_node_t *n, const char *name, size_t len) {
+    size_t total = len;
+    for (const dir_node_t *p = n; p; p = p->parent) total += p->namelen + 1;
+    if (total + 1 > w->path_cap) {
+        w->path_cap = (total + 1) * 2;
+        w->path = realloc(w->path, w->path_cap);
+    }
+    size_t at = total;
+    w->path[at] = '\0';
+    at -= len;
+    memcpy(w->path + at, name, len);
+    for (const dir_node_t *p = n; p; p = p->parent) {
+        w->path[--at] = '/';
+        at -= p->namelen;
+        memcpy(w->path + at, p->name, p->namelen);
+    }
+    return total;
+}
+
+static void flush_output(worker_t *w) {
+    if (w->out_len == 0) return;
+    pthread_mutex_lock(&F.out_lock);
+    size_t off = 0;
+    while (off < w->out_len) {
+        ssize_t k = write(STDOUT_FILENO, w->out + off, w->out_len - off);
+        if (k < 0) {
+            if (errno == EINTR) continue;
+            break;   // e.g. EPIPE from "find x | head"
+        }
+        off += k;
+    }
+    pthread_mutex_unlock(&F.out_lock);
+    w->out_len = 0;
+}
+
+// queue one line of output, writing the buffer out first when it is full
+static void out_line(worker_t *w, const char *s, size_t len) {
+    if (w->out_len + len + 1 > OUT_BUFSIZE) flush_output(w);
+    if (len + 1 > OUT_BUFSIZE) {   // longer than the whole buffer: write it as is
+        pthread_mutex_lock(&F.out_lock);
+        write(STDOUT_FILENO, s, len);
+        write(STDOUT_FILENO, "\n", 1);
+        pthread_mutex_unlock(&F.out_lock);
+        return;
+    }
+    memcpy(w->out + w->out_len, s, len);
+    w->out_len += len;
+    w->out[w->out_len++] = '\n';
+}
+
+static void emit(worker_t *w, const dir_node_t *dir, const char *name, size_t len) {
+    size_t plen = build_path(w, dir, name, len);
+    if (!F.sorted) {
+        out_line(w, w->path, plen);
+        return;
+    }
+    if (w->nmatches == w->matches_cap) {
+        w->matches_cap = w->matches_cap ? w->matches_cap * 2 : 1024;
+        w->matches = realloc(w->matches, w->matches_cap * sizeof(char *));
+    }
+    w->matches[w->nmatches++] = strndup(w->path, plen);
+}
+
+static void report_open_error(worker_t *w, const dir_node_t *n) {
+    int err = errno;
+    build_path(w, n->parent, n->name, n->namelen);
+    fprintf(stderr, "Cannot open directory '%s': %s\n", w->path, strerror(err));
+}
+
+/* read directory n, print its matches and queue its subdirectories */
+static void scan_dir(worker_t *w, dir_node_t *n) {
+    if (n->parent) {
+        n->fd = openat(n->parent->fd, n->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        int open_errno = errno;
+        node_close_fd(n->parent);   // this child no longer needs it
+        errno = open_errno;
+    }
+    if (n->fd < 0) {
+        report_open_error(w, n);
+        node_close_fd(n);
+        node_release(n);
+        return;
+    }
+
+    for (;;) {
+        long nread = syscall(SYS_getdents64, n->fd, w->dents, DENTS_BUFSIZE);
+        if (nread <= 0) break;
+        for (long off = 0; off < nread;) {
+            struct linux_dirent64 *d = (struct linux_dirent64 *)(w->dents + off);
+            off += d->d_reclen;
+            const char *name = d->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+                continue;
+            size_t len = strlen(name);
+
+            if (match_name(name, len)) emit(w, n, name, len);
+
+            unsigned char type = d->d_type;
+            if (type == DT_UNKNOWN) {   // some filesystems don't fill d_type
+                struct stat st;
+                if (fstatat(n->fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode))
+                    type = DT_DIR;
+            }
+            if (type == DT_DIR) push(w, node_new(n, name, len));
+        }
+    }
+    node_close_fd(n);
+    node_release(n);
+}
+
+static void *worker_main(void *arg) {
+    worker_t *w = arg;
+    for (;;) {
+        dir_node_t *n = pop(w);
+        for (int tries = 0; !n && tries < 2 * F.nworkers; tries++) {
+            worker_t *victim = &F.workers[rand_r(&w->seed) % F.nworkers];
+            if (victim != w) n = steal(victim);
+        }
+        if (n) {
+            scan_dir(w, n);
+            if (atomic_fetch_sub(&F.pending, 1) == 1) {
+                // that was the last directory: wake everyone to exit
+                pthread_mutex_lock(&F.idle_lock);
+                pthread_cond_broadcast(&F.idle_cond);
+                pthread_mutex_unlock(&F.idle_lock);
+            }
+            continue;
+        }
+
+        // nothing to steal: sleep until a push or the end of the walk
+        pthread_mutex_lock(&F.idle_lock);
+        atomic_fetch_add(&F.sleepers, 1);
+        while (atomic_load(&F.queued) == 0 && atomic_load(&F.pending) > 0)
+            pthread_cond_wait(&F.idle_cond, &F.idle_lock);
+        atomic_fetch_sub(&F.sleepers, 1);
+        pthread_mutex_unlock(&F.idle_lock);
+        if (atomic_load(&F.pending) == 0) break;
+    }
+    flush_output(w);
+    return NULL;
+}
+
+/*
+ Filename index (find --updatedb / find --index).
+
+ The index is one file that is mmap'ed for queries. Entries are the paths
+ of every file and directory under ".", grouped by directory: a
+ directory's children are contiguous and sorted by name. Paths are front
+ coded against the previous entry, with a restart every IDX_BLOCK entries
+ so entry i is found by decoding at most IDX_BLOCK - 1 others. A trigram
+ table maps every 3-byte sequence of a file name to a delta/varint coded
+ list of the entries containing it; a query intersects the lists of its
+ trigrams and only decodes the candidates.
+
+ Each directory's mtime is kept too. --updatedb reuses the listing of a
+ directory whose mtime has not changed since the last build and only runs
+ getdents on the ones that did; every directory is still stat'ed, since a
+ change deep down does not touch its ancestors' mtimes.
+*/
+#define INDEX_FILE  ".find.idx"
+#define INDEX_MAGIC "CSEFIDX1"
+#define IDX_BLOCK   32
+
+typedef struct {
+    char     magic[8];
+    uint32_t nentries, ndirs, nblocks, ntris;
+    uint64_t blocks_off;              // uint64_t[nblocks], block offsets in the entry blob
+    uint64_t entries_off, entries_len;
+    uint64_t dirs_off;                // idx_dir_t[ndirs]
+    uint64_t tris_off;                // idx_tri_t[ntris], sorted by key
+    uint64_t post_off, post_len;      // posting lists
+} idx_header_t;
+
+typedef struct {
+    int64_t  mtime_ns;
+    uint32_t entry;                   // the directory's own entry, UINT32_MAX for "."
+    uint32_t first_child, nchildren;
+    uint32_t pad;
+} idx_dir_t;
+
+typedef struct {
+    uint32_t key, count;
+    uint64_t off;                     // into the posting blob
+} idx_tri_t;
+
+typedef struct {
+    char  *p;
+    size_t len, cap;
+} buf_t;
+
+static void buf_reserve(buf_t *b, size_t extra) {
+    if (b->len + extra <= b->cap) return;
+    b->cap = (b->len + extra) * 2;
+    b->p = realloc(b->p, b->cap);
+    if (!b->p) {
+        perror("find");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void buf_put(buf_t *b, const void *s, size_t n) {
+    buf_reserve(b, n);
+    memcpy(b->p + b->len, s, n);
+    b->len += n;
+}
+
+static void buf_varint(buf_t *b, uint64_t v) {
+    buf_reserve(b, 10);
+    while (v >= 0x80) {
+        b->p[b->len++] = (char)(v | 0x80);
+        v >>= 7;
+    }
+    b->p[b->len++] = (char)v;
+}
+
+static uint64_t get_varint(const unsigned char **p) {
+    uint64_t v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        unsigned char c = *(*p)++;
+        v |= (uint64_t)(c & 0x7F) << shift;
+        if (!(c & 0x80)) break;
+    }
+    return v;
+}
+
+/* a mapped index, checked well enough that decoding cannot run off it */
+typedef struct {
+    const unsigned char *base;
+    size_t               len;
+    const idx_header_t  *h;
+    const uint64_t      *blocks;
+    const idx_dir_t     *dirs;
+    const idx_tri_t     *tris;
+} index_t;
+
+static int index_map(index_t *ix, const char *file) {
+    memset(ix, 0, sizeof(*ix));
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(idx_header_t)) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
     }
+    void *m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED) return -1;
 
-    char *dir_name = args[0];
-    char *to_match = args[1];
-    char local_dir_name[SHELL_BUFFERSIZE];
+    ix->base = m;
+    ix->len = st.st_size;
+    ix->h = m;
+    const idx_header_t *h = ix->h;
+    if (memcmp(h->magic, INDEX_MAGIC, 8) != 0 ||
+        h->blocks_off + (uint64_t)h->nblocks * sizeof(uint64_t) > ix->len ||
+        h->entries_off + h->entries_len > ix->len ||
+        h->dirs_off + (uint64_t)h->ndirs * sizeof(idx_dir_t) > ix->len ||
+        h->tris_off + (uint64_t)h->ntris * sizeof(idx_tri_t) > ix->len ||
+        h->post_off + h->post_len > ix->len) {
+        munmap(m, ix->len);
+        errno = EINVAL;
+        return -1;
+    }
+    ix->blocks = (const uint64_t *)(ix->base + h->blocks_off);
+    ix->dirs = (const idx_dir_t *)(ix->base + h->dirs_off);
+    ix->tris = (const idx_tri_t *)(ix->base + h->tris_off);
+    return 0;
+}
+
+static void index_unmap(index_t *ix) {
+    if (ix->base) munmap((void *)ix->base, ix->len);
+    ix->base = NULL;
+}
+
+// walks the entries in order; path holds the last one decoded
+typedef struct {
+    const index_t       *ix;
+    const unsigned char *p;
+    uint32_t             next;
+    buf_t                path;
+    int                  is_dir;
+} cursor_t;
+
+static void cursor_seek(cursor_t *c, uint32_t i);
+
+static int cursor_next(cursor_t *c) {
+    if (c->next >= c->ix->h->nentries) return 0;
+    c->is_dir = *c->p++;
+    uint64_t shared = get_varint(&c->p), n = get_varint(&c->p);
+    if (shared > c->path.len) shared = c->path.len;   // corrupt: don't read garbage
+    c->path.len = shared;
+    buf_put(&c->path, c->p, n);
+    buf_reserve(&c->path, 1);
+    c->path.p[c->path.len] = '\0';
+    c->p += n;
+    c->next++;
+    return 1;
+}
 
-    DIR *d;
-    /* Open the directory specified by "dir_name". */
-    if (strcmp(dir_name, "find") == 0)
-    {
-        d = opendir(".");
-        // getcwd(local_dir_name, SHELL_BUFFERSIZE);
-        sprintf(local_dir_name, ".");
-        dir_name = local_dir_name;
+static void cursor_seek(cursor_t *c, uint32_t i) {
+    // forward within the current block is cheaper than a restart
+    if (i >= c->next && i / IDX_BLOCK == c->next / IDX_BLOCK && c->next > 0) {
+        while (c->next < i) cursor_next(c);
+        return;
     }
-    else
-    {
-        d = opendir(dir_name);
+    uint32_t block = i / IDX_BLOCK;
+    c->p = c->ix->base + c->ix->h->entries_off + c->ix->blocks[block];
+    c->next = block * IDX_BLOCK;
+    c->path.len = 0;
+    while (c->next < i) cursor_next(c);
+}
+
+static const char *base_name(const char *path, size_t len) {
+    const char *slash = memrchr(path, '/', len);
+    return slash ? slash + 1 : path;
+}
+
+/* ---------- building ---------- */
+
+typedef struct {
+    uint32_t  key;                    // trigram + 1, 0 marks an empty slot
+    uint32_t  n, cap;
+    uint32_t *ids;
+} tri_list_t;
+
+typedef struct {
+    char   *name;
+    uint8_t is_dir;
+} child_t;
+
+static struct {
+    buf_t       entries, prev;        // entry blob and the last path, for front coding
+    uint64_t   *blocks;
+    size_t      nblocks, blocks_cap;
+    idx_dir_t  *dirs;
+    size_t      ndirs, dirs_cap;
+    uint32_t    nentries;
+    tri_list_t *tri;                  // open addressing, tri_cap is a power of two
+    size_t      ntri, tri_cap;
+    char       *dents;
+
+    index_t     old;                  // previous index, if any
+    cursor_t    oldc;
+    char      **old_paths;            // hash set of old directory paths -> dir index
+    uint32_t   *old_ids;
+    size_t      old_cap;
+    size_t      rescanned, reused;
+    const char *skip;                 // the index file itself, not listed,
+    dev_t       skip_dev;             // wherever in the tree its directory is
+    ino_t       skip_ino;
+} B;
+
+static uint32_t hash_str(const char *s, size_t len) {
+    uint32_t h = 2166136261u;   // FNV-1a
+    while (len--) h = (h ^ (unsigned char)*s++) * 16777619u;
+    return h;
+}
+
+static tri_list_t *tri_slot(uint32_t key) {
+    if ((B.ntri + 1) * 2 > B.tri_cap) {
+        size_t cap = B.tri_cap ? B.tri_cap * 2 : 4096;
+        tri_list_t *t = calloc(cap, sizeof(*t));
+        for (size_t i = 0; i < B.tri_cap; i++) {
+            if (!B.tri[i].key) continue;
+            size_t j = (B.tri[i].key * 2654435761u) & (cap - 1);
+            while (t[j].key) j = (j + 1) & (cap - 1);
+            t[j] = B.tri[i];
+        }
+        free(B.tri);
+        B.tri = t;
+        B.tri_cap = cap;
+    }
+    size_t i = ((key + 1) * 2654435761u) & (B.tri_cap - 1);
+    while (B.tri[i].key && B.tri[i].key != key + 1) i = (i + 1) & (B.tri_cap - 1);
+    if (!B.tri[i].key) {
+        B.tri[i].key = key + 1;
+        B.ntri++;
+    }
+    return &B.tri[i];
+}
+
+static void add_entry(const char *path, size_t len, int is_dir) {
+    uint32_t id = B.nentries++;
+    size_t shared = 0;
+    if (id % IDX_BLOCK == 0) {
+        if (B.nblocks == B.blocks_cap) {
+            B.blocks_cap = B.blocks_cap ? B.blocks_cap * 2 : 1024;
+            B.blocks = realloc(B.blocks, B.blocks_cap * sizeof(uint64_t));
+        }
+        B.blocks[B.nblocks++] = B.entries.len;
+    } else {
+        while (shared < len && shared < B.prev.len && path[shared] == B.prev.p[shared]) shared++;
+    }
+    buf_reserve(&B.entries, 1);
+    B.entries.p[B.entries.len++] = (char)is_dir;
+    buf_varint(&B.entries, shared);
+    buf_varint(&B.entries, len - shared);
+    buf_put(&B.entries, path + shared, len - shared);
+    B.prev.len = 0;
+    buf_put(&B.prev, path, len);
+
+    // trigrams of the file name
+    const unsigned char *name = (const unsigned char *)base_name(path, len);
+    size_t nlen = path + len - (const char *)name;
+    for (size_t i = 0; i + 3 <= nlen; i++) {
+        tri_list_t *t = tri_slot(name[i] << 16 | name[i + 1] << 8 | name[i + 2]);
+        if (t->n && t->ids[t->n - 1] == id) continue;   // repeated in this name
+        if (t->n == t->cap) {
+            t->cap = t->cap ? t->cap * 2 : 4;
+            t->ids = realloc(t->ids, t->cap * sizeof(uint32_t));
+        }
+        t->ids[t->n++] = id;
     }
+}
 
-    /* Check it was opened. */
-    if (!d)
-    {
-        fprintf(stderr, "Cannot open directory '%s': %s\n",
-                dir_name, strerror(errno));
+static void old_dirs_load(void) {
+    const idx_header_t *h = B.old.h;
+    B.old_cap = 16;
+    while (B.old_cap < (size_t)h->ndirs * 2) B.old_cap *= 2;
+    B.old_paths = calloc(B.old_cap, sizeof(char *));
+    B.old_ids = calloc(B.old_cap, sizeof(uint32_t));
+    B.oldc.ix = &B.old;
+    for (uint32_t d = 0; d < h->ndirs; d++) {
+        const char *path = ".";
+        if (B.old.dirs[d].entry != UINT32_MAX) {
+            if (B.old.dirs[d].entry >= h->nentries) continue;
+            cursor_seek(&B.oldc, B.old.dirs[d].entry);
+            cursor_next(&B.oldc);
+            path = B.oldc.path.p;
+        }
+        size_t i = hash_str(path, strlen(path)) & (B.old_cap - 1);
+        while (B.old_paths[i]) i = (i + 1) & (B.old_cap - 1);
+        B.old_paths[i] = strdup(path);
+        B.old_ids[i] = d;
+    }
+}
+
+static const idx_dir_t *old_dir(const char *path, size_t len) {
+    if (!B.old_paths) return NULL;
+    size_t i = hash_str(path, len) & (B.old_cap - 1);
+    for (; B.old_paths[i]; i = (i + 1) & (B.old_cap - 1)) {
+        if (strncmp(B.old_paths[i], path, len) == 0 && B.old_paths[i][len] == '\0')
+            return &B.old.dirs[B.old_ids[i]];
+    }
+    return NULL;
+}
+
+static int cmp_child(const void *a, const void *b) {
+    return strcmp(((const child_t *)a)->name, ((const child_t *)b)->name);
+}
+
+// list dfd with getdents64; NULL when it is empty or cannot be read
+static child_t *read_children(int dfd, size_t *n) {
+    child_t *kids = NULL;
+    size_t cap = 0;
+    int holds_index = 0;
+    *n = 0;
+    for (;;) {
+        long nread = syscall(SYS_getdents64, dfd, B.dents, DENTS_BUFSIZE);
+        if (nread <= 0) break;
+        for (long off = 0; off < nread;) {
+            struct linux_dirent64 *d = (struct linux_dirent64 *)(B.dents + off);
+            off += d->d_reclen;
+            const char *name = d->d_name;
+            if (name[0] == '.' && name[1] == '\0' && B.skip && d->d_ino == B.skip_ino) {
+                struct stat st;   // "." carries this directory's inode, so only a match costs a stat
+                holds_index = fstat(dfd, &st) == 0 && st.st_dev == B.skip_dev;
+            }
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+                continue;
+            unsigned char type = d->d_type;
+            if (type == DT_UNKNOWN) {
+                struct stat st;
+                if (fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode))
+                    type = DT_DIR;
+            }
+            if (*n == cap) {
+                cap = cap ? cap * 2 : 64;
+                kids = realloc(kids, cap * sizeof(child_t));
+            }
+            kids[*n].name = strdup(name);
+            kids[*n].is_dir = type == DT_DIR;
+            (*n)++;
+        }
+    }
+    // the index and its temporary file; "." may come after them, so they go last
+    if (holds_index) {
+        size_t len = strlen(B.skip), kept = 0;
+        for (size_t i = 0; i < *n; i++) {
+            const char *name = kids[i].name;
+            if (strncmp(name, B.skip, len) == 0 &&
+                (name[len] == '\0' || strcmp(name + len, ".tmp") == 0))
+                free(kids[i].name);
+            else
+                kids[kept++] = kids[i];
+        }
+        *n = kept;
+    }
+    return kids;
+}
+
+// the listing stored for an unchanged directory
+static child_t *old_children(const idx_dir_t *od, size_t *n) {
+    child_t *kids = malloc((od->nchildren + 1) * sizeof(child_t));
+    *n = 0;
+    if (od->first_child + (uint64_t)od->nchildren > B.old.h->nentries) return kids;
+    cursor_seek(&B.oldc, od->first_child);
+    for (uint32_t i = 0; i < od->nchildren && cursor_next(&B.oldc); i++) {
+        kids[*n].name = strdup(base_name(B.oldc.path.p, B.oldc.path.len));
+        kids[*n].is_dir = B.oldc.is_dir;
+        (*n)++;
+    }
+    return kids;
+}
+
+static int64_t mtime_ns(const struct stat *st) {
+    return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+/*
+ Index directory dfd, whose path is path->p[0..plen) and whose own entry is
+ self. Children are listed first, then each subdirectory is visited.
+*/
+static void index_dir(int dfd, buf_t *path, size_t plen, uint32_t self) {
+    struct stat st;
+    if (fstat(dfd, &st) < 0) return;
+
+    size_t n;
+    child_t *kids;
+    const idx_dir_t *od = old_dir(path->p, plen);
+    if (od && od->mtime_ns == mtime_ns(&st)) {
+        kids = old_children(od, &n);
+        B.reused++;
+    } else {
+        kids = read_children(dfd, &n);
+        if (n > 1) qsort(kids, n, sizeof(child_t), cmp_child);
+        B.rescanned++;
+    }
+
+    if (B.ndirs == B.dirs_cap) {
+        B.dirs_cap = B.dirs_cap ? B.dirs_cap * 2 : 1024;
+        B.dirs = realloc(B.dirs, B.dirs_cap * sizeof(idx_dir_t));
+    }
+    idx_dir_t *dir = &B.dirs[B.ndirs++];
+    memset(dir, 0, sizeof(*dir));
+    dir->mtime_ns = mtime_ns(&st);
+    dir->entry = self;
+    dir->first_child = B.nentries;
+    dir->nchildren = n;
+
+    uint32_t first = B.nentries;
+    for (size_t i = 0; i < n; i++) {
+        path->len = plen;
+        buf_put(path, "/", 1);
+        buf_put(path, kids[i].name, strlen(kids[i].name));
+        add_entry(path->p, path->len, kids[i].is_dir);
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (kids[i].is_dir) {
+            int fd = openat(dfd, kids[i].name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (fd >= 0) {
+                path->len = plen;
+                buf_put(path, "/", 1);
+                buf_put(path, kids[i].name, strlen(kids[i].name));
+                index_dir(fd, path, path->len, first + i);
+                close(fd);
+            }
+        }
+        free(kids[i].name);
+    }
+    free(kids);
+}
+
+static int cmp_tri(const void *a, const void *b) {
+    uint32_t x = ((const idx_tri_t *)a)->key, y = ((const idx_tri_t *)b)->key;
+    return x < y ? -1 : x > y;
+}
+
+static void pad8(buf_t *b) {
+    static const char zero[8];
+    buf_put(b, zero, (8 - b->len % 8) % 8);
+}
+
+/* write the index to file, through a temporary file renamed over it */
+static int index_write(const char *file) {
+    buf_t out = {0}, post = {0};
+    idx_header_t h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, INDEX_MAGIC, 8);
+    h.nentries = B.nentries;
+    h.ndirs = B.ndirs;
+    h.nblocks = B.nblocks;
+
+    idx_tri_t *tris = malloc((B.ntri + 1) * sizeof(idx_tri_t));
+    size_t nt = 0;
+    for (size_t i = 0; i < B.tri_cap; i++) {
+        tri_list_t *t = &B.tri[i];
+        if (!t->key) continue;
+        tris[nt].key = t->key - 1;
+        tris[nt].count = t->n;
+        tris[nt].off = post.len;
+        uint32_t prev = 0;
+        for (uint32_t k = 0; k < t->n; k++) {
+            buf_varint(&post, t->ids[k] - prev);
+            prev = t->ids[k];
+        }
+        nt++;
+    }
+    qsort(tris, nt, sizeof(idx_tri_t), cmp_tri);
+    h.ntris = nt;
+
+    buf_put(&out, &h, sizeof(h));
+    pad8(&out);
+    h.blocks_off = out.len;
+    buf_put(&out, B.blocks, B.nblocks * sizeof(uint64_t));
+    h.dirs_off = out.len;
+    buf_put(&out, B.dirs, B.ndirs * sizeof(idx_dir_t));
+    h.tris_off = out.len;
+    buf_put(&out, tris, nt * sizeof(idx_tri_t));
+    h.entries_off = out.len;
+    h.entries_len = B.entries.len;
+    buf_put(&out, B.entries.p, B.entries.len);
+    pad8(&out);
+    h.post_off = out.len;
+    h.post_len = post.len;
+    buf_put(&out, post.p, post.len);
+    memcpy(out.p, &h, sizeof(h));
+    free(tris);
+    free(post.p);
+
+    buf_t tmp = {0};
+    buf_put(&tmp, file, strlen(file));
+    buf_put(&tmp, ".tmp", 5);
+    int fd = open(tmp.p, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    int ok = fd >= 0;
+    for (size_t off = 0; ok && off < out.len;) {
+        ssize_t k = write(fd, out.p + off, out.len - off);
+        if (k < 0 && errno != EINTR) ok = 0;
+        else if (k > 0) off += k;
+    }
+    if (fd >= 0 && close(fd) < 0) ok = 0;
+    if (ok && rename(tmp.p, file) < 0) ok = 0;
+    if (!ok) {
+        fprintf(stderr, "find: cannot write index '%s': %s\n", file, strerror(errno));
+        unlink(tmp.p);
+    }
+    free(tmp.p);
+    free(out.p);
+    return ok ? 0 : -1;
+}
+
+static int update_index(const char *file) {
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    memset(&B, 0, sizeof(B));
+    B.dents = xmalloc(DENTS_BUFSIZE);
+    // the index is only in the way if its directory is somewhere under "."
+    const char *slash = strrchr(file, '/');
+    buf_t dir = {0};
+    if (slash) buf_put(&dir, file, slash == file ? 1 : (size_t)(slash - file));
+    else buf_put(&dir, ".", 1);
+    buf_put(&dir, "", 1);
+    struct stat st;
+    if (stat(dir.p, &st) == 0) {
+        B.skip = slash ? slash + 1 : file;
+        B.skip_dev = st.st_dev;
+        B.skip_ino = st.st_ino;
+    }
+    free(dir.p);
+    if (index_map(&B.old, file) == 0) old_dirs_load();
+
+    int root = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root < 0) {
+        fprintf(stderr, "Cannot open directory '.': %s\n", strerror(errno));
         return 1;
     }
+    buf_t path = {0};
+    buf_put(&path, ".", 1);
+    index_dir(root, &path, 1, UINT32_MAX);
+    close(root);
+    int rc = index_write(file);
 
-    while (1)
-    {
-        struct dirent *entry;
-        const char *d_name;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    if (rc == 0)
+        printf("find: indexed %u entries in %zu directories (%zu rescanned, %zu unchanged) in %.1f ms\n",
+               B.nentries, B.ndirs, B.rescanned, B.reused,
+               (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
 
-        /* "Readdir" gets subsequent entries from "d". */
-        entry = readdir(d);
-        if (!entry)
-        {
-            /* There are no more entries in this directory, so break
-               out of the while loop. */
-            break;
+    index_unmap(&B.old);
+    for (size_t i = 0; i < B.old_cap; i++) free(B.old_paths[i]);
+    for (size_t i = 0; i < B.tri_cap; i++) free(B.tri[i].ids);
+    free(B.old_paths); free(B.old_ids); free(B.tri); free(B.blocks); free(B.dirs);
+    free(B.entries.p); free(B.prev.p); free(B.oldc.path.p); free(B.dents); free(path.p);
+    return rc ? 1 : 0;
+}
+
+/* ---------- querying ---------- */
+
+static const idx_tri_t *find_tri(const index_t *ix, uint32_t key) {
+    size_t lo = 0, hi = ix->h->ntris;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (ix->tris[mid].key < key) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < ix->h->ntris && ix->tris[lo].key == key ? &ix->tris[lo] : NULL;
+}
+
+static int cmp_tri_count(const void *a, const void *b) {
+    uint32_t x = (*(idx_tri_t *const *)a)->count, y = (*(idx_tri_t *const *)b)->count;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ Entry ids whose name may contain kw: the intersection of the posting
+ lists of kw's trigrams, rarest first. Returns the count; *out is malloc'ed.
+*/
+static size_t candidates(const index_t *ix, const char *kw, uint32_t **out) {
+    size_t klen = strlen(kw), nt = 0;
+    const idx_tri_t **lists = malloc(klen * sizeof(*lists));
+    const unsigned char *k = (const unsigned char *)kw;
+    for (size_t i = 0; i + 3 <= klen; i++) {
+        const idx_tri_t *t = find_tri(ix, k[i] << 16 | k[i + 1] << 8 | k[i + 2]);
+        if (!t) {   // some trigram never occurs: nothing can match
+            free(lists);
+            *out = NULL;
+            return 0;
+        }
+        lists[nt++] = t;
+    }
+    qsort(lists, nt, sizeof(*lists), cmp_tri_count);
+
+    uint32_t *cand = malloc((lists[0]->count + 1) * sizeof(uint32_t));
+    size_t n = 0;
+    const unsigned char *p = ix->base + ix->h->post_off + lists[0]->off;
+    uint32_t id = 0;
+    for (uint32_t i = 0; i < lists[0]->count; i++) cand[n++] = id += get_varint(&p);
+
+    for (size_t l = 1; l < nt && n > 0; l++) {
+        if (lists[l] == lists[l - 1]) continue;   // kw repeats a trigram
+        // merge: keep the candidates that also appear in this list
+        p = ix->base + ix->h->post_off + lists[l]->off;
+        id = 0;
+        size_t kept = 0, c = 0;
+        for (uint32_t i = 0; i < lists[l]->count && c < n; i++) {
+            id += get_varint(&p);
+            while (c < n && cand[c] < id) c++;
+            if (c < n && cand[c] == id) cand[kept++] = cand[c++];
         }
-        d_name = entry->d_name;
+        n = kept;
+    }
+    free(lists);
+    *out = cand;
+    return n;
+}
+
+static int cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ Answer from the index. When every pattern is a substring of at least
+ three bytes, only the union of their candidates is decoded; anything
+ else (short substrings, globs, regexes) scans every stored name.
+*/
+static int query_index(const char *file, char **subs, size_t nsubs) {
+    index_t ix;
+    if (index_map(&ix, file) != 0) {
+        fprintf(stderr, "find: cannot read index '%s': %s (run find --updatedb)\n",
+                file, strerror(errno));
+        return 1;
+    }
+    worker_t w = { .out = xmalloc(OUT_BUFSIZE) };   // just for its output buffer
+
+    int use_trigrams = nsubs > 0 && M.nglobs == 0 && M.nregexes == 0;
+    for (size_t i = 0; i < nsubs; i++) {
+        if (strlen(subs[i]) < 3) use_trigrams = 0;
+    }
 
-        /* Print the name of the file and directory if it matches the keyword */
-        if (strstr(d_name, to_match) != NULL)
-        {
-            printf("%s/%s\n", dir_name, d_name);
+    cursor_t c = { .ix = &ix };
+    if (!use_trigrams) {
+        cursor_seek(&c, 0);
+        while (cursor_next(&c)) {
+            const char *name = base_name(c.path.p, c.path.len);
+            if (match_name(name, c.path.p + c.path.len - name)) out_line(&w, c.path.p, c.path.len);
+        }
+    } else {
+        uint32_t *all = NULL;
+        size_t n = 0;
+        for (size_t i = 0; i < nsubs; i++) {
+            uint32_t *cand;
+            size_t k = candidates(&ix, subs[i], &cand);
+            all = realloc(all, (n + k + 1) * sizeof(uint32_t));
+            if (k) memcpy(all + n, cand, k * sizeof(uint32_t));
+            n += k;
+            free(cand);
         }
+        if (nsubs > 1 && n > 1) qsort(all, n, sizeof(uint32_t), cmp_u32);
+        for (size_t i = 0; i < n; i++) {
+            if (all[i] >= ix.h->nentries) break;
+            if (i > 0 && all[i] == all[i - 1]) continue;
+            cursor_seek(&c, all[i]);
+            cursor_next(&c);
+            const char *name = base_name(c.path.p, c.path.len);
+            if (match_name(name, c.path.p + c.path.len - name)) out_line(&w, c.path.p, c.path.len);
+        }
+        free(all);
+    }
+    flush_output(&w);
+    free(w.out);
+    free(c.path.p);
+    index_unmap(&ix);
+    return 0;
+}
 
-        if (entry->d_type & DT_DIR)
-        {
+static int cmp_str(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
 
-            /* Check that the directory is not "d" or d's parent. */
-            if (strcmp(d_name, "..") != 0 &&
-                strcmp(d_name, ".") != 0)
-            {
-                int path_length;
-                char path[PATH_MAX];
+static void usage(void) {
+    printf("Usage: find [-j threads] [-s] [-g glob] [-e regex] [keyword...], to find any matching filename in this directory or its children\n");
+    printf("  keyword   names containing it; several keywords match any of them\n");
+    printf("  -g GLOB   names matching a shell glob, such as '*.c' (repeatable)\n");
+    printf("  -e REGEX  names matching an extended regular expression (repeatable)\n");
+    printf("  -j N      walk the tree with N threads\n");
+    printf("  -s        print the matches sorted, the same on every run\n");
+    printf("  --updatedb  build or refresh the index of this directory\n");
+    printf("  --index     look the patterns up in the index instead of walking the tree\n");
+    printf("  -f FILE     index file to use (default %s)\n", INDEX_FILE);
+}
 
-                path_length = snprintf(path, 1024,
-                                       "%s/%s", dir_name, d_name);
+int main(int argc, char **argv) {
+    F.nworkers = 2 * sysconf(_SC_NPROCESSORS_ONLN);
+    F.sorted = 0;
+    memset(&M, 0, sizeof(M));
 
-                if (path_length >= PATH_MAX)
-                {
-                    fprintf(stderr, "Path length has got too long.\n");
-                    exit(EXIT_FAILURE);
-                }
-                /* Recursively call "list_dir" with the new path. */
-                args[0] = path;
-                execute(args);
+    enum { OPT_UPDATEDB = 256, OPT_INDEX };
+    static const struct option longopts[] = {
+        { "updatedb", no_argument, NULL, OPT_UPDATEDB },
+        { "index",    no_argument, NULL, OPT_INDEX },
+        { NULL, 0, NULL, 0 },
+    };
+    const char *index_file = INDEX_FILE;
+    int mode = 0, opt;
+    while ((opt = getopt_long(argc, argv, "j:sf:g:e:", longopts, NULL)) != -1) {
+        switch (opt) {
+        case 'j': F.nworkers = atoi(optarg); break;
+        case 's': F.sorted = 1; break;
+        case 'f': index_file = optarg; break;
+        case 'g': match_add_glob(optarg); break;
+        case 'e':
+            if (match_add_regex(optarg) < 0) {
+                match_free();
+                return 1;
             }
+            break;
+        case OPT_UPDATEDB:
+        case OPT_INDEX: mode = opt; break;
+        default:  match_free(); usage(); return 1;
         }
     }
+    if (mode == OPT_UPDATEDB) {
+        match_free();
+        return update_index(index_file);
+    }
+    if (optind >= argc && M.nglobs == 0 && M.nregexes == 0) {
+        match_free();
+        usage();
+        return 1;
+    }
+    match_compile(argv + optind, argc - optind);
+    if (mode == OPT_INDEX) {
+        int rc = query_index(index_file, argv + optind, argc - optind);
+        match_free();
+        return rc;
+    }
+    if (F.nworkers < 1) F.nworkers = 1;
+    if (F.nworkers > MAX_WORKERS) F.nworkers = MAX_WORKERS;
+
+    dir_node_t *root = node_new(NULL, ".", 1);
+    root->fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root->fd < 0) {
+        fprintf(stderr, "Cannot open directory '.': %s\n", strerror(errno));
+        free(root);
+        match_free();
+        return 1;
+    }
+
+    F.workers = calloc(F.nworkers, sizeof(worker_t));
+    atomic_init(&F.pending, 0);
+    atomic_init(&F.queued, 0);
+    atomic_init(&F.sleepers, 0);
+    pthread_mutex_init(&F.idle_lock, NULL);
+    pthread_cond_init(&F.idle_cond, NULL);
+    pthread_mutex_init(&F.out_lock, NULL);
+    for (int i = 0; i < F.nworkers; i++) {
+        worker_t *w = &F.workers[i];
+        pthread_mutex_init(&w->lock, NULL);
+        w->dents = xmalloc(DENTS_BUFSIZE);
+        w->out = xmalloc(OUT_BUFSIZE);
+        w->seed = i + 1;
+    }
+    push(&F.workers[0], root);
+
+    pthread_t *tids = xmalloc(F.nworkers * sizeof(pthread_t));
+    for (int i = 1; i < F.nworkers; i++) pthread_create(&tids[i], NULL, worker_main, &F.workers[i]);
+    worker_main(&F.workers[0]);
+    for (int i = 1; i < F.nworkers; i++) pthread_join(tids[i], NULL);
 
-    /* After going through all the entries, close the directory. */
-    if (closedir(d))
-    {
-        fprintf(stderr, "Could not close '%s': %s\n",
-                dir_name, strerror(errno));
+    if (F.sorted) {
+        // gather every worker's matches, sort them, print through worker 0
+        size_t total = 0;
+        for (int i = 0; i < F.nworkers; i++) total += F.workers[i].nmatches;
+        char **all = xmalloc((total + 1) * sizeof(char *));
+        size_t k = 0;
+        for (int i = 0; i < F.nworkers; i++) {
+            memcpy(all + k, F.workers[i].matches, F.workers[i].nmatches * sizeof(char *));
+            k += F.workers[i].nmatches;
+        }
+        qsort(all, total, sizeof(char *), cmp_str);
+        worker_t *w = &F.workers[0];
+        for (size_t i = 0; i < total; i++) {
+            out_line(w, all[i], strlen(all[i]));
+            free(all[i]);
+        }
+        flush_output(w);
+        free(all);
     }
 
+    for (int i = 0; i < F.nworkers; i++) {
+        worker_t *w = &F.workers[i];
+        pthread_mutex_destroy(&w->lock);
+        free(w->items);
+        free(w->dents);
+        free(w->out);
+        free(w->path);
+        free(w->matches);
+    }
+    free(F.workers);
+    free(tids);
+    match_free();
     return EXIT_SUCCESS;
 }
-
-int main(int argc, char **args)
-{
-    return execute(args);
-}
\ No newline at end of file
@@ -1,7 +1,73 @@
+#define _GNU_SOURCE
 #include "system_program.h"
+#include <stdint.h>
+#include <grp.h>
+#include <sys/syscall.h>
+
+/*
+    List the items in the current directory (or the one given).
+
+      ld [-l] [-S | -t] [dir]
+      ld -r           same as ldr
+
+    Names are read with getdents64 into one arena and each entry is
+    stat'ed with statx() relative to the directory fd, asking only for the
+    fields the chosen format and sort key use. The entries sit in one
+    contiguous array; the sort runs over small {key, index} pairs (the
+    first 8 bytes of the name, the size or the mtime) and only falls back
+    to comparing whole names on ties. Output goes through one large
+    buffer, with color only when stdout is a terminal.
+*/
+
+#define DENTS_BUFSIZE (1024 * 1024)
+#define OUT_BUFSIZE   (1024 * 1024)
+
+// the layout getdents64 fills in; glibc has no header for it
+struct linux_dirent64
+{
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+typedef struct
+{
+    uint32_t name;  // offset in the name arena
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    int64_t size;
+    int64_t mtime;  // seconds
+} entry_t;
+
+typedef struct
+{
+    uint64_t key;
+    uint32_t idx;
+} sort_key_t;
+
+enum { SORT_NAME, SORT_SIZE, SORT_TIME };
+
+#ifdef MULTICALL
+int ldr_main(int argc, char **argv);
+#endif
+
+static struct
+{
+    char *names;
+    size_t names_len, names_cap;
+    entry_t *entries;
+    size_t count, cap;
+
+    char out[OUT_BUFSIZE];
+    size_t out_len;
+    int color;
+} L;
 
 // Function to convert permissions to a string
-void perms_to_string(mode_t mode, char str[11])
+static void perms_to_string(mode_t mode, char str[11])
 {
     strcpy(str, "----------"); // Default to all permissions off
 
@@ -11,6 +77,8 @@ void perms_to_string(mode_t mode, char str[11])
         str[0] = 'c'; // Character device
     if (S_ISBLK(mode))
         str[0] = 'b'; // Block device
+    if (S_ISLNK(mode))
+        str[0] = 'l'; // Symbolic link
 
     if (mode & S_IRUSR)
         str[1] = 'r'; // Owner has read permission
@@ -32,72 +100,365 @@ void perms_to_string(mode_t mode, char str[11])
         str[9] = 'x'; // Others have execute permission
 }
 
-/*
-    List the items in the directory
-*/
-int execute(char **args)
+static void flush_out(void)
+{
+    size_t off = 0;
+    while (off < L.out_len)
+    {
+        ssize_t n = write(STDOUT_FILENO, L.out + off, L.out_len - off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break; // reader went away; nothing useful left to do
+        off += n;
+    }
+    L.out_len = 0;
+}
+
+static void out_str(const char *s, size_t len)
 {
-    if (args[1] != NULL)
+    if (L.out_len + len > OUT_BUFSIZE)
+        flush_out();
+    if (len > OUT_BUFSIZE)
     {
-        char *token = strtok(args[1], SHELL_OPT_DELIM);
-        // printf("Token is %s\n", token);
+        write(STDOUT_FILENO, s, len);
+        return;
+    }
+    memcpy(L.out + L.out_len, s, len);
+    L.out_len += len;
+}
 
-        if (token != NULL)
+static void out_color(const char *code)
+{
+    if (L.color)
+        out_str(code, strlen(code));
+}
+
+// a few distinct owners per directory is the norm: remember the last lookups
+static const char *owner_name(uid_t uid, int is_group)
+{
+    static struct
+    {
+        uid_t id;
+        int is_group;
+        char name[32];
+    } cache[16];
+    static int used, next;
+
+    for (int i = 0; i < used; i++)
+    {
+        if (cache[i].id == uid && cache[i].is_group == is_group)
+            return cache[i].name;
+    }
+    int slot = next;
+    next = (next + 1) % 16;
+    if (used < 16)
+        used++;
+    cache[slot].id = uid;
+    cache[slot].is_group = is_group;
+
+    const char *name = NULL;
+    if (is_group)
+    {
+        struct group *gr = getgrgid(uid);
+        name = gr ? gr->gr_name : NULL;
+    }
+    else
+    {
+        struct passwd *pw = getpwuid(uid);
+        name = pw ? pw->pw_name : NULL;
+    }
+    if (name)
+        snprintf(cache[slot].name, sizeof(cache[slot].name), "%s", name);
+    else
+        snprintf(cache[slot].name, sizeof(cache[slot].name), "%u", (unsigned)uid);
+    return cache[slot].name;
+}
+
+static int stat_entry(int dfd, const char *name, unsigned mask, entry_t *e)
+{
+    static int have_statx = 1;
+    if (have_statx)
+    {
+        struct statx stx;
+        if (statx(dfd, name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC, mask, &stx) == 0)
+        {
+            e->mode = stx.stx_mode;
+            e->uid = stx.stx_uid;
+            e->gid = stx.stx_gid;
+            e->size = stx.stx_size;
+            e->mtime = stx.stx_mtime.tv_sec;
+            return 0;
+        }
+        if (errno != ENOSYS)
+            return -1;
+        have_statx = 0; // old kernel
+    }
+    struct stat st;
+    if (fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+        return -1;
+    e->mode = st.st_mode;
+    e->uid = st.st_uid;
+    e->gid = st.st_gid;
+    e->size = st.st_size;
+    e->mtime = st.st_mtime;
+    return 0;
+}
+
+/* read every non-dot entry of dfd into L, stat'ed with the fields in mask */
+static int read_dir(int dfd, unsigned mask)
+{
+    char *dents = malloc(DENTS_BUFSIZE);
+    if (!dents)
+        return -1;
+
+    for (;;)
+    {
+        long nread = syscall(SYS_getdents64, dfd, dents, DENTS_BUFSIZE);
+        if (nread < 0)
+        {
+            perror("ld");
+            break;
+        }
+        if (nread == 0)
+            break;
+        for (long off = 0; off < nread;)
         {
-            if (strcmp(token, "r") == 0)
+            struct linux_dirent64 *d = (struct linux_dirent64 *)(dents + off);
+            off += d->d_reclen;
+            if (d->d_name[0] == '.') // Skip dotfiles
+                continue;
+
+            size_t len = strlen(d->d_name) + 1;
+            // grown through a temporary: if realloc fails, L still owns the old block and frees it
+            if (L.names_len + len > L.names_cap)
             {
-                // call listdirall,
-                // execvp still need the ./bin because this was called
-                // by a process that was at the .. directory
-                if (execvp("./bin/ldr", args) == -1)
+                size_t cap = (L.names_len + len) * 2;
+                char *names = realloc(L.names, cap);
+                if (!names)
                 {
-                    perror("Failed to execute, command is invalid.");
+                    perror("ld");
+                    free(dents);
+                    return -1;
                 }
-                return 1;
+                L.names = names;
+                L.names_cap = cap;
             }
-            else
+            if (L.count == L.cap)
             {
-                printf("Invalid option. Use -r to display all files within the current directory and its subdirectories.\n");
-                return EXIT_SUCCESS;
+                size_t cap = L.cap ? L.cap * 2 : 1024;
+                entry_t *entries = realloc(L.entries, cap * sizeof(entry_t));
+                if (!entries)
+                {
+                    perror("ld");
+                    free(dents);
+                    return -1;
+                }
+                L.entries = entries;
+                L.cap = cap;
             }
+
+            entry_t *e = &L.entries[L.count];
+            if (stat_entry(dfd, d->d_name, mask, e) != 0)
+            {
+                fprintf(stderr, "stat failed: %s: %s\n", d->d_name, strerror(errno));
+                continue;
+            }
+            e->name = L.names_len;
+            memcpy(L.names + L.names_len, d->d_name, len);
+            L.names_len += len;
+            L.count++;
         }
     }
+    free(dents);
+    return 0;
+}
 
-    // print out all the contents of the directory using opendir() function
-    DIR *d;
-    struct dirent *dir;
-    struct stat st;
-    char permissions[11];
-    d = opendir(".");
-    if (d)
+// the first 8 bytes of a name as a big-endian number, so integer order is strcmp order
+static uint64_t name_prefix(const char *s)
+{
+    uint64_t k = 0;
+    int i = 0;
+    for (; i < 8 && s[i]; i++)
+        k = (k << 8) | (unsigned char)s[i];
+    return i == 0 ? 0 : k << (8 * (8 - i));
+}
+
+static int cmp_key(const void *a, const void *b)
+{
+    const sort_key_t *x = a, *y = b;
+    if (x->key != y->key)
+        return x->key < y->key ? -1 : 1;
+    return strcmp(L.names + L.entries[x->idx].name, L.names + L.entries[y->idx].name);
+}
+
+static sort_key_t *sort_entries(int sort)
+{
+    sort_key_t *keys = malloc((L.count + 1) * sizeof(sort_key_t));
+    if (!keys)
+        return NULL;
+    for (size_t i = 0; i < L.count; i++)
+    {
+        const entry_t *e = &L.entries[i];
+        keys[i].idx = i;
+        // largest and newest first, as ls -S and ls -t do
+        if (sort == SORT_SIZE)
+            keys[i].key = UINT64_MAX - (uint64_t)e->size;
+        else if (sort == SORT_TIME)
+            keys[i].key = (uint64_t)INT64_MAX - (uint64_t)e->mtime;
+        else
+            keys[i].key = name_prefix(L.names + e->name);
+    }
+    qsort(keys, L.count, sizeof(sort_key_t), cmp_key);
+    return keys;
+}
+
+static int digits(int64_t v)
+{
+    int n = 1;
+    while (v >= 10)
+    {
+        v /= 10;
+        n++;
+    }
+    return n;
+}
+
+static void print_entries(const sort_key_t *keys, int long_format)
+{
+    char line[512], permissions[11], when[32] = "";
+    int size_width = 1;
+    int64_t last_minute = INT64_MIN;
+    if (long_format)
+    {
+        for (size_t i = 0; i < L.count; i++)
+        {
+            int w = digits(L.entries[i].size);
+            if (w > size_width)
+                size_width = w;
+        }
+    }
+
+    for (size_t i = 0; i < L.count; i++)
     {
-        while ((dir = readdir(d)) != NULL)
+        const entry_t *e = &L.entries[keys[i].idx];
+        const char *name = L.names + e->name;
+        perms_to_string(e->mode, permissions);
+
+        out_color(COLOR_RED);
+        out_str(permissions, 10);
+        out_str(" ", 1);
+        if (long_format)
         {
-            // Skip dotfiles
-            if (dir->d_name[0] != '.')
+            // entries in one directory often share a minute: format it once
+            if (e->mtime / 60 != last_minute)
             {
-                if (stat(dir->d_name, &st) == 0)
-                {
-                    perms_to_string(st.st_mode, permissions);
-                    printf(COLOR_RED "%s " COLOR_GREEN "%s\n" COLOR_RESET, permissions, dir->d_name);
-                }
-                else
-                {
-                    perror("stat failed");
-                }
+                time_t t = e->mtime;
+                struct tm tm;
+                localtime_r(&t, &tm);
+                strftime(when, sizeof(when), "%Y-%m-%d %H:%M", &tm);
+                last_minute = e->mtime / 60;
             }
+            int n = snprintf(line, sizeof(line), "%-8s %-8s %*lld %s ",
+                             owner_name(e->uid, 0), owner_name(e->gid, 1),
+                             size_width, (long long)e->size, when);
+            out_color(COLOR_RESET);
+            out_str(line, n < (int)sizeof(line) ? n : (int)sizeof(line) - 1);
         }
-        closedir(d);
+        out_color(COLOR_GREEN);
+        out_str(name, strlen(name));
+        out_color(COLOR_RESET);
+        out_str("\n", 1);
     }
-    else
+    flush_out();
+}
+
+static void usage(void)
+{
+    printf("Usage: ld [-l] [-S | -t] [dir], to list the items in a directory\n");
+    printf("  -l   also show owner, group, size and modification time\n");
+    printf("  -S   sort by size, largest first\n");
+    printf("  -t   sort by modification time, newest first\n");
+    printf("  -r   list this directory and all of its subdirectories (ldr)\n");
+}
+
+/*
+    List the items in the directory
+*/
+static int execute(char **args)
+{
+    int argc = 0, opt, long_format = 0, sort = SORT_NAME;
+    while (args[argc] != NULL)
+        argc++;
+
+    while ((opt = getopt(argc, args, "lStr")) != -1)
+    {
+        switch (opt)
+        {
+        case 'l':
+            long_format = 1;
+            break;
+        case 'S':
+            sort = SORT_SIZE;
+            break;
+        case 't':
+            sort = SORT_TIME;
+            break;
+        case 'r':
+#ifdef MULTICALL
+            // inside the shell: exec would replace it, so call ldr directly
+            optind = 0;
+            return ldr_main(argc, args);
+#else
+            // call listdirall,
+            // execvp still need the ./bin because this was called
+            // by a process that was at the .. directory
+            if (execvp("./bin/ldr", args) == -1)
+            {
+                perror("Failed to execute, command is invalid.");
+            }
+            return 1;
+#endif
+        default:
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+    const char *path = optind < argc ? args[optind] : ".";
+
+    unsigned mask = STATX_TYPE | STATX_MODE;
+    if (long_format || sort == SORT_SIZE)
+        mask |= STATX_SIZE;
+    if (long_format || sort == SORT_TIME)
+        mask |= STATX_MTIME;
+    if (long_format)
+        mask |= STATX_UID | STATX_GID;
+
+    int dfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd < 0)
     {
         printf("Directory doesn't exist. \n");
+        return EXIT_SUCCESS;
     }
+    L.color = isatty(STDOUT_FILENO);
+    int rc = read_dir(dfd, mask);
+    close(dfd);
 
-    return EXIT_SUCCESS;
+    sort_key_t *keys = rc == 0 ? sort_entries(sort) : NULL;
+    if (keys)
+        print_entries(keys, long_format);
+    else
+        rc = -1;
+    free(keys);
+    free(L.entries);
+    free(L.names);
+    L.entries = NULL;
+    L.names = NULL;
+    L.count = L.cap = L.names_len = L.names_cap = 0;
+    return rc == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
 int main(int argc, char **args)
 {
     return execute(args);
-}
\ No newline at end of file
+}
@@ -1,6 +1,93 @@
+#define _GNU_SOURCE
 #include "system_program.h"
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/syscall.h>
 
-void perms_to_string(mode_t mode, char str[11])
+/*
+    Recursively list all visible files under the current directory with
+    permissions.
+
+      ldr [-d depth] [-j threads]
+
+    The walk is iterative: a stack holds one frame per open directory
+    (its fd, its sorted entries and how far it has got), so the depth is
+    only bounded by the fd limit and the path is rebuilt in a growing
+    buffer instead of a fixed array. Entries are stat'ed with fstatat()
+    relative to their directory's fd, a directory's entries all at once by
+    a pool of threads. Each directory is printed in name order right
+    before its subdirectories, so the output is the same on every run.
+    Lines go through one large buffer; a summary goes to stderr so that
+    pipelines such as `ldr | wc -l` still count entries only.
+*/
+
+#define DENTS_BUFSIZE (256 * 1024)
+#define OUT_BUFSIZE   (256 * 1024)
+#define MAX_THREADS   64
+#define PARALLEL_MIN  64 // smaller directories are stat'ed inline
+#define STAT_CHUNK    32
+
+// the layout getdents64 fills in; glibc has no header for it
+struct linux_dirent64
+{
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+typedef struct
+{
+    uint32_t name; // offset in the frame's name arena
+    uint32_t namelen;
+    mode_t mode;
+    int64_t size;
+    int err; // errno of a failed fstatat, else 0
+} item_t;
+
+// a directory being listed
+typedef struct
+{
+    int fd;
+    char *names;
+    item_t *items;
+    size_t count, next;
+    size_t plen; // length of its path
+    int depth;   // of its entries; the top level is 1
+} frame_t;
+
+// the stat pool: one batch at a time, handed out in chunks
+static struct
+{
+    pthread_t *tids;
+    int nthreads;
+    pthread_mutex_t lock;
+    pthread_cond_t work, done;
+    unsigned generation; // bumped for every batch
+    int active;          // threads still on the current batch
+    int quit;
+
+    int dfd;
+    const char *names;
+    item_t *items;
+    size_t count;
+    atomic_size_t next;
+} P;
+
+static struct
+{
+    char out[OUT_BUFSIZE];
+    size_t out_len;
+    int color;
+    char *path;
+    size_t path_cap;
+    size_t ndirs, nfiles, nerrors;
+    uint64_t bytes;
+} W;
+
+static void perms_to_string(mode_t mode, char str[11])
 {
     strcpy(str, "----------");
     if (S_ISDIR(mode))
@@ -9,6 +96,8 @@ void perms_to_string(mode_t mode, char str[11])
         str[0] = 'c';
     if (S_ISBLK(mode))
         str[0] = 'b';
+    if (S_ISLNK(mode))
+        str[0] = 'l';
 
     if (mode & S_IRUSR)
         str[1] = 'r';
@@ -30,66 +119,364 @@ void perms_to_string(mode_t mode, char str[11])
         str[9] = 'x';
 }
 
-void print_path_with_colored_slash(const char *path)
+static void *xrealloc(void *p, size_t n)
+{
+    p = realloc(p, n);
+    if (!p)
+    {
+        perror("ldr");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+static void flush_out(void)
+{
+    size_t off = 0;
+    while (off < W.out_len)
+    {
+        ssize_t n = write(STDOUT_FILENO, W.out + off, W.out_len - off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break; // reader went away
+        off += n;
+    }
+    W.out_len = 0;
+}
+
+static void out_str(const char *s, size_t len)
+{
+    if (W.out_len + len > OUT_BUFSIZE)
+        flush_out();
+    if (len > OUT_BUFSIZE)
+    {
+        write(STDOUT_FILENO, s, len);
+        return;
+    }
+    memcpy(W.out + W.out_len, s, len);
+    W.out_len += len;
+}
+
+static void out_color(const char *code)
+{
+    if (W.color)
+        out_str(code, strlen(code));
+}
+
+static void print_path_with_colored_slash(const char *path, size_t len)
+{
+    if (!W.color)
+    {
+        out_str(path, len);
+        return;
+    }
+    size_t start = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        if (path[i] == '/')
+        {
+            out_str(path + start, i - start);
+            out_str(COLOR_YELLOW "/" COLOR_GREEN, strlen(COLOR_YELLOW "/" COLOR_GREEN));
+            start = i + 1;
+        }
+    }
+    out_str(path + start, len - start);
+    out_color(COLOR_RESET);
+}
+
+static void stat_range(int dfd, const char *names, item_t *items, size_t from, size_t to)
 {
-    const char *p = path;
-    while (*p)
+    for (size_t i = from; i < to; i++)
     {
-        if (*p == '/')
+        struct stat st;
+        if (fstatat(dfd, names + items[i].name, &st, AT_SYMLINK_NOFOLLOW) == 0)
         {
-            printf(COLOR_YELLOW "/%s" COLOR_RESET, COLOR_GREEN);
+            items[i].mode = st.st_mode;
+            items[i].size = st.st_size;
+            items[i].err = 0;
         }
         else
         {
-            putchar(*p);
+            items[i].err = errno;
         }
-        p++;
     }
 }
 
-void list_directory(const char *basePath)
+static void run_batch(void)
 {
-    char path[1000];
-    struct dirent *dp;
-    DIR *dir = opendir(basePath);
-    if (!dir)
-        return; // Unable to open directory
+    size_t i;
+    while ((i = atomic_fetch_add(&P.next, STAT_CHUNK)) < P.count)
+    {
+        size_t end = i + STAT_CHUNK < P.count ? i + STAT_CHUNK : P.count;
+        stat_range(P.dfd, P.names, P.items, i, end);
+    }
+}
+
+static void *stat_worker(void *arg)
+{
+    (void)arg;
+    unsigned seen = 0;
+    pthread_mutex_lock(&P.lock);
+    for (;;)
+    {
+        while (P.generation == seen && !P.quit)
+            pthread_cond_wait(&P.work, &P.lock);
+        if (P.quit)
+            break;
+        seen = P.generation;
+        pthread_mutex_unlock(&P.lock);
+
+        run_batch();
+
+        pthread_mutex_lock(&P.lock);
+        if (--P.active == 0)
+            pthread_cond_signal(&P.done);
+    }
+    pthread_mutex_unlock(&P.lock);
+    return NULL;
+}
+
+/* stat every item of a directory, spread over the pool when it is large */
+static void stat_items(int dfd, const char *names, item_t *items, size_t count)
+{
+    if (P.nthreads == 0 || count < PARALLEL_MIN)
+    {
+        stat_range(dfd, names, items, 0, count);
+        return;
+    }
+    pthread_mutex_lock(&P.lock);
+    P.dfd = dfd;
+    P.names = names;
+    P.items = items;
+    P.count = count;
+    atomic_store(&P.next, 0);
+    P.active = P.nthreads;
+    P.generation++;
+    pthread_cond_broadcast(&P.work);
+    pthread_mutex_unlock(&P.lock);
+
+    run_batch(); // this thread helps too
+
+    pthread_mutex_lock(&P.lock);
+    while (P.active > 0)
+        pthread_cond_wait(&P.done, &P.lock);
+    pthread_mutex_unlock(&P.lock);
+}
+
+static const char *sort_names;
+
+static int cmp_item(const void *a, const void *b)
+{
+    return strcmp(sort_names + ((const item_t *)a)->name, sort_names + ((const item_t *)b)->name);
+}
+
+/* read, stat and sort the visible entries of the directory open on f->fd */
+static void load_frame(frame_t *f)
+{
+    static char dents[DENTS_BUFSIZE];
+    size_t names_len = 0, names_cap = 0, cap = 0;
 
-    while ((dp = readdir(dir)) != NULL)
+    for (;;)
     {
-        if (strcmp(dp->d_name, ".") != 0 && strcmp(dp->d_name, "..") != 0)
+        long nread = syscall(SYS_getdents64, f->fd, dents, DENTS_BUFSIZE);
+        if (nread <= 0)
+            break;
+        for (long off = 0; off < nread;)
         {
-            // Construct new path
-            snprintf(path, sizeof(path), "%s/%s", basePath, dp->d_name);
+            struct linux_dirent64 *d = (struct linux_dirent64 *)(dents + off);
+            off += d->d_reclen;
+            // Skip dotfiles (and "." and "..")
+            if (d->d_name[0] == '.')
+                continue;
 
-            // Skip dotfiles
-            if (dp->d_name[0] != '.')
+            size_t len = strlen(d->d_name);
+            if (names_len + len + 1 > names_cap)
             {
-                struct stat st;
-                char permissions[11] = {0};
-                if (stat(path, &st) == 0)
-                {
-                    perms_to_string(st.st_mode, permissions);
-                    printf(COLOR_RED "%s " COLOR_RESET, permissions);
-                    print_path_with_colored_slash(path);
-                    printf("\n");
-                }
-
-                // Recursively list directories
-                if (S_ISDIR(st.st_mode))
-                {
-                    list_directory(path);
-                }
+                names_cap = (names_len + len + 1) * 2;
+                f->names = xrealloc(f->names, names_cap);
             }
+            if (f->count == cap)
+            {
+                cap = cap ? cap * 2 : 64;
+                f->items = xrealloc(f->items, cap * sizeof(item_t));
+            }
+            item_t *it = &f->items[f->count++];
+            it->name = names_len;
+            it->namelen = len;
+            memcpy(f->names + names_len, d->d_name, len + 1);
+            names_len += len + 1;
+        }
+    }
+
+    stat_items(f->fd, f->names, f->items, f->count);
+    sort_names = f->names;
+    qsort(f->items, f->count, sizeof(item_t), cmp_item);
+}
+
+// the path of entry it of frame f, in W.path; returns its length
+static size_t set_path(const frame_t *f, const item_t *it)
+{
+    size_t len = f->plen + 1 + it->namelen;
+    if (len + 1 > W.path_cap)
+    {
+        W.path_cap = (len + 1) * 2;
+        W.path = xrealloc(W.path, W.path_cap);
+    }
+    W.path[f->plen] = '/';
+    memcpy(W.path + f->plen + 1, f->names + it->name, it->namelen + 1);
+    return len;
+}
+
+static void list_directory(const char *basePath, int max_depth)
+{
+    frame_t *stack = NULL;
+    size_t depth = 0, stack_cap = 0;
+
+    int fd = open(basePath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Cannot open directory '%s': %s\n", basePath, strerror(errno));
+        return; // Unable to open directory
+    }
+    size_t plen = strlen(basePath);
+    W.path_cap = plen + 256;
+    W.path = xrealloc(W.path, W.path_cap);
+    memcpy(W.path, basePath, plen + 1);
+
+    stack_cap = 16;
+    stack = xrealloc(NULL, stack_cap * sizeof(frame_t));
+    stack[0] = (frame_t){ .fd = fd, .plen = plen, .depth = 1 };
+    load_frame(&stack[0]);
+    depth = 1;
+
+    char permissions[11];
+    while (depth > 0)
+    {
+        frame_t *f = &stack[depth - 1];
+        if (f->next == f->count)
+        {
+            close(f->fd);
+            free(f->names);
+            free(f->items);
+            depth--;
+            continue;
+        }
+
+        item_t *it = &f->items[f->next++];
+        size_t len = set_path(f, it);
+        if (it->err)
+        {
+            fprintf(stderr, "Cannot stat '%s': %s\n", W.path, strerror(it->err));
+            W.nerrors++;
+            continue;
+        }
+
+        perms_to_string(it->mode, permissions);
+        out_color(COLOR_RED);
+        out_str(permissions, 10);
+        out_str(" ", 1);
+        out_color(COLOR_RESET);
+        print_path_with_colored_slash(W.path, len);
+        out_str("\n", 1);
+
+        if (!S_ISDIR(it->mode))
+        {
+            W.nfiles++;
+            W.bytes += it->size;
+            continue;
+        }
+        W.ndirs++;
+        if (max_depth > 0 && f->depth >= max_depth)
+            continue;
+
+        // Descend: the child becomes the top of the stack
+        int child = openat(f->fd, f->names + it->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (child < 0)
+        {
+            fprintf(stderr, "Cannot open directory '%s': %s\n", W.path, strerror(errno));
+            W.nerrors++;
+            continue;
+        }
+        if (depth == stack_cap)
+        {
+            stack_cap *= 2;
+            stack = xrealloc(stack, stack_cap * sizeof(frame_t));
+            f = &stack[depth - 1];
         }
+        stack[depth] = (frame_t){ .fd = child, .plen = len, .depth = f->depth + 1 };
+        load_frame(&stack[depth]);
+        depth++;
     }
-    closedir(dir);
+    flush_out();
+    free(stack);
+}
+
+static void usage(void)
+{
+    printf("Usage: ldr [-d depth] [-j threads], to list every visible file under the current directory\n");
+    printf("  -d N   go at most N levels deep (1 lists only this directory)\n");
+    printf("  -j N   stat with N threads\n");
 }
 
-int main()
+int main(int argc, char **argv)
 {
-    // printf("Recursively listing all visible files under the current directory with permissions:\n");
-    list_directory(".");
+    int opt, max_depth = 0;
+    long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    while ((opt = getopt(argc, argv, "d:j:r")) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            max_depth = atoi(optarg);
+            break;
+        case 'j':
+            nthreads = atoi(optarg);
+            break;
+        case 'r': // from `ld -r`; already recursive
+            break;
+        default:
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+    if (nthreads < 1)
+        nthreads = 1;
+    if (nthreads > MAX_THREADS)
+        nthreads = MAX_THREADS;
+
+    // the walking thread takes part in every batch, so start one fewer
+    memset(&P, 0, sizeof(P));
+    pthread_mutex_init(&P.lock, NULL);
+    pthread_cond_init(&P.work, NULL);
+    pthread_cond_init(&P.done, NULL);
+    P.tids = xrealloc(NULL, nthreads * sizeof(pthread_t));
+    for (int i = 0; i < nthreads - 1; i++)
+    {
+        if (pthread_create(&P.tids[i], NULL, stat_worker, NULL) != 0)
+            break;
+        P.nthreads++;
+    }
+
+    W.out_len = 0;
+    W.ndirs = W.nfiles = W.nerrors = 0;
+    W.bytes = 0;
+    W.color = isatty(STDOUT_FILENO);
+    list_directory(".", max_depth);
+
+    pthread_mutex_lock(&P.lock);
+    P.quit = 1;
+    pthread_cond_broadcast(&P.work);
+    pthread_mutex_unlock(&P.lock);
+    for (int i = 0; i < P.nthreads; i++)
+        pthread_join(P.tids[i], NULL);
+    free(P.tids);
+    free(W.path);
+    W.path = NULL;
+    W.path_cap = 0;
 
-    return EXIT_SUCCESS;
+    fprintf(stderr, "%zu directories, %zu files, %llu bytes%s\n", W.ndirs, W.nfiles,
+            (unsigned long long)W.bytes, W.nerrors ? " (some entries could not be read)" : "");
+    return W.nerrors ? EXIT_FAILURE : EXIT_SUCCESS;
 }
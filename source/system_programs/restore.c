@@ -0,0 +1,778 @@
+// restore.c
+#define _GNU_SOURCE
+#include "system_program.h"
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <zlib.h>
+#include "csa_format.h"
+#include "snap_format.h"
+
+/*
+ List, verify or restore an archive written by "backup -a", or a snapshot
+ written by "backup".
+
+   restore -l [archive]                      list what it holds
+   restore -t [-j N] [archive]               check every block's CRC
+   restore [-j N] [-C DIR] [archive [path...]]
+   ... | restore [-l | -t] [-C DIR] - [path...]
+
+ Without an archive the newest archive/backup-*.csa or .snap is used. Only
+ the trailer and the central index at the end of the archive are read to
+ find out what is in it, so listing costs two preads however large it is.
+
+ Verifying and restoring split the work into units of up to UNIT_BLOCKS
+ blocks of one file and hand them to -j threads (default one per CPU).
+ Each thread preads its blocks from the shared archive fd, inflates them,
+ checks their CRC and, when restoring, pwrites them into place. Every unit
+ of a file opens it, preallocates its full size with fallocate and sets it
+ with ftruncate, which all come to the same whatever order the units run
+ in; whoever finishes a file's last unit sets its mode and mtime.
+
+ Directories are made first and given their mode and mtime last, deepest
+ first; symlinks are made after the files so nothing is written through
+ one. Paths that are absolute or contain ".." are skipped.
+
+ An archive given as "-" is read from standard input front to back, as
+ it comes down a pipe, by one thread: each entry is listed, checked or
+ written as it goes by, and directories and symlinks are finished at the
+ end as above.
+
+ A snapshot is read whole and its chunks are found through the chunks.idx
+ beside it, sorted by hash. Each file is one unit: its chunks are preaded
+ from their packs in order and hashed as they go, and the file counts as
+ damaged unless the result is the SHA-256 the snapshot recorded for it.
+*/
+
+#define ARCHIVE_DIR  "./archive"
+#define UNIT_BLOCKS  16
+#define MAX_THREADS  256
+
+typedef struct {
+    csa_entry_t  e;
+    const char  *path, *link;   // into the index, not terminated
+    const char  *blocks;        // e.nblocks packed csa_block_t, or a snapshot's chunk hashes
+    const char  *hash;          // a snapshot's SHA-256 of the contents
+    atomic_int   units_left;
+    int          selected;
+} entry_t;
+
+typedef struct {
+    size_t   entry;
+    uint64_t first, count;      // blocks of the entry
+    uint64_t file_off;          // where the first one goes
+} unit_t;
+
+static struct {
+    int            fd, dest;    // archive, and the directory restored into
+    char          *index;
+    entry_t       *entries;
+    size_t         nentries;
+    unit_t        *units;
+    size_t         nunits;
+    atomic_size_t  next_unit;
+    int            verify_only;
+    atomic_ullong  bytes, bad_blocks, errors;
+
+    int            snap, dir;   // reading a snapshot, and the directory it is in
+    chunk_rec_t   *chunks;      // chunks.idx, sorted by hash
+    size_t         nchunks;
+    atomic_int    *packs;       // pack fds, opened as they are first needed; -1 until then
+    uint32_t       npacks;
+} X;
+
+static void usage(void) {
+    printf("Usage: restore [-l | -t] [-j threads] [-C dir] [archive [path...]], to restore a backup\n");
+    printf("  archive   a .csa archive or .snap snapshot (default: the newest in %s),\n", ARCHIVE_DIR);
+    printf("            or - to read an archive front to back from standard input\n");
+    printf("  path      only restore these files or directories\n");
+    printf("  -l        list the archive\n");
+    printf("  -t        verify the checksum of every block, or of every file of a snapshot\n");
+    printf("  -C DIR    restore into DIR instead of the current directory\n");
+    printf("  -j N      use N threads\n");
+}
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// the newest backup-*.csa or .snap; the names sort by time
+static int newest_archive(char *out, size_t n) {
+    DIR *d = opendir(ARCHIVE_DIR);
+    if (!d) return -1;
+    struct dirent *e;
+    char best[256] = "";
+    while ((e = readdir(d)) != NULL) {
+        size_t len = strlen(e->d_name);
+        if (strncmp(e->d_name, "backup-", 7) != 0 ||
+            !((len >= 11 && strcmp(e->d_name + len - 4, ".csa") == 0) ||
+              (len >= 12 && strcmp(e->d_name + len - 5, ".snap") == 0)))
+            continue;
+        if (strcmp(e->d_name, best) > 0) snprintf(best, sizeof(best), "%s", e->d_name);
+    }
+    closedir(d);
+    if (!best[0]) return -1;
+    snprintf(out, n, ARCHIVE_DIR "/%s", best);
+    return 0;
+}
+
+static int read_full(int fd, void *buf, size_t n) {
+    for (char *p = buf; n; ) {
+        ssize_t r = read(fd, p, n);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return -1;
+        p += r;
+        n -= r;
+    }
+    return 0;
+}
+
+static int pread_full(int fd, void *buf, size_t n, uint64_t off) {
+    for (char *p = buf; n; ) {
+        ssize_t r = pread(fd, p, n, off);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return -1;
+        p += r;
+        n -= r;
+        off += r;
+    }
+    return 0;
+}
+
+static int cmp_chunks(const void *a, const void *b) {
+    return memcmp(((const chunk_rec_t *)a)->hash, ((const chunk_rec_t *)b)->hash, 32);
+}
+
+// chunks.idx next to the snapshot, sorted so chunks can be looked up by hash
+static int load_chunk_index(const char *file) {
+    char dir[PATH_MAX];
+    const char *slash = strrchr(file, '/');
+    snprintf(dir, sizeof(dir), "%.*s", slash ? (slash == file ? 1 : (int)(slash - file)) : 1, slash ? file : ".");
+    X.dir = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    int fd = X.dir < 0 ? -1 : openat(X.dir, "chunks.idx", O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    char magic[8];
+    if (fd < 0 || fstat(fd, &st) < 0 || pread_full(fd, magic, 8, 0) < 0 || memcmp(magic, SNAP_IDX_MAGIC, 8) != 0) {
+        fprintf(stderr, "restore: %s/chunks.idx: %s\n", dir, fd < 0 ? strerror(errno) : "not a chunk index");
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    X.nchunks = (st.st_size - 8) / sizeof(chunk_rec_t);   // a record cut short by a crash is not used
+    X.chunks = malloc(X.nchunks * sizeof(chunk_rec_t) + 1);
+    int failed = pread_full(fd, X.chunks, X.nchunks * sizeof(chunk_rec_t), 8) < 0;
+    close(fd);
+    if (failed) {
+        fprintf(stderr, "restore: %s/chunks.idx: %s\n", dir, strerror(errno));
+        return -1;
+    }
+    qsort(X.chunks, X.nchunks, sizeof(chunk_rec_t), cmp_chunks);
+    for (size_t i = 0; i < X.nchunks; i++)
+        if (X.chunks[i].pack >= X.npacks) X.npacks = X.chunks[i].pack + 1;
+    X.packs = malloc((X.npacks + 1) * sizeof(atomic_int));
+    for (uint32_t i = 0; i < X.npacks; i++) atomic_init(&X.packs[i], -1);
+    return 0;
+}
+
+// a snapshot, read whole; its entries are described with the archive's entry records
+static int load_snapshot(const char *file) {
+    struct stat st;
+    uint64_t count;
+    if (fstat(X.fd, &st) < 0 || st.st_size < 16 || pread_full(X.fd, &count, 8, 8) < 0 ||
+        count > (uint64_t)st.st_size / sizeof(snap_entry_t)) {
+        fprintf(stderr, "restore: %s: not a complete snapshot\n", file);
+        return -1;
+    }
+    X.index = malloc(st.st_size);
+    if (pread_full(X.fd, X.index, st.st_size, 0) < 0) {
+        fprintf(stderr, "restore: %s: %s\n", file, strerror(errno));
+        return -1;
+    }
+
+    X.entries = calloc(count ? count : 1, sizeof(entry_t));
+    const char *p = X.index + 16, *end = X.index + st.st_size;
+    for (X.nentries = 0; X.nentries < count; X.nentries++) {
+        entry_t *en = &X.entries[X.nentries];
+        snap_entry_t se;
+        if (end - p < (ptrdiff_t)sizeof(se)) break;
+        memcpy(&se, p, sizeof(se));
+        if ((uint64_t)(end - p) - sizeof(se) < (uint64_t)se.path_len + se.link_len + (uint64_t)se.nchunks * 32)
+            break;
+        en->e = (csa_entry_t){ .tag = CSA_TAG_ENTRY, .mode = se.mode, .size = se.size, .mtime_ns = se.mtime_ns,
+                               .path_len = se.path_len, .link_len = se.link_len, .nblocks = se.nchunks };
+        en->hash = p + offsetof(snap_entry_t, hash);
+        en->path = p + sizeof(se);
+        en->link = en->path + se.path_len;
+        en->blocks = en->link + se.link_len;
+        p = en->blocks + (size_t)se.nchunks * 32;
+    }
+    if (X.nentries != count || p != end) {
+        fprintf(stderr, "restore: %s: the snapshot is damaged\n", file);
+        return -1;
+    }
+    X.snap = 1;
+    return load_chunk_index(file);
+}
+
+// read the trailer and the index, and check that they are whole
+static int load_index(const char *file) {
+    X.fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (X.fd < 0) {
+        fprintf(stderr, "restore: %s: %s\n", file, strerror(errno));
+        return -1;
+    }
+    char magic[8];
+    if (pread_full(X.fd, magic, 8, 0) == 0 && memcmp(magic, SNAP_MAGIC, 8) == 0) return load_snapshot(file);
+
+    struct stat st;
+    csa_trailer_t tr;
+    if (fstat(X.fd, &st) < 0 || st.st_size < (off_t)(8 + sizeof(tr)) ||
+        pread_full(X.fd, &tr, sizeof(tr), st.st_size - sizeof(tr)) < 0 ||
+        memcmp(tr.magic, CSA_END_MAGIC, 8) != 0 || tr.index_off + tr.index_len + sizeof(tr) != (uint64_t)st.st_size) {
+        fprintf(stderr, "restore: %s: not a complete backup archive\n", file);
+        return -1;
+    }
+    X.index = malloc(tr.index_len + 1);
+    if (pread_full(X.fd, X.index, tr.index_len, tr.index_off) < 0 ||
+        crc32(0, (const Bytef *)X.index, tr.index_len) != tr.index_crc) {
+        fprintf(stderr, "restore: %s: the index is damaged\n", file);
+        return -1;
+    }
+
+    X.entries = calloc(tr.nentries ? tr.nentries : 1, sizeof(entry_t));
+    const char *p = X.index, *end = X.index + tr.index_len;
+    for (X.nentries = 0; X.nentries < tr.nentries; X.nentries++) {
+        entry_t *en = &X.entries[X.nentries];
+        if (end - p < (ptrdiff_t)sizeof(csa_entry_t)) break;
+        memcpy(&en->e, p, sizeof(en->e));
+        p += sizeof(en->e);
+        if (en->e.tag != CSA_TAG_ENTRY || en->e.nblocks > (uint64_t)(end - p) / sizeof(csa_block_t) ||
+            (uint64_t)(end - p) < en->e.path_len + en->e.link_len + en->e.nblocks * sizeof(csa_block_t))
+            break;
+        en->path = p;
+        en->link = p + en->e.path_len;
+        en->blocks = en->link + en->e.link_len;
+        p = en->blocks + en->e.nblocks * sizeof(csa_block_t);
+    }
+    if (X.nentries != tr.nentries || p != end) {
+        fprintf(stderr, "restore: %s: the index is damaged\n", file);
+        return -1;
+    }
+    return 0;
+}
+
+static void list_entry(const entry_t *en) {
+    const csa_entry_t *e = &en->e;
+    char perms[11] = "----------", when[32];
+    perms[0] = S_ISDIR(e->mode) ? 'd' : S_ISLNK(e->mode) ? 'l' : '-';
+    for (int b = 0; b < 9; b++)
+        if (e->mode & (0400 >> b)) perms[1 + b] = "rwx"[b % 3];
+    time_t t = e->mtime_ns / 1000000000;
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M", localtime(&t));
+    printf("%s %12llu %s %.*s", perms, (unsigned long long)e->size, when, (int)e->path_len, en->path);
+    if (S_ISLNK(e->mode)) printf(" -> %.*s", (int)e->link_len, en->link);
+    putchar('\n');
+}
+
+static void list_archive(void) {
+    uint64_t total = 0;
+    for (size_t i = 0; i < X.nentries; i++) {
+        list_entry(&X.entries[i]);
+        if (S_ISREG(X.entries[i].e.mode)) total += X.entries[i].e.size;
+    }
+    printf("%zu entries, %.1f MB\n", X.nentries, total / 1e6);
+}
+
+// unsafe to create: absolute, or reaching out of the destination with ".."
+static int unsafe_path(const entry_t *en) {
+    const char *p = en->path, *end = p + en->e.path_len;
+    if (en->e.path_len == 0 || *p == '/' || memchr(p, '\0', en->e.path_len)) return 1;
+    while (p < end) {
+        const char *slash = memchr(p, '/', end - p);
+        size_t n = (slash ? slash : end) - p;
+        if (n == 2 && p[0] == '.' && p[1] == '.') return 1;
+        p += n + 1;
+    }
+    return 0;
+}
+
+// whether en is named on the command line or is under one of the paths named; marks those in matched
+static int path_selected(const entry_t *en, char **paths, int npaths, char *matched) {
+    int selected = npaths == 0;
+    for (int k = 0; k < npaths; k++) {
+        size_t n = strlen(paths[k]);
+        while (n > 1 && paths[k][n - 1] == '/') n--;
+        if (en->e.path_len >= n && memcmp(en->path, paths[k], n) == 0 &&
+            (en->e.path_len == n || en->path[n] == '/'))
+            selected = matched[k] = 1;
+    }
+    return selected;
+}
+
+// the paths that matched nothing, each reported; returns how many
+static int report_missing(char **paths, int npaths, const char *matched) {
+    int missing = 0;
+    for (int k = 0; k < npaths; k++) {
+        if (matched[k]) continue;
+        fprintf(stderr, "restore: %s: not in the archive\n", paths[k]);
+        missing++;
+    }
+    return missing;
+}
+
+// mark the entries named on the command line, and everything under them; returns how many named nothing
+static int select_entries(char **paths, int npaths) {
+    char *matched = calloc(npaths + 1, 1);
+    for (size_t i = 0; i < X.nentries; i++)
+        X.entries[i].selected = path_selected(&X.entries[i], paths, npaths, matched);
+    int missing = report_missing(paths, npaths, matched);
+    free(matched);
+    return missing;
+}
+
+static void make_units(void) {
+    size_t cap = 0;
+    for (size_t i = 0; i < X.nentries; i++) {
+        entry_t *en = &X.entries[i];
+        if (!en->selected || !S_ISREG(en->e.mode)) continue;
+        uint64_t first = 0, off = 0;
+        int units = 0;
+        do {
+            if (X.nunits == cap) {
+                cap = cap ? 2 * cap : 1024;
+                X.units = realloc(X.units, cap * sizeof(unit_t));
+            }
+            unit_t *u = &X.units[X.nunits++];
+            u->entry = i;
+            u->first = first;
+            u->count = en->e.nblocks - first < UNIT_BLOCKS || X.snap ? en->e.nblocks - first : UNIT_BLOCKS;
+            u->file_off = off;
+            for (uint64_t b = first; b < first + u->count && !X.snap; b++) {
+                csa_block_t blk;
+                memcpy(&blk, en->blocks + b * sizeof(blk), sizeof(blk));
+                off += blk.raw_len;
+            }
+            first += u->count;
+            units++;
+        } while (first < en->e.nblocks);
+        atomic_store(&en->units_left, units);
+    }
+}
+
+// the times to set: mtime_ns, and the atime left alone
+static void mtime_spec(int64_t mtime_ns, struct timespec ts[2]) {
+    ts[0] = (struct timespec){ .tv_nsec = UTIME_OMIT };
+    ts[1] = (struct timespec){ .tv_sec = mtime_ns / 1000000000, .tv_nsec = mtime_ns % 1000000000 };
+}
+
+static void set_times(int dirfd, const char *path, int64_t mtime_ns, int flags) {
+    struct timespec ts[2];
+    mtime_spec(mtime_ns, ts);
+    utimensat(dirfd, path, ts, flags);
+}
+
+// lengths no block can have, in an archive damaged anywhere
+static int bad_lengths(const csa_block_t *b) {
+    return b->raw_len > CSA_BLOCK_SIZE || b->comp_len > compressBound(CSA_BLOCK_SIZE);
+}
+
+// where the block's data is read to: out if it is stored as is, in if it is to be inflated
+static uint8_t *block_buf(const csa_block_t *b, uint8_t *in, uint8_t *out) {
+    return b->comp_len == b->raw_len ? out : in;
+}
+
+// inflate the block read into block_buf() and check it, leaving the data in out
+static int unpack_block(const csa_block_t *b, z_stream *z, uint8_t *in, uint8_t *out) {
+    if (block_buf(b, in, out) == in) {
+        if (inflateReset(z) != Z_OK) return -1;
+        z->next_in = in;
+        z->avail_in = b->comp_len;
+        z->next_out = out;
+        z->avail_out = CSA_BLOCK_SIZE;
+        if (inflate(z, Z_FINISH) != Z_STREAM_END || z->total_out != b->raw_len) return -1;
+    }
+    return crc32(0, out, b->raw_len) == b->crc ? 0 : -1;
+}
+
+// read, inflate and check one block into out
+static int load_block(const csa_block_t *b, z_stream *z, uint8_t *in, uint8_t *out) {
+    if (bad_lengths(b) || pread_full(X.fd, block_buf(b, in, out), b->comp_len, b->offset) < 0) return -1;
+    return unpack_block(b, z, in, out);
+}
+
+// the pack that holds chunk c, opened by whichever thread needs it first
+static int pack_fd(const chunk_rec_t *c) {
+    int fd = atomic_load(&X.packs[c->pack]);
+    if (fd >= 0) return fd;
+    char name[64];
+    snprintf(name, sizeof(name), "packs/pack-%06u", c->pack);
+    int mine = openat(X.dir, name, O_RDONLY | O_CLOEXEC);
+    if (mine < 0) return -1;
+    if (atomic_compare_exchange_strong(&X.packs[c->pack], &fd, mine)) return mine;
+    close(mine);   // another thread got there first
+    return fd;
+}
+
+// a snapshot's file, chunk after chunk, checked against the SHA-256 of the whole
+static void restore_chunks(entry_t *en, const char *path, int fd, uint8_t *buf) {
+    sha256_t whole;
+    sha256_init(&whole);
+    uint64_t off = 0;
+    for (uint64_t i = 0; i < en->e.nblocks; i++) {
+        chunk_rec_t key;
+        memcpy(key.hash, en->blocks + 32 * i, 32);
+        const chunk_rec_t *c = bsearch(&key, X.chunks, X.nchunks, sizeof(chunk_rec_t), cmp_chunks);
+        int pfd = c && c->len <= CSA_BLOCK_SIZE ? pack_fd(c) : -1;
+        if (pfd < 0 || pread_full(pfd, buf, c->len, c->off) < 0) {
+            fprintf(stderr, "restore: %s: chunk %llu is missing\n", path, (unsigned long long)i);
+            X.bad_blocks++;
+            return;
+        }
+        sha256_update(&whole, buf, c->len);
+        if (fd >= 0 && pwrite(fd, buf, c->len, off) != (ssize_t)c->len) {
+            fprintf(stderr, "restore: %s: %s\n", path, strerror(errno));
+            X.errors++;
+            return;
+        }
+        X.bytes += c->len;
+        off += c->len;
+    }
+    uint8_t sum[32];
+    sha256_final(&whole, sum);
+    if (off != en->e.size || memcmp(sum, en->hash, 32) != 0) {
+        fprintf(stderr, "restore: %s: the contents do not match their checksum\n", path);
+        X.bad_blocks++;
+    }
+}
+
+static void run_unit(const unit_t *u, z_stream *z, uint8_t *in, uint8_t *out) {
+    entry_t *en = &X.entries[u->entry];
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%.*s", (int)en->e.path_len, en->path);
+
+    int fd = -1;
+    if (!X.verify_only) {
+        fd = openat(X.dest, path, O_WRONLY | O_CREAT | O_CLOEXEC | O_NOFOLLOW, 0600);
+        if (fd < 0) {
+            fprintf(stderr, "restore: %s: %s\n", path, strerror(errno));
+            X.errors++;
+            return;
+        }
+        // the same for every unit of the file, so it does not matter which runs first
+        if (en->e.size) fallocate(fd, 0, 0, en->e.size);
+        ftruncate(fd, en->e.size);
+    }
+
+    uint64_t off = u->file_off;
+    if (X.snap) restore_chunks(en, path, fd, out);
+    for (uint64_t i = u->first; i < u->first + u->count && !X.snap; i++) {
+        csa_block_t b;
+        memcpy(&b, en->blocks + i * sizeof(b), sizeof(b));
+        if (load_block(&b, z, in, out) < 0) {
+            fprintf(stderr, "restore: %s: block %llu is damaged\n", path, (unsigned long long)i);
+            X.bad_blocks++;
+        } else if (fd >= 0 && pwrite(fd, out, b.raw_len, off) != (ssize_t)b.raw_len) {
+            fprintf(stderr, "restore: %s: %s\n", path, strerror(errno));
+            X.errors++;
+            break;
+        } else {
+            X.bytes += b.raw_len;
+        }
+        off += b.raw_len;
+    }
+
+    if (fd >= 0) {
+        if (atomic_fetch_sub(&en->units_left, 1) == 1) {
+            fchmod(fd, en->e.mode & 07777);
+            struct timespec ts[2];
+            mtime_spec(en->e.mtime_ns, ts);
+            futimens(fd, ts);
+        }
+        close(fd);
+    }
+}
+
+static void *worker(void *arg) {
+    (void)arg;
+    z_stream z = { 0 };
+    uint8_t *in = malloc(compressBound(CSA_BLOCK_SIZE)), *out = malloc(CSA_BLOCK_SIZE);
+    if (inflateInit(&z) == Z_OK) {
+        size_t i;
+        while ((i = atomic_fetch_add(&X.next_unit, 1)) < X.nunits) run_unit(&X.units[i], &z, in, out);
+        inflateEnd(&z);
+    }
+    free(in);
+    free(out);
+    return NULL;
+}
+
+// mkdir -p for the directories above path
+static void make_parents(const char *path) {
+    char buf[PATH_MAX];
+    snprintf(buf, sizeof(buf), "%s", path);
+    for (char *p = strchr(buf, '/'); p; p = strchr(p + 1, '/')) {
+        *p = '\0';
+        mkdirat(X.dest, buf, 0755);
+        *p = '/';
+    }
+}
+
+// directories and the parents of what is selected; unsafe paths are deselected
+static void make_directories(void) {
+    for (size_t i = 0; i < X.nentries; i++) {
+        entry_t *en = &X.entries[i];
+        if (!en->selected) continue;
+        if (unsafe_path(en)) {
+            fprintf(stderr, "restore: skipping unsafe path %.*s\n", (int)en->e.path_len, en->path);
+            en->selected = 0;
+            X.errors++;
+            continue;
+        }
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%.*s", (int)en->e.path_len, en->path);
+        make_parents(path);
+        if (S_ISDIR(en->e.mode) && mkdirat(X.dest, path, 0700) < 0 && errno != EEXIST) {
+            fprintf(stderr, "restore: %s: %s\n", path, strerror(errno));
+            X.errors++;
+        }
+    }
+}
+
+static void finish_links_and_dirs(void) {
+    for (size_t i = 0; i < X.nentries; i++) {
+        entry_t *en = &X.entries[i];
+        if (!en->selected || !S_ISLNK(en->e.mode)) continue;
+        char path[PATH_MAX], target[PATH_MAX];
+        snprintf(path, sizeof(path), "%.*s", (int)en->e.path_len, en->path);
+        snprintf(target, sizeof(target), "%.*s", (int)en->e.link_len, en->link);
+        unlinkat(X.dest, path, 0);
+        if (symlinkat(target, X.dest, path) < 0) {
+            fprintf(stderr, "restore: %s: %s\n", path, strerror(errno));
+            X.errors++;
+            continue;
+        }
+        set_times(X.dest, path, en->e.mtime_ns, AT_SYMLINK_NOFOLLOW);
+    }
+    // the index is in path order, so walking it backwards does children before parents
+    for (size_t i = X.nentries; i-- > 0; ) {
+        entry_t *en = &X.entries[i];
+        if (!en->selected || !S_ISDIR(en->e.mode)) continue;
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%.*s", (int)en->e.path_len, en->path);
+        fchmodat(X.dest, path, en->e.mode & 07777, 0);
+        set_times(X.dest, path, en->e.mtime_ns, 0);
+    }
+}
+
+/*
+ Read the archive on fd front to back, never seeking, and list, check or
+ write each selected entry as it goes by; the blocks of an entry follow it
+ up to the next record's tag. Directories and symlinks are kept to be
+ finished at the end by finish_links_and_dirs(). Returns how many paths
+ matched nothing; nfiles is the number of files selected.
+*/
+static int stream_archive(int fd, int list, char **paths, int npaths, size_t *nfiles) {
+    char *matched = calloc(npaths + 1, 1);
+    entry_t *late = NULL;       // directories and symlinks, paths and targets allocated
+    size_t nlate = 0, cap = 0, nentries = 0;
+    uint64_t total = 0;
+    z_stream z = { 0 };
+    uint8_t *in = malloc(compressBound(CSA_BLOCK_SIZE)), *out = malloc(CSA_BLOCK_SIZE);
+    char magic[8], path[PATH_MAX], link[PATH_MAX];
+    uint32_t tag = 0;
+    if (read_full(fd, magic, 8) < 0 || memcmp(magic, CSA_MAGIC, 8) != 0 || inflateInit(&z) != Z_OK) {
+        fprintf(stderr, "restore: -: not a backup -a archive that can be read front to back\n");
+        X.errors++;
+        goto done;
+    }
+
+    int ok = read_full(fd, &tag, 4) == 0;
+    while (ok && tag == CSA_TAG_ENTRY) {
+        entry_t en = { .e.tag = tag, .path = path, .link = link };
+        ok = read_full(fd, (char *)&en.e + 4, sizeof(en.e) - 4) == 0 &&
+             en.e.path_len < PATH_MAX && en.e.link_len < PATH_MAX &&
+             read_full(fd, path, en.e.path_len) == 0 && read_full(fd, link, en.e.link_len) == 0;
+        if (!ok) break;
+        path[en.e.path_len] = link[en.e.link_len] = '\0';
+        nentries++;
+        if (S_ISREG(en.e.mode)) total += en.e.size;
+
+        int selected = path_selected(&en, paths, npaths, matched), out_fd = -1;
+        if (selected && list) {
+            list_entry(&en);
+        } else if (selected && unsafe_path(&en)) {
+            fprintf(stderr, "restore: skipping unsafe path %s\n", path);
+            X.errors++;
+            selected = 0;
+        } else if (selected && !X.verify_only) {
+            make_parents(path);
+            if (S_ISREG(en.e.mode)) {
+                out_fd = openat(X.dest, path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_NOFOLLOW, 0600);
+                if (out_fd < 0) {
+                    fprintf(stderr, "restore: %s: %s\n", path, strerror(errno));
+                    X.errors++;
+                }
+            } else if (S_ISDIR(en.e.mode) || S_ISLNK(en.e.mode)) {
+                if (S_ISDIR(en.e.mode) && mkdirat(X.dest, path, 0700) < 0 && errno != EEXIST) {
+                    fprintf(stderr, "restore: %s: %s\n", path, strerror(errno));
+                    X.errors++;
+                }
+                if (nlate == cap) {
+                    cap = cap ? 2 * cap : 256;
+                    late = realloc(late, cap * sizeof(entry_t));
+                }
+                late[nlate] = (entry_t){ .e = en.e, .path = strdup(path), .link = strdup(link), .selected = 1 };
+                nlate++;
+            }
+        }
+        if (selected && S_ISREG(en.e.mode)) (*nfiles)++;
+
+        uint64_t off = 0, i = 0;
+        for (; (ok = read_full(fd, &tag, 4) == 0) && tag == CSA_TAG_BLOCK; i++) {
+            csa_block_t b = { .tag = tag };
+            ok = read_full(fd, (char *)&b + 4, sizeof(b) - 4) == 0 && !bad_lengths(&b) &&
+                 read_full(fd, block_buf(&b, in, out), b.comp_len) == 0;
+            if (!ok) break;
+            if (!selected || list) continue;   // read past
+            if (unpack_block(&b, &z, in, out) < 0) {
+                fprintf(stderr, "restore: %s: block %llu is damaged\n", path, (unsigned long long)i);
+                X.bad_blocks++;
+            } else if (out_fd >= 0 && pwrite(out_fd, out, b.raw_len, off) != (ssize_t)b.raw_len) {
+                fprintf(stderr, "restore: %s: %s\n", path, strerror(errno));
+                X.errors++;
+            } else {
+                X.bytes += b.raw_len;
+            }
+            off += b.raw_len;
+        }
+        if (out_fd >= 0) {
+            ftruncate(out_fd, off);   // a damaged last block leaves a hole of its size, as elsewhere
+            fchmod(out_fd, en.e.mode & 07777);
+            struct timespec ts[2];
+            mtime_spec(en.e.mtime_ns, ts);
+            futimens(out_fd, ts);
+            close(out_fd);
+        }
+    }
+    if (!ok || tag != CSA_TAG_END) {
+        fprintf(stderr, "restore: -: the archive is damaged or cut short\n");
+        X.errors++;
+    }
+    if (list) printf("%zu entries, %.1f MB\n", nentries, total / 1e6);
+
+    // the deferred entries stand in for the index
+    X.entries = late;
+    X.nentries = nlate;
+    if (!list && !X.verify_only) finish_links_and_dirs();
+    for (size_t k = 0; k < nlate; k++) {
+        free((char *)late[k].path);
+        free((char *)late[k].link);
+    }
+    inflateEnd(&z);
+done:
+    free(in);
+    free(out);
+    int missing = report_missing(paths, npaths, matched);
+    free(matched);
+    return missing;
+}
+
+static void free_state(void) {
+    if (X.fd >= 0) close(X.fd);
+    if (X.dest >= 0) close(X.dest);
+    if (X.dir >= 0) close(X.dir);
+    for (uint32_t i = 0; i < X.npacks; i++)
+        if (X.packs[i] >= 0) close(X.packs[i]);
+    free(X.index);
+    free(X.entries);
+    free(X.units);
+    free(X.chunks);
+    free(X.packs);
+}
+
+int main(int argc, char **argv) {
+    memset(&X, 0, sizeof(X));
+    X.fd = X.dest = X.dir = -1;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    const char *dest = ".";
+    int list = 0, opt;
+    while ((opt = getopt(argc, argv, "ltj:C:h")) != -1) {
+        switch (opt) {
+        case 'l': list = 1; break;
+        case 't': X.verify_only = 1; break;
+        case 'j': threads = atol(optarg); break;
+        case 'C': dest = optarg; break;
+        default:  usage(); return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (threads < 1) threads = 1;
+    if (threads > MAX_THREADS) threads = MAX_THREADS;
+
+    char file[PATH_MAX];
+    if (optind < argc) {
+        snprintf(file, sizeof(file), "%s", argv[optind++]);
+    } else if (newest_archive(file, sizeof(file)) < 0) {
+        fprintf(stderr, "restore: no archive given and none in %s\n", ARCHIVE_DIR);
+        return 1;
+    }
+    int stream = strcmp(file, "-") == 0;
+    if (!stream && load_index(file) < 0) {
+        free_state();
+        return 1;
+    }
+    if (list && !stream) {
+        list_archive();
+        free_state();
+        return 0;
+    }
+
+    int missing = stream ? 0 : select_entries(argv + optind, argc - optind);
+    if (!X.verify_only && !list) {
+        mkdir(dest, 0755);
+        X.dest = open(dest, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (X.dest < 0) {
+            fprintf(stderr, "restore: %s: %s\n", dest, strerror(errno));
+            free_state();
+            return 1;
+        }
+        if (!stream) make_directories();
+    }
+
+    double t0 = now_s();
+    size_t nfiles = 0;
+    if (stream) {
+        missing = stream_archive(STDIN_FILENO, list, argv + optind, argc - optind, &nfiles);
+        threads = 1;
+        if (list) {
+            free_state();
+            return missing || X.errors ? 1 : 0;
+        }
+    } else {
+        make_units();
+        pthread_t tids[MAX_THREADS];
+        if ((size_t)threads > X.nunits) threads = X.nunits ? X.nunits : 1;
+        for (long i = 0; i < threads; i++) pthread_create(&tids[i], NULL, worker, NULL);
+        for (long i = 0; i < threads; i++) pthread_join(tids[i], NULL);
+        if (!X.verify_only) finish_links_and_dirs();
+        for (size_t i = 0; i < X.nentries; i++) nfiles += X.entries[i].selected && S_ISREG(X.entries[i].e.mode);
+    }
+    double secs = now_s() - t0;
+
+    printf("%s %zu files, %.1f MB in %.2f s: %.1f MB/s with %ld threads\n",
+           X.verify_only ? "Verified" : "Restored", nfiles, X.bytes / 1e6, secs,
+           X.bytes / 1e6 / (secs > 0 ? secs : 1e-9), threads);
+    int status = missing ? 1 : 0;
+    if (missing) printf("%d paths were not in the archive.\n", missing);
+    if (X.bad_blocks) {
+        printf("%llu damaged %s.\n", (unsigned long long)X.bad_blocks, X.snap ? "files" : "blocks");
+        status = 1;
+    }
+    if (X.errors) {
+        printf("%llu entries could not be restored.\n", (unsigned long long)X.errors);
+        status = 1;
+    }
+    if (status == 0) printf("%s\n", X.verify_only ? "The archive is intact." : "Restore complete.");
+    free_state();
+    return status;
+}
@@ -5,8 +5,346 @@
 #include <string.h>
 #include <sys/utsname.h>
 #include <sys/sysinfo.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <time.h>
+#include <getopt.h>
+
+/*
+ sys prints a snapshot of the system; sys --watch [-i SECS] [-n COUNT]
+ keeps redrawing a compact view of CPU use per core, memory, load, and
+ disk and network rates until Ctrl-C (or COUNT frames).
+
+ The sampler is meant to be left running, so a sample costs five preads
+ and one write: the /proc files stay open and are re-read from offset 0
+ into one fixed buffer, parsed in place without allocating, and the frame
+ is formatted into another fixed buffer. Rates are computed against the
+ previous sample, kept alongside the current one.
+*/
+
+#define MAX_CPUS 256
+#define MAX_DEVS 32
+#define MAX_DISKSTATS 512
+
+typedef struct {
+    unsigned long long busy, total, user, system, iowait;
+} cpu_sample_t;
+
+typedef struct {
+    char name[32];
+    unsigned long long in, out;   // disks: sectors read and written; interfaces: bytes
+} dev_sample_t;
+
+static struct {
+    int                stat_fd, mem_fd, load_fd, disk_fd, net_fd;
+    char               buf[64 * 1024];
+    char               frame[32 * 1024];
+    size_t             frame_len;
+    int                cur;                       // which of the two samples is the new one
+    cpu_sample_t       cpu[2][MAX_CPUS + 1];      // [0] is all CPUs
+    int                ncpus[2];
+    dev_sample_t       disk[2][MAX_DEVS], net[2][MAX_DEVS];
+    int                ndisks[2], nnets[2];
+    double             when[2];
+    char               line_name[MAX_DISKSTATS][32];   // each diskstats line seen, and whether it is a disk
+    unsigned char      line_disk[MAX_DISKSTATS];
+} W;
+
+static volatile sig_atomic_t watch_stop;
+
+static void on_watch_stop(int sig) {
+    (void)sig;
+    watch_stop = 1;
+}
+
+static double mono_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// the whole file into W.buf, terminated; /proc files are regenerated on every read at 0
+static const char *read_proc(int fd) {
+    ssize_t n = fd >= 0 ? pread(fd, W.buf, sizeof(W.buf) - 1, 0) : -1;
+    W.buf[n > 0 ? n : 0] = '\0';
+    return W.buf;
+}
+
+static unsigned long long next_num(const char **pp) {
+    const char *p = *pp;
+    while (*p == ' ' || *p == '\t') p++;
+    unsigned long long v = 0;
+    while (*p >= '0' && *p <= '9') v = v * 10 + (*p++ - '0');
+    *pp = p;
+    return v;
+}
+
+static const char *next_line(const char *p) {
+    p = strchr(p, '\n');
+    return p ? p + 1 : NULL;
+}
+
+// copy the next blank-separated word into out
+static const char *next_word(const char *p, char *out, size_t n) {
+    while (*p == ' ' || *p == '\t') p++;
+    size_t len = 0;
+    while (*p && *p != ' ' && *p != '\t' && *p != '\n' && *p != ':') {
+        if (len + 1 < n) out[len++] = *p;
+        p++;
+    }
+    out[len] = '\0';
+    return p;
+}
+
+static void sample_cpus(void) {
+    int c = W.cur, n = 0;
+    for (const char *p = read_proc(W.stat_fd); p && strncmp(p, "cpu", 3) == 0; p = next_line(p)) {
+        if (n > MAX_CPUS) break;
+        p += 3;
+        while (*p && *p != ' ') p++;   // "cpu" for the total, "cpuN" for core N
+        unsigned long long f[8];
+        for (int i = 0; i < 8; i++) f[i] = next_num(&p);   // user nice system idle iowait irq softirq steal
+        cpu_sample_t *s = &W.cpu[c][n++];
+        s->total = f[0] + f[1] + f[2] + f[3] + f[4] + f[5] + f[6] + f[7];
+        s->busy = s->total - f[3] - f[4];
+        s->user = f[0] + f[1];
+        s->system = f[2] + f[5] + f[6];
+        s->iowait = f[4];
+    }
+    W.ncpus[c] = n;
+}
+
+// whole disks only: partitions would count the same I/O twice
+static int is_disk(const char *name) {
+    char path[64];
+    if (strncmp(name, "loop", 4) == 0 || strncmp(name, "ram", 3) == 0) return 0;
+    snprintf(path, sizeof(path), "/sys/block/%s", name);
+    return access(path, F_OK) == 0;
+}
+
+static void sample_disks(void) {
+    int c = W.cur, n = 0, line = 0;
+    for (const char *p = read_proc(W.disk_fd); p && *p && n < MAX_DEVS; p = next_line(p), line++) {
+        dev_sample_t *d = &W.disk[c][n];
+        next_num(&p);
+        next_num(&p);
+        p = next_word(p, d->name, sizeof(d->name));
+        unsigned long long f[7];
+        for (int i = 0; i < 7; i++) f[i] = next_num(&p);   // reads merged sectors ms writes merged sectors
+        d->in = f[2];
+        d->out = f[6];
+        // the lines hardly change, so /sys is only asked about a name that is new on its line
+        if (line >= MAX_DISKSTATS) {
+            n += is_disk(d->name);
+        } else {
+            if (strcmp(W.line_name[line], d->name) != 0) {
+                memcpy(W.line_name[line], d->name, sizeof(d->name));
+                W.line_disk[line] = is_disk(d->name);
+            }
+            n += W.line_disk[line];
+        }
+    }
+    W.ndisks[c] = n;
+}
+
+static void sample_net(void) {
+    int c = W.cur, n = 0;
+    const char *p = next_line(read_proc(W.net_fd));
+    p = p ? next_line(p) : NULL;   // two header lines
+    for (; p && *p && n < MAX_DEVS; p = next_line(p)) {
+        dev_sample_t *d = &W.net[c][n++];
+        p = next_word(p, d->name, sizeof(d->name));
+        if (*p == ':') p++;
+        unsigned long long f[9];
+        for (int i = 0; i < 9; i++) f[i] = next_num(&p);   // rx: bytes packets errs drop fifo frame compressed multicast; tx: bytes
+        d->in = f[0];
+        d->out = f[8];
+    }
+    W.nnets[c] = n;
+}
+
+static void put(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+static void put(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(W.frame + W.frame_len, sizeof(W.frame) - W.frame_len, fmt, ap);
+    va_end(ap);
+    if (n > 0) W.frame_len += (size_t)n < sizeof(W.frame) - W.frame_len ? (size_t)n : sizeof(W.frame) - W.frame_len - 1;
+}
+
+static double pct(unsigned long long part, unsigned long long whole) {
+    return whole ? 100.0 * part / whole : 0.0;
+}
+
+static const dev_sample_t *find_dev(const dev_sample_t *devs, int n, const char *name) {
+    for (int i = 0; i < n; i++)
+        if (strcmp(devs[i].name, name) == 0) return &devs[i];
+    return NULL;
+}
+
+// on a terminal every line overwrites the last frame's, then the rest is cleared
+static void draw(int tty, double interval) {
+    int c = W.cur, p = !c;
+    double dt = W.when[c] - W.when[p];
+    const char *eol = tty ? "\x1b[K\n" : "\n";
+    W.frame_len = 0;
+    if (tty) put("\x1b[H");
+
+    struct sysinfo si;
+    char load[64] = "";
+    sysinfo(&si);
+    const char *l = read_proc(W.load_fd);
+    for (int i = 0, fields = 0; l[i] && l[i] != '\n' && i < (int)sizeof(load) - 1; i++) {
+        if (l[i] == ' ' && ++fields == 3) break;
+        load[i] = l[i];
+    }
+    long up = si.uptime;
+    put("every %.1fs   up %ld days, %02ld:%02ld   load %s%s", interval, up / 86400, up % 86400 / 3600,
+        up % 3600 / 60, load, eol);
+
+    if (W.ncpus[p] == W.ncpus[c] && W.ncpus[c] > 0) {
+        const cpu_sample_t *a = &W.cpu[p][0], *b = &W.cpu[c][0];
+        unsigned long long total = b->total - a->total;
+        double busy = pct(b->busy - a->busy, total);
+        char bar[41];
+        int fill = (int)(busy * 40 / 100 + 0.5);
+        for (int i = 0; i < 40; i++) bar[i] = i < fill ? '#' : '.';
+        bar[40] = '\0';
+        put("CPU  %5.1f%% [%s]  usr %.1f%%  sys %.1f%%  iowait %.1f%%%s", busy, bar,
+            pct(b->user - a->user, total), pct(b->system - a->system, total),
+            pct(b->iowait - a->iowait, total), eol);
+        for (int i = 1; i < W.ncpus[c]; i++) {
+            a = &W.cpu[p][i];
+            b = &W.cpu[c][i];
+            put("  cpu%-3d %5.1f%%", i - 1, pct(b->busy - a->busy, b->total - a->total));
+            if (i % 6 == 0 || i == W.ncpus[c] - 1) put("%s", eol);
+        }
+    }
+
+    unsigned long long total = 0, avail = 0, cached = 0, buffers = 0, swap_total = 0, swap_free = 0;
+    for (const char *m = read_proc(W.mem_fd); m && *m; m = next_line(m)) {
+        unsigned long long *dst = strncmp(m, "MemTotal:", 9) == 0     ? &total
+                                  : strncmp(m, "MemAvailable:", 13) == 0 ? &avail
+                                  : strncmp(m, "Cached:", 7) == 0        ? &cached
+                                  : strncmp(m, "Buffers:", 8) == 0       ? &buffers
+                                  : strncmp(m, "SwapTotal:", 10) == 0    ? &swap_total
+                                  : strncmp(m, "SwapFree:", 9) == 0      ? &swap_free
+                                                                          : NULL;
+        if (!dst) continue;
+        const char *v = strchr(m, ':') + 1;
+        *dst = next_num(&v);
+    }
+    const double GB = 1024.0 * 1024.0;   // meminfo is in KB
+    put("Mem  %.2f / %.2f GB used (%.0f%%)   available %.2f GB   cache %.2f GB   swap %.2f / %.2f GB%s",
+        (total - avail) / GB, total / GB, pct(total - avail, total), avail / GB, (cached + buffers) / GB,
+        (swap_total - swap_free) / GB, swap_total / GB, eol);
+
+    for (int i = 0; i < W.ndisks[c]; i++) {
+        const dev_sample_t *b = &W.disk[c][i], *a = find_dev(W.disk[p], W.ndisks[p], b->name);
+        if (!a) continue;
+        put("Disk %-10s read %8.2f MB/s   write %8.2f MB/s%s", b->name, (b->in - a->in) * 512 / 1e6 / dt,
+            (b->out - a->out) * 512 / 1e6 / dt, eol);
+    }
+    for (int i = 0; i < W.nnets[c]; i++) {
+        const dev_sample_t *b = &W.net[c][i], *a = find_dev(W.net[p], W.nnets[p], b->name);
+        if (!a) continue;
+        put("Net  %-10s rx   %8.1f KB/s   tx    %8.1f KB/s%s", b->name, (b->in - a->in) / 1e3 / dt,
+            (b->out - a->out) / 1e3 / dt, eol);
+    }
+    put(tty ? "\x1b[J" : "\n");
+
+    for (size_t off = 0; off < W.frame_len; ) {
+        ssize_t n = write(STDOUT_FILENO, W.frame + off, W.frame_len - off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        off += n;
+    }
+}
+
+static void sample(void) {
+    W.cur = !W.cur;
+    W.when[W.cur] = mono_now();
+    sample_cpus();
+    sample_disks();
+    sample_net();
+}
+
+static int watch(double interval, long count) {
+    memset(&W, 0, sizeof(W));
+    W.stat_fd = open("/proc/stat", O_RDONLY | O_CLOEXEC);
+    W.mem_fd = open("/proc/meminfo", O_RDONLY | O_CLOEXEC);
+    W.load_fd = open("/proc/loadavg", O_RDONLY | O_CLOEXEC);
+    W.disk_fd = open("/proc/diskstats", O_RDONLY | O_CLOEXEC);
+    W.net_fd = open("/proc/net/dev", O_RDONLY | O_CLOEXEC);
+    if (W.stat_fd < 0 || W.mem_fd < 0) {
+        perror("sys: /proc");
+        return EXIT_FAILURE;
+    }
+
+    // Ctrl-C ends the watch, not the process: sys may be running inside the shell
+    struct sigaction sa = { .sa_handler = on_watch_stop }, old;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, &old);
+    watch_stop = 0;
+
+    int tty = isatty(STDOUT_FILENO);
+    static const char hide_and_clear[] = "\x1b[?25l\x1b[H\x1b[2J", show[] = "\x1b[?25h";
+    if (tty && write(STDOUT_FILENO, hide_and_clear, sizeof(hide_and_clear) - 1) < 0) tty = 0;
+
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    sample();
+    for (long frames = 0; !watch_stop && (count <= 0 || frames < count); frames++) {
+        next.tv_sec += (time_t)interval;
+        next.tv_nsec += (long)((interval - (time_t)interval) * 1e9);
+        if (next.tv_nsec >= 1000000000) {
+            next.tv_sec++;
+            next.tv_nsec -= 1000000000;
+        }
+        while (!watch_stop && clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR) {}
+        if (watch_stop) break;
+        sample();
+        draw(tty, interval);
+    }
+
+    if (tty && write(STDOUT_FILENO, show, sizeof(show) - 1) < 0) {}
+    sigaction(SIGINT, &old, NULL);
+    int fds[] = { W.stat_fd, W.mem_fd, W.load_fd, W.disk_fd, W.net_fd };
+    for (int i = 0; i < 5; i++)
+        if (fds[i] >= 0) close(fds[i]);
+    return EXIT_SUCCESS;
+}
+
+static void usage(void) {
+    printf("Usage: sys [--watch [-i seconds] [-n count]], to show system information\n");
+    printf("  -w, --watch  keep showing CPU, memory, load, disk and network use\n");
+    printf("  -i SECS      seconds between updates (default 1)\n");
+    printf("  -n COUNT     stop after COUNT updates\n");
+}
+
+int main(int argc, char **argv) {
+    static const struct option longopts[] = {
+        { "watch", no_argument, NULL, 'w' },
+        { NULL, 0, NULL, 0 },
+    };
+    int watching = 0, opt;
+    double interval = 1.0;
+    long count = 0;
+    while ((opt = getopt_long(argc, argv, "wi:n:", longopts, NULL)) != -1) {
+        switch (opt) {
+        case 'w': watching = 1; break;
+        case 'i': interval = atof(optarg); break;
+        case 'n': count = atol(optarg); break;
+        default:  usage(); return EXIT_FAILURE;
+        }
+    }
+    if (watching) {
+        if (interval < 0.01) interval = 0.01;
+        return watch(interval, count);
+    }
 
-int main(void) {
     struct utsname uts;
     if (uname(&uts) < 0) {
         perror("uname");
@@ -34,3 +34,9 @@
 #define COLOR_MAGENTA "\x1b[35m"
 #define COLOR_CYAN "\x1b[36m"
 #define COLOR_RESET "\x1b[0m"
+
+#ifdef MULTICALL
+/* built into cseshell (see source/multicall.h): exit() returns to the shell */
+void sysprog_exit(int status) __attribute__((noreturn));
+#define exit(status) sysprog_exit(status)
+#endif